@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compares the chunkers on the same corpus.  The corpus is a base buffer
+ * followed by an edited copy (bytes inserted, deleted and overwritten at
+ * random offsets) and the dedup ratio is the fraction of the corpus that is
+ * stored once duplicate chunks are removed.
+ *
+ * Usage: chunker_bench [MB]
+ */
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <time.h>
+#include <sys/time.h>
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "rkchunker.h"
+#include "gearchunker.h"
+
+#define EDIT_COUNT 256
+#define EDIT_MAXLEN 64
+
+class BenchCB : public ChunkerCB
+{
+public:
+    BenchCB(uint8_t *b, uint64_t l) : buf(b), len(l), loaded(false) { }
+    virtual void match(const uint8_t *b, uint32_t l)
+    {
+        chunks.push_back(l);
+    }
+    virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
+    {
+        if (loaded)
+            return 0;
+
+        *b = buf;
+        *l = len;
+        *o = 0;
+        loaded = true;
+        return 1;
+    }
+    std::vector<uint32_t> chunks;
+private:
+    uint8_t *buf;
+    uint64_t len;
+    bool loaded;
+};
+
+static double
+now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Returns the number of bytes left after removing duplicate chunks.
+ */
+static uint64_t
+uniqueBytes(const uint8_t *buf, const std::vector<uint32_t> &chunks)
+{
+    std::set<std::string> seen;
+    uint64_t off = 0;
+    uint64_t unique = 0;
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+
+        SHA256(buf + off, chunks[i], hash);
+        if (seen.insert(std::string((char *)hash, sizeof(hash))).second)
+            unique += chunks[i];
+        off += chunks[i];
+    }
+
+    return unique;
+}
+
+template <class C>
+static void
+runBench(const char *name, C &c, uint8_t *buf, uint64_t len)
+{
+    BenchCB cb = BenchCB(buf, len);
+    double start, end;
+    uint64_t total = 0;
+
+    start = now();
+    c.chunk(&cb);
+    end = now();
+
+    for (size_t i = 0; i < cb.chunks.size(); i++)
+        total += cb.chunks[i];
+    assert(total == len);
+
+    printf("%-12s Chunks %8zu, Avg Chunk %6" PRIu64 ", Speed %5.2f GB/s, "
+           "Dedup %5.3f\n",
+           name, cb.chunks.size(), len / cb.chunks.size(),
+           len / (end - start) / 1e9,
+           (double)uniqueBytes(buf, cb.chunks) / len);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t baseLen = 256;
+    std::vector<uint8_t> base;
+    std::vector<uint8_t> corpus;
+
+    if (argc > 1)
+        baseLen = strtoull(argv[1], NULL, 10);
+    baseLen *= 1024 * 1024;
+
+    srand(42);
+    base.resize(baseLen);
+    for (uint64_t i = 0; i < baseLen; i++)
+        base[i] = rand() % 256;
+    corpus = base;
+
+    // Append an edited copy of the base
+    std::vector<uint64_t> edits;
+    for (int i = 0; i < EDIT_COUNT; i++)
+        edits.push_back(((uint64_t)rand() * RAND_MAX + rand()) % baseLen);
+    std::sort(edits.begin(), edits.end());
+
+    uint64_t off = 0;
+    for (size_t i = 0; i < edits.size(); i++) {
+        uint64_t editLen = 1 + rand() % EDIT_MAXLEN;
+
+        if (edits[i] > off)
+            corpus.insert(corpus.end(), base.begin() + off,
+                          base.begin() + edits[i]);
+        off = std::max(off, edits[i]);
+        switch (rand() % 3) {
+            case 0: // Insert
+                for (uint64_t j = 0; j < editLen; j++)
+                    corpus.push_back(rand() % 256);
+                break;
+            case 1: // Delete
+                off += editLen;
+                break;
+            case 2: // Overwrite
+                for (uint64_t j = 0; j < editLen; j++)
+                    corpus.push_back(rand() % 256);
+                off += editLen;
+                break;
+        }
+        if (off > baseLen)
+            off = baseLen;
+    }
+    corpus.insert(corpus.end(), base.begin() + off, base.end());
+
+    printf("Corpus %" PRIu64 " bytes, %d edits\n",
+           (uint64_t)corpus.size(), EDIT_COUNT);
+
+    RKChunker<4096, 2048, 8192> rk = RKChunker<4096, 2048, 8192>();
+    runBench("RK", rk, corpus.data(), corpus.size());
+
+    GearChunker<4096, 2048, 8192> gear;
+    runBench("Gear", gear, corpus.data(), corpus.size());
+
+    GearChunker<4096, 2048, 8192> gearScalar;
+    gearScalar.disableSIMD();
+    runBench("Gear scalar", gearScalar, corpus.data(), corpus.size());
+
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Implements a FastCDC style content defined chunker
+ *
+ * The Gear hash shifts left once per byte and adds a random value for the
+ * byte, so the hash at a position only depends on the preceding 64 bytes and
+ * needs no modulo or lookup table removal.  Cut points are found by masking:
+ * hashing starts min bytes into a chunk, a mask with two extra bits is used
+ * until target bytes and a mask with two fewer bits afterwards (normalized
+ * chunking), which keeps chunk sizes close to target.
+ *
+ * The boundaries only depend on the data, the AVX2 scanner evaluates four
+ * interleaved blocks at once and always returns the same cut point as the
+ * scalar code.
+ */
+
+#ifndef __GEARCHUNKER_H__
+#define __GEARCHUNKER_H__
+
+#include <assert.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define GEAR_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#include "chunker.h"
+
+/// Bytes of history that determine a Gear hash value
+#define GEAR_WINDOW 64
+/// Positions hashed by one AVX2 lane per window
+#define GEAR_AVX2_BLOCK 128
+/// Positions scanned by one AVX2 window (four lanes)
+#define GEAR_AVX2_SPAN (4 * GEAR_AVX2_BLOCK)
+
+template<int target, int min, int max>
+class GearChunker
+{
+public:
+    GearChunker();
+    ~GearChunker();
+    void chunk(ChunkerCB *cb);
+    /// Force the portable code path (for testing and benchmarks)
+    void disableSIMD() { useAVX2 = false; }
+    /// @returns the length of the first chunk of the n bytes at p
+    uint64_t findCut(const uint8_t *p, uint64_t n) const;
+private:
+    uint64_t gear[256];
+    uint64_t maskS;
+    uint64_t maskL;
+    bool useAVX2;
+
+    static uint64_t spreadMask(int bits);
+    uint64_t hashAt(const uint8_t *p, uint64_t from, uint64_t i) const;
+    uint64_t scan(const uint8_t *p, uint64_t from, uint64_t begin,
+                  uint64_t end, uint64_t mask) const;
+#ifdef GEAR_HAVE_AVX2
+    uint64_t scanAVX2(const uint8_t *p, uint64_t from, uint64_t begin,
+                      uint64_t end, uint64_t mask) const;
+#endif
+};
+
+template<int target, int min, int max>
+GearChunker<target, min, max>::GearChunker()
+{
+    static_assert(min + 2 * GEAR_WINDOW <= target && target < max,
+                  "GearChunker requires min < target < max");
+    static_assert((target & (target - 1)) == 0,
+                  "GearChunker target must be a power of two");
+
+    /*
+     * The table must never change since it determines the chunk boundaries
+     * and thereby deduplication against existing repositories.  It is
+     * generated with splitmix64 from a fixed seed.
+     */
+    uint64_t seed = 0x6f72694765617221ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+
+    int bits = 0;
+    while ((1 << bits) < target)
+        bits++;
+    maskS = spreadMask(bits + 2);
+    maskL = spreadMask(bits - 2);
+
+#ifdef GEAR_HAVE_AVX2
+    useAVX2 = __builtin_cpu_supports("avx2");
+#else
+    useAVX2 = false;
+#endif
+}
+
+template<int target, int min, int max>
+GearChunker<target, min, max>::~GearChunker()
+{
+}
+
+/*
+ * Spread the mask bits over the upper 48 bits of the hash, the high bits have
+ * seen the most bytes.
+ */
+template<int target, int min, int max>
+uint64_t GearChunker<target, min, max>::spreadMask(int bits)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < bits; i++)
+        mask |= 1ULL << (63 - (i * 48) / bits);
+    return mask;
+}
+
+/*
+ * Hash at position i when hashing started at position from.
+ */
+template<int target, int min, int max>
+uint64_t GearChunker<target, min, max>::hashAt(const uint8_t *p,
+                                               uint64_t from,
+                                               uint64_t i) const
+{
+    uint64_t h = 0;
+    uint64_t j = (i + 1 - from > GEAR_WINDOW) ? i + 1 - GEAR_WINDOW : from;
+    for (; j <= i; j++)
+        h = (h << 1) + gear[p[j]];
+    return h;
+}
+
+/*
+ * Returns the first position in [begin, end) whose hash matches the mask, or
+ * end.  Hashing started at position from.
+ */
+template<int target, int min, int max>
+uint64_t GearChunker<target, min, max>::scan(const uint8_t *p,
+                                             uint64_t from,
+                                             uint64_t begin,
+                                             uint64_t end,
+                                             uint64_t mask) const
+{
+    uint64_t h = (begin > from) ? hashAt(p, from, begin - 1) : 0;
+    uint64_t i = begin;
+
+#ifdef GEAR_HAVE_AVX2
+    if (useAVX2) {
+        // The lanes need a full window of history before their blocks
+        for (; i < end && i < from + GEAR_WINDOW - 1; i++) {
+            h = (h << 1) + gear[p[i]];
+            if ((h & mask) == 0)
+                return i;
+        }
+        if (end - i >= GEAR_AVX2_SPAN)
+            return scanAVX2(p, from, i, end, mask);
+    }
+#endif
+
+    for (; i < end; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h & mask) == 0)
+            return i;
+    }
+
+    return end;
+}
+
+#ifdef GEAR_HAVE_AVX2
+/*
+ * Each window is split into four blocks of GEAR_AVX2_BLOCK positions that are
+ * hashed in parallel lanes.  A lane first rolls over the GEAR_WINDOW - 1
+ * bytes preceding its block, which reproduces the scalar hash exactly, and
+ * the first match of the lowest lane is the cut point.
+ */
+template<int target, int min, int max>
+__attribute__((target("avx2")))
+uint64_t GearChunker<target, min, max>::scanAVX2(const uint8_t *p,
+                                                 uint64_t from,
+                                                 uint64_t begin,
+                                                 uint64_t end,
+                                                 uint64_t mask) const
+{
+    const __m256i vmask = _mm256_set1_epi64x(mask);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t base = begin;
+
+    for (; base + GEAR_AVX2_SPAN <= end; base += GEAR_AVX2_SPAN) {
+        const uint8_t *b0 = p + base;
+        const uint8_t *b1 = b0 + GEAR_AVX2_BLOCK;
+        const uint8_t *b2 = b1 + GEAR_AVX2_BLOCK;
+        const uint8_t *b3 = b2 + GEAR_AVX2_BLOCK;
+        __m256i h = zero;
+        int t;
+
+        for (t = 1 - GEAR_WINDOW; t < 0; t++) {
+            __m256i g = _mm256_set_epi64x(gear[b3[t]], gear[b2[t]],
+                                          gear[b1[t]], gear[b0[t]]);
+            h = _mm256_add_epi64(_mm256_slli_epi64(h, 1), g);
+        }
+
+        int first[4] = { -1, -1, -1, -1 };
+        int found = 0;
+        for (t = 0; t < GEAR_AVX2_BLOCK; t++) {
+            __m256i g = _mm256_set_epi64x(gear[b3[t]], gear[b2[t]],
+                                          gear[b1[t]], gear[b0[t]]);
+            h = _mm256_add_epi64(_mm256_slli_epi64(h, 1), g);
+
+            __m256i hit = _mm256_cmpeq_epi64(_mm256_and_si256(h, vmask),
+                                             zero);
+            int bits = _mm256_movemask_pd(_mm256_castsi256_pd(hit)) & ~found;
+            if (bits != 0) {
+                for (int l = 0; l < 4; l++) {
+                    if (bits & (1 << l))
+                        first[l] = t;
+                }
+                found |= bits;
+                // Nothing can precede a hit in the first block
+                if (found & 1)
+                    break;
+            }
+        }
+
+        for (int l = 0; l < 4; l++) {
+            if (first[l] >= 0)
+                return base + l * GEAR_AVX2_BLOCK + first[l];
+        }
+    }
+
+    // Finish the remainder with the portable code
+    uint64_t h = hashAt(p, from, base - 1);
+    for (; base < end; base++) {
+        h = (h << 1) + gear[p[base]];
+        if ((h & mask) == 0)
+            return base;
+    }
+
+    return end;
+}
+#endif
+
+template<int target, int min, int max>
+uint64_t GearChunker<target, min, max>::findCut(const uint8_t *p,
+                                                uint64_t n) const
+{
+    if (n <= min)
+        return n;
+
+    uint64_t normal = (n < (uint64_t)target) ? n : target;
+    uint64_t limit = (n < (uint64_t)max) ? n : max;
+    uint64_t i;
+
+    i = scan(p, min, min, normal, maskS);
+    if (i < normal)
+        return i + 1;
+
+    i = scan(p, min, normal, limit, maskL);
+    if (i < limit)
+        return i + 1;
+
+    return limit;
+}
+
+template<int target, int min, int max>
+void GearChunker<target, min, max>::chunk(ChunkerCB *cb)
+{
+    uint8_t *in = nullptr;
+    uint64_t len = 0;
+    uint64_t off = 0;
+    uint64_t start = 0;
+
+    if (cb->load(&in, &len, &off) == 0) {
+        assert(false);
+        return;
+    }
+
+fastPath:
+    /*
+     * A whole maximum sized chunk is available, cut points never depend on
+     * where the buffer ends.
+     */
+    while (off + max < len) {
+        off += findCut(in + off, max);
+        cb->match(in + start, off - start);
+        start = off;
+    }
+
+    if (cb->load(&in, &len, &off) == 1) {
+        start = off;
+        goto fastPath;
+    }
+
+    while (off < len) {
+        off += findCut(in + off, len - off);
+        cb->match(in + start, off - start);
+        start = off;
+    }
+
+    return;
+}
+
+#endif /* __GEARCHUNKER_H__ */
+
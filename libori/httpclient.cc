@@ -39,6 +39,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/orinet.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
 #include <ori/httpclient.h>
 #include <ori/httprepo.h>
 
@@ -136,6 +137,8 @@ struct RequestCB
 {
     HttpClient *client;
     string *response;
+    /// 0 once a successful response was received
+    int status;
 };
 
 void
@@ -177,6 +180,7 @@ HttpClient_requestDoneCB(struct evhttp_request *req, void *r)
     }
 
     cb->response->assign(data, len);
+    cb->status = 0;
 
     event_base_loopexit(client->base, nullptr);
 }
@@ -190,6 +194,7 @@ HttpClient::getRequest(const string &command, string &response)
 
     cb.client = this;
     cb.response = &response;
+    cb.status = -1;
     req = evhttp_request_new(HttpClient_requestDoneCB, (void *)&cb);
 
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
@@ -204,7 +209,7 @@ HttpClient::getRequest(const string &command, string &response)
     // XXX: Create dedicated event loop
     event_base_dispatch(base);
 
-    return 0;
+    return cb.status;
 }
 
 int
@@ -215,6 +220,7 @@ HttpClient::postRequest(const string &url,
     RequestCB cb;
     cb.client = this;
     cb.response = &response;
+    cb.status = -1;
 
     struct evhttp_request *req = evhttp_request_new(
             HttpClient_requestDoneCB, &cb);
@@ -234,9 +240,177 @@ HttpClient::postRequest(const string &url,
     // XXX: Create dedicated event loop
     event_base_dispatch(base);
 
+    return cb.status;
+}
+
+/*
+ * Response body of HttpClient::postStream.  The event loop only runs while
+ * the reader waits for data, so at most one read from the socket is buffered
+ * and a slow reader holds back the server through TCP flow control.
+ */
+class HttpStream : public bytestream
+{
+public:
+    HttpStream(HttpClient *client);
+    ~HttpStream();
+    bool ended() override;
+    size_t read(uint8_t *out, size_t n) override;
+    size_t sizeHint() const override;
+private:
+    bool pump();
+    HttpClient *client;
+    struct evhttp_request *req;
+    struct evbuffer *buf;
+    /// HTTP status once the headers arrived, -1 before and on errors
+    int status;
+    bool done;
+    friend class HttpClient;
+    friend int HttpStream_headerCB(struct evhttp_request *, void *);
+    friend void HttpStream_chunkCB(struct evhttp_request *, void *);
+    friend void HttpStream_errorCB(enum evhttp_request_error, void *);
+    friend void HttpStream_doneCB(struct evhttp_request *, void *);
+};
+
+int
+HttpStream_headerCB(struct evhttp_request *req, void *arg)
+{
+    HttpStream *s = (HttpStream *)arg;
+
+    s->status = evhttp_request_get_response_code(req);
     return 0;
 }
 
+void
+HttpStream_chunkCB(struct evhttp_request *req, void *arg)
+{
+    HttpStream *s = (HttpStream *)arg;
+    struct evbuffer *bufIn = evhttp_request_get_input_buffer(req);
+
+    if (s->status == HTTP_OK)
+        evbuffer_add_buffer(s->buf, bufIn);
+    else
+        evbuffer_drain(bufIn, evbuffer_get_length(bufIn));
+}
+
+void
+HttpStream_errorCB(enum evhttp_request_error err, void *arg)
+{
+    HttpStream *s = (HttpStream *)arg;
+
+    if (err != EVREQ_HTTP_REQUEST_CANCEL)
+        WARNING("HTTP response failed (error %d)", (int)err);
+    s->status = -1;
+    s->req = nullptr;
+    s->done = true;
+}
+
+void
+HttpStream_doneCB(struct evhttp_request *req, void *arg)
+{
+    HttpStream *s = (HttpStream *)arg;
+
+    if (req && s->status == HTTP_OK)
+        HttpStream_chunkCB(req, arg);
+    else
+        s->status = -1;
+    s->req = nullptr;
+    s->done = true;
+}
+
+HttpStream::HttpStream(HttpClient *client)
+    : client(client), req(nullptr), buf(evbuffer_new()), status(-1),
+      done(false)
+{
+}
+
+HttpStream::~HttpStream()
+{
+    // Let a fully read response complete so the connection can be reused
+    while (req && evbuffer_get_length(buf) == 0 && pump()) {
+    }
+    if (req)
+        evhttp_cancel_request(req);
+    evbuffer_free(buf);
+}
+
+/*
+ * Runs the event loop once, @returns false once the response is complete.
+ */
+bool
+HttpStream::pump()
+{
+    if (done)
+        return false;
+    if (event_base_loop(client->base, EVLOOP_ONCE) != 0 && !done) {
+        WARNING("HTTP client has no pending events");
+        status = -1;
+        done = true;
+    }
+
+    return true;
+}
+
+bool
+HttpStream::ended()
+{
+    while (evbuffer_get_length(buf) == 0 && pump()) {
+    }
+
+    return evbuffer_get_length(buf) == 0;
+}
+
+size_t
+HttpStream::read(uint8_t *out, size_t n)
+{
+    while (evbuffer_get_length(buf) == 0 && pump()) {
+    }
+
+    int len = evbuffer_remove(buf, out, n);
+    return len < 0 ? 0 : len;
+}
+
+size_t
+HttpStream::sizeHint() const
+{
+    return 0;
+}
+
+bytestream *
+HttpClient::postStream(const string &url, const string &payload)
+{
+    HttpStream *s = new HttpStream(this);
+
+    struct evhttp_request *req = evhttp_request_new(HttpStream_doneCB, s);
+    evhttp_request_set_header_cb(req, HttpStream_headerCB);
+    evhttp_request_set_chunked_cb(req, HttpStream_chunkCB);
+    evhttp_request_set_error_cb(req, HttpStream_errorCB);
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Connection", "keep-alive");
+
+    struct evbuffer *outbuf = evhttp_request_get_output_buffer(req);
+    evbuffer_add(outbuf, payload.data(), payload.size());
+
+    int status = evhttp_make_request(con, req, EVHTTP_REQ_POST, url.c_str());
+    if (status < 0) {
+        WARNING("HTTP request failure!");
+        delete s;
+        return nullptr;
+    }
+    s->req = req;
+
+    // Wait for the headers
+    while (s->status == -1 && s->pump()) {
+    }
+    if (s->status != HTTP_OK) {
+        WARNING("HTTP request failed!");
+        delete s;
+        return nullptr;
+    }
+
+    return s;
+}
+
 int
 HttpClient::putRequest(const string &command,
                        const string &payload,
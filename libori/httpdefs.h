@@ -25,6 +25,8 @@
 #define ORIHTTP_PATH_COMMITS    "/commits"
 #define ORIHTTP_PATH_CONTAINS   "/contains"
 #define ORIHTTP_PATH_GETOBJS    "/getobjs"
+#define ORIHTTP_PATH_GETMISSING "/getmissing"
+#define ORIHTTP_PATH_OBJFILTER  "/objfilter"
 #define ORIHTTP_PATH_OBJINFO    "/objinfo/"
 
 #endif /* __HTTPDEFS_H__ */
@@ -31,6 +31,7 @@
 #include <openssl/sha.h>
 
 #include <oriutil/debug.h>
+#include <oriutil/codec.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
 #include <ori/object.h>
@@ -112,34 +113,14 @@ HttpRepo::getObject(const ObjectHash &id)
     objs.push_back(id);
     bytestream::ap bs(getObjects(objs));
     if (bs.get()) {
-        numobjs_t num = bs->readUInt32();
-        ASSERT(num == 1);
-
-        std::string info_str(ObjectInfo::SIZE, '\0');
-        bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
-        ObjectInfo info;
-        info.fromString(info_str);
-
-        uint32_t objSize = bs->readUInt32();
-        std::string payload(objSize, '\0');
-        bs->readExact((uint8_t*)&payload[0], objSize);
-
-        num = bs->readUInt32();
-        ASSERT(num == 0);
-
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
-        return Object::sp(new HttpObject(this, info));
+        GroupReader gr(bs.get());
+        // The remote leaves out objects it does not have
+        if (!gr.nextGroup())
+            return Object::sp();
+
+        pair<ObjectInfo, string> o = gr.readObject();
+        payloads[o.first.hash] = o.second;
+        return Object::sp(new HttpObject(this, o.first));
     }
     return Object::sp();
 }
@@ -215,14 +196,44 @@ HttpRepo::getObjects(const ObjectHashVec &vec) {
         ss.writeHash(vec[i]);
     }
 
-    string resp;
-    int status = client->postRequest(ORIHTTP_PATH_GETOBJS, ss.str(), resp);
-    bytestream::ap bs(new strstream(resp));
+    return client->postStream(ORIHTTP_PATH_GETOBJS, ss.str());
+}
 
-    if (status == 0) {
-        return bs.release();
+/*
+ * Servers without /getmissing reply 404, in which case the caller falls back
+ * to walking the remote history itself.
+ */
+bytestream *
+HttpRepo::getMissingObjects(const ObjectHashVec &wants,
+                            const ObjectHashVec &haves)
+{
+    strwstream ss;
+    ss.writeUInt32(wants.size());
+    for (size_t i = 0; i < wants.size(); i++) {
+        ss.writeHash(wants[i]);
+    }
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+
+    return client->postStream(ORIHTTP_PATH_GETMISSING, ss.str());
+}
+
+ObjectFilter::sp
+HttpRepo::getObjectFilter()
+{
+    string blob;
+    int status = client->getRequest(ORIHTTP_PATH_OBJFILTER, blob);
+    if (status != 0) {
+        return ObjectFilter::sp();
+    }
+
+    ObjectFilter::sp filter(new ObjectFilter());
+    if (!filter->fromBlob(blob)) {
+        return ObjectFilter::sp();
     }
-    return nullptr;
+    return filter;
 }
 
 std::set<ObjectInfo>
@@ -45,6 +45,7 @@
 #include <ori/localrepo.h>
 #include <ori/httpserver.h>
 
+#include "tuneables.h"
 #include "evbufstream.h"
 #include "httpdefs.h"
 
@@ -122,6 +123,8 @@ HTTPServer::entry(struct evhttp_request *req)
      * /commits
      * /contains
      * /getobjs
+     * /getmissing
+     * /objfilter
      * /objs/...
      * /objinfo/...
      */
@@ -145,6 +148,10 @@ HTTPServer::entry(struct evhttp_request *req)
         contains(req);
     } else if (url == ORIHTTP_PATH_GETOBJS) {
         getObjs(req);
+    } else if (url == ORIHTTP_PATH_GETMISSING) {
+        getMissing(req);
+    } else if (url == ORIHTTP_PATH_OBJFILTER) {
+        getObjFilter(req);
     } else if (OriStr_StartsWith(url, "/objs/")) {
         evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
         return;
@@ -366,12 +373,113 @@ HTTPServer::getObjs(struct evhttp_request *req)
 
 
     // Transmit
-    evbufwstream out;
-    repo.transmit(&out, objs);
+    sendStream(req, repo.getObjects(objs));
+}
+
+void
+HTTPServer::getMissing(struct evhttp_request *req)
+{
+    evbuffer *buf = evhttp_request_get_input_buffer(req);
+    evbufstream in(buf);
+    ObjectHashVec wants, haves;
+
+    uint32_t numWants = in.readUInt32();
+    for (uint32_t i = 0; i < numWants; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        wants.push_back(hash);
+    }
+    uint32_t numHaves = in.readUInt32();
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+
+    DLOG("httpd: getMissing %u wants %u haves", numWants, numHaves);
+
+    // Transmit
+    sendStream(req, repo.getMissingObjects(wants, haves));
+}
+
+/*
+ * A reply being streamed by HTTPServer::sendStream
+ */
+struct HTTPStreamReply {
+    struct evhttp_request *req;
+    bytestream *bs;
+};
+
+static void
+HTTPStreamReply_closeCB(struct evhttp_connection *evcon, void *arg)
+{
+    HTTPStreamReply *r = (HTTPStreamReply *)arg;
+
+    DLOG("httpd: connection closed during a streamed reply");
+    delete r->bs;
+    delete r;
+}
+
+static void
+HTTPStreamReply_chunkCB(struct evhttp_connection *evcon, void *arg)
+{
+    HTTPStreamReply *r = (HTTPStreamReply *)arg;
+    struct evbuffer *chunk = evbuffer_new();
+    struct evbuffer_iovec v;
+    size_t n = 0;
+
+    if (evbuffer_reserve_space(chunk, HTTP_CHUNKSIZE, &v, 1) == 1) {
+        n = r->bs->read((uint8_t *)v.iov_base, HTTP_CHUNKSIZE);
+        v.iov_len = n;
+        evbuffer_commit_space(chunk, &v, 1);
+    }
+
+    if (n == 0) {
+        evhttp_connection_set_closecb(evcon, nullptr, nullptr);
+        evhttp_send_reply_end(r->req);
+        delete r->bs;
+        delete r;
+    } else {
+        evhttp_send_reply_chunk_with_cb(r->req, chunk, HTTPStreamReply_chunkCB,
+                                        r);
+    }
+    evbuffer_free(chunk);
+}
+
+/*
+ * Sends the stream as a chunked reply and takes ownership of it.  The next
+ * chunk is read only once the previous one has been written, so a slow
+ * client holds back the reading of the stream rather than the server
+ * buffering the whole reply.
+ */
+void
+HTTPServer::sendStream(struct evhttp_request *req, bytestream *bs)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    HTTPStreamReply *r = new HTTPStreamReply();
+
+    r->req = req;
+    r->bs = bs;
 
     evhttp_add_header(req->output_headers, "Content-Type",
             "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+    evhttp_connection_set_closecb(evcon, HTTPStreamReply_closeCB, r);
+    HTTPStreamReply_chunkCB(evcon, r);
+}
+
+void
+HTTPServer::getObjFilter(struct evhttp_request *req)
+{
+    DLOG("httpd: getObjFilter");
+
+    string blob = repo.getObjectFilter()->getBlob();
+    evbufwstream es;
+    es.write(blob.data(), blob.size());
+
+    evhttp_add_header(req->output_headers, "Content-Type",
+            "application/octet-stream");
+    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
 }
 
 void
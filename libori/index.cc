@@ -21,14 +21,21 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <string>
 #include <set>
+#include <vector>
 #include <iostream>
+#include <algorithm>
 #include <unordered_map>
 
+#include "tuneables.h"
+
 #include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/thread.h>
 #include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/orifile.h>
@@ -41,9 +48,181 @@ using namespace std;
 /// Adds a checksum
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
 
+/*
+ * Base index layout (all integers are big endian):
+ *   magic (4), version (4), number of entries (4),
+ *   fanout table (256 x 4), entries sorted by hash (IndexEntry::SIZE each)
+ *
+ * fanout[i] is the number of entries whose first hash byte is <= i.  The base
+ * is written to a temporary file, synced and renamed so it does not need the
+ * per-entry checksums of the log.
+ */
+#define BASE_MAGIC "ORIX"
+#define BASE_VERSION 1
+#define BASE_HDRSIZE (4 + 4 + 4 + 256 * 4)
+/// Offset of the hash within a serialized ObjectInfo
+#define BASE_HASHOFF ORI_OBJECT_TYPESIZE
+/// Entries buffered before writing during compaction
+#define BASE_WRITEBATCH 4096
+
+static uint32_t
+_readBE32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+_decodeEntry(const uint8_t *p, IndexEntry *entry)
+{
+    entry->info.fromBytes(p);
+    p += ObjectInfo::SIZE;
+    entry->offset = _readBE32(p);
+    entry->packed_size = _readBE32(p + 4);
+    entry->packfile = _readBE32(p + 8);
+}
+
+/*
+ * Verifies the checksums of a range of index log entries.
+ */
+class IndexVerifyThread : public Thread
+{
+public:
+    IndexVerifyThread(const uint8_t *log, size_t first, size_t last)
+        : log(log), first(first), last(last), valid(true)
+    {
+    }
+    virtual void run() override
+    {
+        for (size_t i = first; i < last; i++) {
+            const uint8_t *e = log + i * TOTAL_ENTRYSIZE;
+            ObjectHash computedChecksum =
+                OriCrypt_HashBlob(e, IndexEntry::SIZE);
+            if (memcmp(e + IndexEntry::SIZE, computedChecksum.hash, 16) != 0) {
+                valid = false;
+                return;
+            }
+        }
+    }
+    const uint8_t *log;
+    size_t first;
+    size_t last;
+    bool valid;
+};
+
+static bool
+_verifyLog(const uint8_t *log, size_t entries)
+{
+    size_t nthreads = MIN((size_t)Util_NumCPUs(),
+                          entries / INDEX_VERIFY_MINENTRIES);
+    if (nthreads <= 1) {
+        IndexVerifyThread t(log, 0, entries);
+        t.run();
+        return t.valid;
+    }
+
+    vector<IndexVerifyThread *> threads;
+    size_t per = (entries + nthreads - 1) / nthreads;
+    for (size_t first = 0; first < entries; first += per) {
+        IndexVerifyThread *t =
+            new IndexVerifyThread(log, first, MIN(first + per, entries));
+        t->start();
+        threads.push_back(t);
+    }
+
+    bool valid = true;
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->wait();
+        valid = valid && threads[i]->valid;
+        delete threads[i];
+    }
+
+    return valid;
+}
+
+static void
+_encodeEntry(strwstream &ss, const IndexEntry &e)
+{
+    string info_str = e.info.toString();
+    ss.write(info_str.data(), info_str.size());
+
+    ss.writeUInt32(e.offset);
+    ss.writeUInt32(e.packed_size);
+    ss.writeUInt32(e.packfile);
+}
+
+static bool
+_entryCmp(const IndexEntry &e1, const IndexEntry &e2)
+{
+    return e1.info.hash < e2.info.hash;
+}
+
+static void
+_writeAll(int fd, const string &buf)
+{
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        written += n;
+    }
+}
+
+IndexBatch::IndexBatch(bool replace)
+    : replace(replace)
+{
+}
+
+IndexBatch::~IndexBatch()
+{
+}
+
+void
+IndexBatch::add(const IndexEntry &entry)
+{
+    strwstream ss;
+
+    ASSERT(!entry.info.hash.isEmpty());
+
+    _encodeEntry(ss, entry);
+
+    ObjectHash checksum = OriCrypt_HashString(ss.str());
+    ss.write(checksum.hash, 16);
+
+    ASSERT(ss.str().size() == TOTAL_ENTRYSIZE);
+    records.append(ss.str());
+    entries.push_back(entry);
+}
+
+void
+IndexBatch::remove(const ObjectHash &objId)
+{
+    IndexEntry entry;
+
+    entry.info = ObjectInfo(objId);
+    entry.info.type = ObjectInfo::Purged;
+    entry.offset = 0;
+    entry.packed_size = 0;
+    entry.packfile = INDEX_PACKID_DELETED;
+    add(entry);
+}
+
+void
+IndexBatch::clear()
+{
+    entries.clear();
+    records.clear();
+}
+
 Index::Index()
+    : fd(-1), dirty(false), accounting(nullptr),
+      base(nullptr), baseLen(0), baseCount(0)
 {
-    fd = -1;
+    memset(baseFanout, 0, sizeof(baseFanout));
 }
 
 Index::~Index()
@@ -54,16 +233,20 @@ Index::~Index()
 void
 Index::open(const string &indexFile)
 {
-    int i, entries;
+    size_t entries;
     struct stat sb;
 
     fileName = indexFile;
 
+    // Map the sorted base
+    _openBase();
+
     // Read index
     fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT,
               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
         WARNING("Could not open the index file!");
+        _closeBase();
         throw SystemException();
     }
 
@@ -72,6 +255,7 @@ Index::open(const string &indexFile)
         int errcode = errno;
         ::close(fd);
         fd = -1;
+        _closeBase();
         WARNING("Could not fstat the index file!");
         throw SystemException(errcode);
     }
@@ -81,40 +265,44 @@ Index::open(const string &indexFile)
         WARNING("Index seems dirty please rebuild it!");
         ::close(fd);
         fd = -1;
+        _closeBase();
         throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
     }
 
     entries = sb.st_size / TOTAL_ENTRYSIZE;
-    for (i = 0; i < entries; i++) {
-        std::string entry_str(TOTAL_ENTRYSIZE, '\0');
-
-        int status UNUSED = read(fd, &entry_str[0], TOTAL_ENTRYSIZE);
-        ASSERT(status == TOTAL_ENTRYSIZE);
-
-        IndexEntry entry;
-
-        string info_str = entry_str.substr(0, ObjectInfo::SIZE);
-        entry.info.fromString(info_str);
-
-        strstream ss(entry_str, ObjectInfo::SIZE);
-        entry.offset = ss.readUInt32();
-        entry.packed_size = ss.readUInt32();
-        entry.packfile = ss.readUInt32();
-
+    index.reserve(entries);
+    if (entries > 0) {
+        // Map the whole log and parse the entries in place
+        void *m = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            int errcode = errno;
+            ::close(fd);
+            fd = -1;
+            _closeBase();
+            WARNING("Could not map the index file!");
+            throw SystemException(errcode);
+        }
+        const uint8_t *log = (const uint8_t *)m;
+        madvise(m, sb.st_size, MADV_SEQUENTIAL);
 
-        std::vector<uint8_t> storedChecksum(16);
-        ss.read(&storedChecksum[0], 16);
-        ObjectHash computedChecksum =
-            OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
-        if (memcmp(&storedChecksum[0], computedChecksum.hash, 16) != 0) {
+        if (!_verifyLog(log, entries)) {
             // XXX: Attempt truncating last entries
             WARNING("Index has corrupt entries please rebuild it!");
+            munmap(m, sb.st_size);
             ::close(fd);
             fd = -1;
+            _closeBase();
             throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
         }
 
-        index[entry.info.hash] = entry;
+        for (size_t i = 0; i < entries; i++) {
+            IndexEntry entry;
+
+            _decodeEntry(log + i * TOTAL_ENTRYSIZE, &entry);
+            index[entry.info.hash] = entry;
+        }
+
+        munmap(m, sb.st_size);
     }
     ::close(fd);
 
@@ -126,31 +314,73 @@ Index::open(const string &indexFile)
     if (OriFile_Exists(indexFile + ".tmp")) {
         OriFile_Delete(indexFile + ".tmp");
     }
+    if (OriFile_Exists(indexFile + INDEX_BASE_EXT ".tmp")) {
+        OriFile_Delete(indexFile + INDEX_BASE_EXT ".tmp");
+    }
 }
 
 void
 Index::close()
 {
+    lock.lock();
     if (fd != -1) {
         ::fsync(fd);
         ::close(fd);
         fd = -1;
     }
+    dirty = false;
+    _closeBase();
+    index.clear();
+    filter.reset();
+    filterAdds.clear();
+    lock.unlock();
+}
+
+void
+Index::setAccounting(PackfileManager *mgr)
+{
+    lock.lock();
+    accounting = mgr;
+    lock.unlock();
 }
 
 void
 Index::sync()
 {
-    ::fsync(fd);
+    lock.lock();
+    if (dirty) {
+        ::fsync(fd);
+        dirty = false;
+    }
+    // Bound the log that has to be loaded at open
+    if (index.size() > INDEX_CHECKPOINT_MINENTRIES &&
+        index.size() > baseCount * INDEX_CHECKPOINT_FRAC) {
+        _rewrite();
+    }
+    lock.unlock();
 }
 
 void
 Index::rewrite()
+{
+    lock.lock();
+    _rewrite();
+    lock.unlock();
+}
+
+/*
+ * Merge the base and the delta log into a new base, then truncate the log.  A
+ * crash after the rename leaves log entries that duplicate the base, which is
+ * harmless as the delta takes precedence with identical contents.
+ */
+void
+Index::_rewrite()
 {
     int fdNew;
-    string newIndex = fileName + ".tmp";
+    string baseFile = fileName + INDEX_BASE_EXT;
+    string newBase = baseFile + ".tmp";
 
-    fdNew = ::open(newIndex.c_str(), O_RDWR | O_CREAT,
+    fdNew = ::open(newBase.c_str(), O_RDWR | O_CREAT | O_TRUNC,
                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fdNew < 0) {
         perror("open");
@@ -158,19 +388,96 @@ Index::rewrite()
         return;
     };
 
-    int tmpFd = fd;
-    fd = fdNew;
-    ::close(tmpFd);
-
-    // Write new index
+    vector<IndexEntry> delta;
+    delta.reserve(index.size());
     for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
             it != index.end();
             it++)
     {
-        _writeEntry((*it).second);
+        delta.push_back((*it).second);
     }
+    sort(delta.begin(), delta.end(), _entryCmp);
+
+    // Leave room for the header which is written once the counts are known
+    uint32_t fanout[256];
+    uint32_t count = 0;
+    memset(fanout, 0, sizeof(fanout));
+
+    try {
+        _writeAll(fdNew, string(BASE_HDRSIZE, '\0'));
+
+        strwstream ss(BASE_WRITEBATCH * IndexEntry::SIZE);
+        size_t batched = 0;
+        uint32_t ib = 0;
+        size_t id = 0;
+        while (ib < baseCount || id < delta.size()) {
+            IndexEntry e;
+
+            if (id == delta.size()) {
+                _decodeEntry(_baseEntry(ib++), &e);
+            } else if (ib == baseCount) {
+                e = delta[id++];
+            } else {
+                int cmp = memcmp(_baseEntry(ib) + BASE_HASHOFF,
+                                 delta[id].info.hash.hash, ObjectHash::SIZE);
+                if (cmp < 0) {
+                    _decodeEntry(_baseEntry(ib++), &e);
+                } else {
+                    // Delta entries replace base entries
+                    if (cmp == 0)
+                        ib++;
+                    e = delta[id++];
+                }
+            }
+            if (e.packfile == INDEX_PACKID_DELETED)
+                continue;
+
+            _encodeEntry(ss, e);
+            fanout[e.info.hash.hash[0]]++;
+            count++;
+
+            if (++batched == BASE_WRITEBATCH) {
+                _writeAll(fdNew, ss.str());
+                ss = strwstream(BASE_WRITEBATCH * IndexEntry::SIZE);
+                batched = 0;
+            }
+        }
+        _writeAll(fdNew, ss.str());
+
+        strwstream hdr(BASE_HDRSIZE);
+        hdr.write(BASE_MAGIC, 4);
+        hdr.writeUInt32(BASE_VERSION);
+        hdr.writeUInt32(count);
+        uint32_t total = 0;
+        for (int i = 0; i < 256; i++) {
+            total += fanout[i];
+            hdr.writeUInt32(total);
+        }
+        ASSERT(hdr.str().size() == BASE_HDRSIZE);
+        if (pwrite(fdNew, hdr.str().data(), BASE_HDRSIZE, 0) != BASE_HDRSIZE)
+            throw SystemException();
+
+        if (::fsync(fdNew) < 0)
+            throw SystemException();
+    } catch (SystemException &e) {
+        WARNING("Could not write the index base: %s", e.what());
+        ::close(fdNew);
+        OriFile_Delete(newBase);
+        return;
+    }
+    ::close(fdNew);
+
+    _closeBase();
+    OriFile_Rename(newBase, baseFile);
+    _openBase();
 
-    OriFile_Rename(newIndex, fileName);
+    // The base now holds every entry so the log can be emptied
+    if (::ftruncate(fd, 0) < 0) {
+        perror("ftruncate");
+        WARNING("Could not truncate the index log!");
+    }
+    ::fsync(fd);
+    index.clear();
 }
 
 void
@@ -178,45 +485,124 @@ Index::dump()
 {
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
+    lock.lock();
     cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(_baseEntry(i), &e);
+        if (index.find(e.info.hash) != index.end())
+            continue;
+
+        cout << e.info.hash.hex() << " packfile: " <<
+            e.packfile << "," <<
+            e.offset << "," <<
+            e.packed_size << endl;
+    }
     for (it = index.begin(); it != index.end(); it++)
     {
+        if ((*it).second.packfile == INDEX_PACKID_DELETED)
+            continue;
         cout << (*it).first.hex() << " packfile: " <<
             (*it).second.packfile << "," <<
             (*it).second.offset << "," <<
             (*it).second.packed_size << endl;
     }
     cout << "***** END REPOSITORY INDEX *****" << endl;
+    lock.unlock();
 }
 
 void
 Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
 {
-    ASSERT(!objId.isEmpty());
+    IndexBatch batch;
 
-    _writeEntry(entry);
+    ASSERT(objId == entry.info.hash);
 
-    if (index.find(objId) != index.end()) {
-        fprintf(stderr, "WARNING: duplicate updateEntry\n");
+    batch.add(entry);
+    commit(batch);
+}
+
+/*
+ * Group commit: all records of a batch go out in one write.  The log is only
+ * fsynced by Index::sync, so callers must make the packfile contents durable
+ * before committing a batch that references them.  A batch torn by a crash
+ * is caught by the size and checksum checks at open and the index can then be
+ * rebuilt from the packfiles.
+ */
+void
+Index::commit(IndexBatch &batch)
+{
+    if (batch.empty())
+        return;
+
+    lock.lock();
+    try {
+        _writeAll(fd, batch.records);
+    } catch (SystemException &e) {
+        lock.unlock();
+        throw;
     }
+    dirty = true;
+
+    for (size_t i = 0; i < batch.entries.size(); i++) {
+        const IndexEntry &e = batch.entries[i];
+        IndexEntry old;
+        bool indexed = _hasEntry(e.info.hash, &old);
+
+        if (!batch.replace && e.packfile != INDEX_PACKID_DELETED && indexed) {
+            fprintf(stderr, "WARNING: duplicate updateEntry\n");
+        }
+
+        // The previous location (if any) is no longer referenced
+        if (accounting != nullptr) {
+            if (indexed)
+                accounting->addDead(old.packfile, old.packed_size);
+            if (e.packfile != INDEX_PACKID_DELETED)
+                accounting->addLive(e.packfile, e.packed_size);
+        }
+
+        if (filter && e.packfile != INDEX_PACKID_DELETED && !indexed)
+            filterAdds.push_back(e.info.hash);
 
-    // Add to in-memory index
-    index[objId] = entry;
+        // Add to in-memory index
+        index[e.info.hash] = e;
+    }
+    if (filter &&
+        filter->getCount() + filterAdds.size() > filter->getCapacity()) {
+        filter.reset();
+        filterAdds.clear();
+    }
+    lock.unlock();
+
+    batch.clear();
 }
 
-const IndexEntry &
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
+    IndexEntry entry;
+    bool found = true;
+
+    lock.lock();
     unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
-    if (it == index.end()) {
+    if (it != index.end()) {
+        entry = (*it).second;
+        found = entry.packfile != INDEX_PACKID_DELETED;
+    } else {
+        found = _findBase(objId, &entry);
+    }
+    lock.unlock();
+
+    if (!found) {
         WARNING("Could not find the object!");
         throw RuntimeException(ORIEC_INDEXNOTFOUND, "Index not found");
     }
 
-    return (*it).second;
+    return entry;
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -225,11 +611,37 @@ Index::getInfo(const ObjectHash &objId) const
 bool
 Index::hasObject(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+    bool found;
 
-    it = index.find(objId);
+    lock.lock();
+    found = _hasEntry(objId);
+    lock.unlock();
+
+    return found;
+}
+
+size_t
+Index::getDeltaSize() const
+{
+    size_t n;
+
+    lock.lock();
+    n = index.size();
+    lock.unlock();
 
-    return it != index.end();
+    return n;
+}
+
+size_t
+Index::getBaseSize() const
+{
+    size_t n;
+
+    lock.lock();
+    n = baseCount;
+    lock.unlock();
+
+    return n;
 }
 
 set<ObjectInfo>
@@ -238,32 +650,217 @@ Index::getList()
     set<ObjectInfo> lst;
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
+    lock.lock();
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(_baseEntry(i), &e);
+        if (index.find(e.info.hash) == index.end())
+            lst.insert(e.info);
+    }
+
     for (it = index.begin(); it != index.end(); it++)
     {
-        lst.insert((*it).second.info);
+        if ((*it).second.packfile != INDEX_PACKID_DELETED)
+            lst.insert((*it).second.info);
     }
+    lock.unlock();
 
     return lst;
 }
 
+/*
+ * Published filters are never modified, committed objects are collected in
+ * filterAdds and applied to a copy of the filter outside the lock by the next
+ * caller, which then publishes the copy.
+ */
+ObjectFilter::sp
+Index::getFilter()
+{
+    ObjectFilter::sp f;
+    vector<ObjectHash> adds;
+
+    lock.lock();
+    if (!filter)
+        _buildFilter();
+    f = filter;
+    adds = filterAdds;
+    lock.unlock();
+
+    if (adds.empty())
+        return f;
+
+    ObjectFilter::sp updated(new ObjectFilter(*f));
+    for (size_t i = 0; i < adds.size(); i++)
+        updated->add(adds[i]);
+
+    // Publish unless the filter was rebuilt or updated meanwhile
+    lock.lock();
+    if (filter == f && filterAdds.size() >= adds.size()) {
+        filter = updated;
+        filterAdds.erase(filterAdds.begin(), filterAdds.begin() + adds.size());
+    }
+    lock.unlock();
+
+    return updated;
+}
 
 void
-Index::_writeEntry(const IndexEntry &e)
+Index::_openBase()
 {
-    strwstream ss;
+    string baseFile = fileName + INDEX_BASE_EXT;
+    struct stat sb;
 
-    string info_str = e.info.toString();
-    ss.write(info_str.data(), info_str.size());
+    ASSERT(base == nullptr);
 
-    ss.writeUInt32(e.offset);
-    ss.writeUInt32(e.packed_size);
-    ss.writeUInt32(e.packfile);
+    int baseFd = ::open(baseFile.c_str(), O_RDONLY);
+    if (baseFd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the index base!");
+        throw SystemException();
+    }
 
-    ObjectHash checksum = OriCrypt_HashString(ss.str());
-    ss.write(checksum.hash, 16);
+    if (::fstat(baseFd, &sb) < 0) {
+        int errcode = errno;
+        ::close(baseFd);
+        WARNING("Could not fstat the index base!");
+        throw SystemException(errcode);
+    }
+
+    if ((size_t)sb.st_size < BASE_HDRSIZE) {
+        ::close(baseFd);
+        WARNING("Index base is truncated please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    void *m = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, baseFd, 0);
+    ::close(baseFd);
+    if (m == MAP_FAILED) {
+        WARNING("Could not map the index base!");
+        throw SystemException();
+    }
+
+    base = (const uint8_t *)m;
+    baseLen = sb.st_size;
+
+    // Validate the header and fanout table
+    bool valid = memcmp(base, BASE_MAGIC, 4) == 0 &&
+                 _readBE32(base + 4) == BASE_VERSION;
+    if (valid) {
+        baseCount = _readBE32(base + 8);
+        uint32_t prev = 0;
+        for (int i = 0; i < 256; i++) {
+            baseFanout[i] = _readBE32(base + 12 + 4 * i);
+            if (baseFanout[i] < prev)
+                valid = false;
+            prev = baseFanout[i];
+        }
+        valid = valid && baseFanout[255] == baseCount &&
+            baseLen == BASE_HDRSIZE + (size_t)baseCount * IndexEntry::SIZE;
+    }
+
+    if (!valid) {
+        _closeBase();
+        WARNING("Index base is corrupt please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+}
+
+void
+Index::_closeBase()
+{
+    if (base != nullptr) {
+        munmap((void *)base, baseLen);
+        base = nullptr;
+    }
+    baseLen = 0;
+    baseCount = 0;
+    memset(baseFanout, 0, sizeof(baseFanout));
+}
+
+/*
+ * Returns true if the object is indexed and optionally its entry, the caller
+ * holds the lock.
+ */
+bool
+Index::_hasEntry(const ObjectHash &objId, IndexEntry *entry) const
+{
+    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+
+    it = index.find(objId);
+    if (it != index.end()) {
+        if ((*it).second.packfile == INDEX_PACKID_DELETED)
+            return false;
+        if (entry != nullptr)
+            *entry = (*it).second;
+        return true;
+    }
+
+    return _findBase(objId, entry);
+}
+
+/*
+ * Sized for OBJFILTER_GROWTH times the current objects so that additions can
+ * be applied in place for a while before the filter needs to be rebuilt.
+ */
+void
+Index::_buildFilter()
+{
+    unordered_map<ObjectHash, IndexEntry>::iterator it;
+
+    filter.reset(new ObjectFilter((baseCount + index.size()) *
+                                  OBJFILTER_GROWTH));
+    filterAdds.clear();
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(_baseEntry(i), &e);
+        if (index.find(e.info.hash) == index.end())
+            filter->add(e.info.hash);
+    }
+
+    for (it = index.begin(); it != index.end(); it++)
+    {
+        if ((*it).second.packfile != INDEX_PACKID_DELETED)
+            filter->add((*it).first);
+    }
+}
 
-    const string &final = ss.str();
-    ASSERT(final.size() == TOTAL_ENTRYSIZE);
-    write(fd, final.data(), final.size());
+const uint8_t *
+Index::_baseEntry(uint32_t ix) const
+{
+    ASSERT(ix < baseCount);
+    return base + BASE_HDRSIZE + (size_t)ix * IndexEntry::SIZE;
 }
 
+/*
+ * Binary search within the fanout bucket of the first hash byte.
+ */
+bool
+Index::_findBase(const ObjectHash &objId, IndexEntry *entry) const
+{
+    if (baseCount == 0)
+        return false;
+
+    uint8_t first = objId.hash[0];
+    uint32_t lo = (first == 0) ? 0 : baseFanout[first - 1];
+    uint32_t hi = baseFanout[first];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = _baseEntry(mid);
+        int cmp = memcmp(e + BASE_HASHOFF, objId.hash, ObjectHash::SIZE);
+        if (cmp == 0) {
+            if (entry != nullptr)
+                _decodeEntry(e, entry);
+            return true;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
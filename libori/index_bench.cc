@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Index open microbenchmark.  Times loading an index of synthetic entries from
+ * the append-only log and from the sorted base.
+ *
+ * Usage: index_bench [ENTRIES] [DIRECTORY]
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/orifile.h>
+#include <oriutil/stopwatch.h>
+#include <ori/index.h>
+
+using namespace std;
+
+#define DEFAULT_ENTRIES (1000 * 1000)
+#define LOOKUPS (1000 * 1000)
+
+static ObjectHash
+syntheticHash(uint64_t i)
+{
+    return OriCrypt_HashBlob((const uint8_t *)&i, sizeof(i));
+}
+
+static void
+fillIndex(const string &path, uint64_t entries)
+{
+    Index idx;
+
+    idx.open(path);
+    for (uint64_t i = 0; i < entries; i++) {
+        IndexEntry ie;
+
+        ie.info = ObjectInfo(syntheticHash(i));
+        ie.info.type = ObjectInfo::Blob;
+        ie.info.payload_size = 4096;
+        ie.info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        ie.offset = (i % 2048) * 4096;
+        ie.packed_size = 4096;
+        ie.packfile = i / 2048;
+
+        idx.updateEntry(ie.info.hash, ie);
+    }
+    idx.close();
+}
+
+static void
+timeLookups(Index &idx, uint64_t entries)
+{
+    Stopwatch sw;
+    uint64_t found = 0;
+
+    sw.start();
+    for (uint64_t i = 0; i < LOOKUPS; i++) {
+        if (idx.hasObject(syntheticHash(rand() % entries)))
+            found++;
+    }
+    sw.stop();
+
+    printf("  %d lookups: %" PRIu64 " ms (%" PRIu64 " found)\n",
+           LOOKUPS, sw.getElapsedMS(), found);
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint64_t entries = DEFAULT_ENTRIES;
+    string dir = "/tmp";
+    Stopwatch sw;
+
+    if (argc > 1)
+        entries = strtoull(argv[1], nullptr, 10);
+    if (argc > 2)
+        dir = argv[2];
+    if (entries == 0) {
+        printf("index_bench requires a positive number of entries!\n");
+        return 1;
+    }
+
+    string path = dir + "/index_bench.idx";
+    OriFile_Delete(path);
+    OriFile_Delete(path + INDEX_BASE_EXT);
+
+    printf("Generating %" PRIu64 " entries\n", entries);
+    fillIndex(path, entries);
+
+    {
+        Index idx;
+
+        sw.start();
+        idx.open(path);
+        sw.stop();
+        printf("Open from log: %" PRIu64 " ms\n", sw.getElapsedMS());
+        timeLookups(idx, entries);
+
+        sw.reset();
+        sw.start();
+        idx.rewrite();
+        sw.stop();
+        printf("Compaction: %" PRIu64 " ms\n", sw.getElapsedMS());
+    }
+
+    {
+        Index idx;
+
+        sw.reset();
+        sw.start();
+        idx.open(path);
+        sw.stop();
+        printf("Open from base: %" PRIu64 " ms\n", sw.getElapsedMS());
+        timeLookups(idx, entries);
+    }
+
+    OriFile_Delete(path);
+    OriFile_Delete(path + INDEX_BASE_EXT);
+
+    return 0;
+}
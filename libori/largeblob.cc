@@ -30,6 +30,15 @@
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <atomic>
 
 #include <openssl/sha.h>
 
@@ -38,8 +47,17 @@
 #endif
 
 #include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/thread.h>
+#include <oriutil/rwlock.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/stream.h>
+#include <oriutil/codec.h>
 #include <ori/largeblob.h>
+#include <ori/packfile.h>
+
+#include "tuneables.h"
 
 #ifdef ORI_USE_RK
 #include "rkchunker.h"
@@ -49,6 +67,10 @@
 #include "fchunker.h"
 #endif /* ORI_USE_FIXED */
 
+#ifdef ORI_USE_GEAR
+#include "gearchunker.h"
+#endif /* ORI_USE_GEAR */
+
 using namespace std;
 
 /********************************************************************
@@ -59,13 +81,8 @@ using namespace std;
  *
  ********************************************************************/
 
-LBlobEntry::LBlobEntry(const LBlobEntry &l)
-    : hash(l.hash), length(l.length)
-{
-}
-
-LBlobEntry::LBlobEntry(const ObjectHash &h, uint16_t l)
-    : hash(h), length(l)
+LBlobEntry::LBlobEntry(const ObjectHash &h, uint64_t o, uint32_t l)
+    : hash(h), offset(o), length(l)
 {
 }
 
@@ -90,14 +107,285 @@ LargeBlob::~LargeBlob()
 {
 }
 
+/*
+ * Ingests the chunks of a large file.  The chunker runs on the calling thread
+ * and hands chunks to a pool of workers that hash and compress them, while a
+ * single writer adds the results to the repository in file order.  At most
+ * LBLOB_PIPELINE_DEPTH chunks are in flight.  On a single CPU the chunks are
+ * processed inline.
+ */
+class ChunkPipeline
+{
+public:
+    ChunkPipeline(LargeBlob *l, int workers, const string &fileType);
+    ~ChunkPipeline();
+    /// Queue a chunk (called from the chunker)
+    void add(const uint8_t *b, uint32_t l);
+    /// Wait for all queued chunks to be written, rethrows worker errors
+    void finish();
+    void worker();
+    void writer();
+private:
+    struct Job {
+        uint64_t seq;
+        uint64_t off;
+        string data;
+        ObjectInfo info;
+        string stored;
+    };
+    void process(Job *job);
+    void write(Job *job);
+    void fail(exception_ptr e);
+    void stop();
+
+    LargeBlob *lb;
+    const Codec *codec;
+    CompressionMemo *memo;
+    string fileType;
+    vector<Thread *> threads;
+    uint64_t lbOff;
+
+    mutex lock;
+    condition_variable workCV;
+    condition_variable doneCV;
+    condition_variable spaceCV;
+    deque<Job *> work;
+    map<uint64_t, Job *> done;
+    uint64_t nextSeq;
+    uint64_t nextWrite;
+    bool closed;
+    bool aborted;
+    exception_ptr error;
+};
+
+class ChunkPipelineThread : public Thread
+{
+public:
+    ChunkPipelineThread(ChunkPipeline *p, bool w)
+        : Thread(w ? "ChunkWriter" : "ChunkWorker"), pipeline(p), isWriter(w)
+    {
+    }
+    virtual void run() override
+    {
+        if (isWriter)
+            pipeline->writer();
+        else
+            pipeline->worker();
+    }
+private:
+    ChunkPipeline *pipeline;
+    bool isWriter;
+};
+
+ChunkPipeline::ChunkPipeline(LargeBlob *l, int workers,
+                             const string &fileType)
+    : lb(l), codec(l->repo->getCodec()), memo(l->repo->getCompressionMemo()),
+      fileType(fileType), lbOff(0), nextSeq(0), nextWrite(0), closed(false),
+      aborted(false)
+{
+    if (workers == 0)
+        return;
+
+    threads.push_back(new ChunkPipelineThread(this, true));
+    for (int i = 0; i < workers; i++)
+        threads.push_back(new ChunkPipelineThread(this, false));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i]->start();
+}
+
+ChunkPipeline::~ChunkPipeline()
+{
+    if (!threads.empty()) {
+        {
+            unique_lock<mutex> l(lock);
+            aborted = true;
+        }
+        stop();
+    }
+
+    for (size_t i = 0; i < work.size(); i++)
+        delete work[i];
+    for (map<uint64_t, Job *>::iterator it = done.begin();
+         it != done.end(); it++)
+        delete it->second;
+}
+
+/*
+ * Wakes up and joins all threads, closed or aborted must be set.
+ */
+void
+ChunkPipeline::stop()
+{
+    workCV.notify_all();
+    doneCV.notify_all();
+    spaceCV.notify_all();
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->wait();
+        delete threads[i];
+    }
+    threads.clear();
+}
+
+void
+ChunkPipeline::add(const uint8_t *b, uint32_t l)
+{
+    Job *job = new Job();
+
+    job->off = lbOff;
+    job->data.assign((const char *)b, l);
+    lbOff += l;
+
+    if (threads.empty()) {
+        process(job);
+        write(job);
+        delete job;
+        return;
+    }
+
+    unique_lock<mutex> lk(lock);
+    spaceCV.wait(lk, [this]() {
+        return aborted || nextSeq - nextWrite < LBLOB_PIPELINE_DEPTH;
+    });
+    if (aborted) {
+        delete job;
+        rethrow_exception(error);
+    }
+    job->seq = nextSeq++;
+    work.push_back(job);
+    workCV.notify_one();
+}
+
+void
+ChunkPipeline::finish()
+{
+    if (threads.empty())
+        return;
+
+    {
+        unique_lock<mutex> l(lock);
+        closed = true;
+    }
+    stop();
+
+    if (error)
+        rethrow_exception(error);
+}
+
+void
+ChunkPipeline::fail(exception_ptr e)
+{
+    unique_lock<mutex> l(lock);
+
+    if (!error)
+        error = e;
+    aborted = true;
+    workCV.notify_all();
+    doneCV.notify_all();
+    spaceCV.notify_all();
+}
+
+void
+ChunkPipeline::worker()
+{
+    while (true) {
+        Job *job;
+        {
+            unique_lock<mutex> l(lock);
+            workCV.wait(l, [this]() {
+                return aborted || closed || !work.empty();
+            });
+            if (aborted || work.empty())
+                return;
+            job = work.front();
+            work.pop_front();
+        }
+
+        try {
+            process(job);
+        } catch (...) {
+            delete job;
+            fail(current_exception());
+            return;
+        }
+
+        unique_lock<mutex> l(lock);
+        done[job->seq] = job;
+        if (job->seq == nextWrite)
+            doneCV.notify_one();
+    }
+}
+
+void
+ChunkPipeline::writer()
+{
+    while (true) {
+        Job *job;
+        {
+            unique_lock<mutex> l(lock);
+            doneCV.wait(l, [this]() {
+                return aborted || done.count(nextWrite) != 0 ||
+                       (closed && nextWrite == nextSeq);
+            });
+            if (aborted)
+                return;
+            map<uint64_t, Job *>::iterator it = done.find(nextWrite);
+            if (it == done.end())
+                return;
+            job = it->second;
+            done.erase(it);
+        }
+
+        try {
+            write(job);
+        } catch (...) {
+            delete job;
+            fail(current_exception());
+            return;
+        }
+        delete job;
+
+        unique_lock<mutex> l(lock);
+        nextWrite++;
+        spaceCV.notify_one();
+    }
+}
+
+/*
+ * Hash and compress a chunk, safe to run concurrently.
+ */
+void
+ChunkPipeline::process(Job *job)
+{
+    job->info = ObjectInfo(OriCrypt_HashString(job->data));
+    job->info.type = ObjectInfo::Blob;
+    job->info.payload_size = job->data.size();
+    job->stored = PfTransaction::preparePayload(job->info, job->data,
+                                                codec, memo, fileType);
+}
+
+/*
+ * Add a processed chunk to the repository and the LargeBlob object, only
+ * called by the writer (or inline).
+ */
+void
+ChunkPipeline::write(Job *job)
+{
+    // XXX: Journal for cleanup!
+    lb->repo->addPreparedObject(job->info, job->data, job->stored);
+    ASSERT(job->off == lb->totalSize());
+    lb->addPart(job->info.hash, job->data.size());
+}
+
 class FileChunkerCB : public ChunkerCB
 {
 public:
-    FileChunkerCB(LargeBlob *l)
+    FileChunkerCB(ChunkPipeline *p, OriCrypt_HashContext *h)
     {
-        lb = l;
-        lbOff = 0;
+        pipeline = p;
+        fileHash = h;
         buf = nullptr;
+        srcFd = -1;
     }
     ~FileChunkerCB()
     {
@@ -130,15 +418,9 @@ public:
     }
     virtual void match(const uint8_t *b, uint32_t l) override
     {
-        // Add the fragment into the repository
-        // XXX: Journal for cleanup!
-        string blob = string((const char *)b, l);
-        ObjectHash hash = OriCrypt_HashString(blob);
-        lb->repo->addObject(ObjectInfo::Blob, hash, blob);
-
-        // Add the fragment to the LargeBlob object.
-        lb->parts.insert(make_pair(lbOff, LBlobEntry(hash, l)));
-        lbOff += l;
+        // Chunks arrive in file order, so the file hash needs no second pass
+        fileHash->update(b, l);
+        pipeline->add(b, l);
     }
     virtual int load(uint8_t **b, uint64_t *l, uint64_t *o) override
     {
@@ -177,9 +459,9 @@ public:
         return 1;
     }
 private:
-    // Output large blob
-    LargeBlob *lb;
-    uint64_t lbOff;
+    // Output pipeline and whole file hash
+    ChunkPipeline *pipeline;
+    OriCrypt_HashContext *fileHash;
     // Input file
     int srcFd;
     uint64_t fileLen;
@@ -192,7 +474,11 @@ private:
 void
 LargeBlob::chunkFile(const string &path)
 {
-    FileChunkerCB cb = FileChunkerCB(this);
+    int numCPUs = Util_NumCPUs();
+    int workers = (numCPUs > 1) ? MIN(numCPUs, LBLOB_PIPELINE_MAXWORKERS) : 0;
+    ChunkPipeline pipeline(this, workers, CompressionMemo::fileType(path));
+    OriCrypt_HashContext fileHash;
+    FileChunkerCB cb = FileChunkerCB(&pipeline, &fileHash);
 #ifdef ORI_USE_RK
     RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
 #endif /* ORI_USE_RK */
@@ -202,6 +488,10 @@ LargeBlob::chunkFile(const string &path)
     FChunker<32*1024> c = FChunker<32*1024>();
 #endif /* ORI_USE_FIXED */
 
+#ifdef ORI_USE_GEAR
+    GearChunker<4096, 2048, 8192> c;
+#endif /* ORI_USE_GEAR */
+
     const int status = cb.open(path);
     if (status < 0) {
         perror("Cannot open large file for chunking");
@@ -209,16 +499,114 @@ LargeBlob::chunkFile(const string &path)
         return;
     }
 
-    totalHash = OriCrypt_HashFile(path);
-
     c.chunk(&cb);
+    pipeline.finish();
+
+    totalHash = fileHash.final();
+}
+
+/*
+ * Runs fn(0) ... fn(n - 1) on up to Util_NumCPUs() threads, or inline on a
+ * single CPU.  Stops early after the first failure and returns its message.
+ */
+class ExtractThread : public Thread
+{
+public:
+    ExtractThread(std::function<void(size_t)> *fn, size_t n,
+                  std::atomic<size_t> *next, std::atomic<bool> *failed,
+                  std::string *error, std::mutex *errorLock)
+        : Thread("LargeBlobExtract"), fn(fn), n(n), next(next),
+          failed(failed), error(error), errorLock(errorLock)
+    {
+    }
+    virtual void run() override
+    {
+        size_t i;
+        while (!*failed && (i = next->fetch_add(1)) < n) {
+            try {
+                (*fn)(i);
+            } catch (std::exception &e) {
+                std::unique_lock<std::mutex> l(*errorLock);
+                if (!*failed)
+                    *error = e.what();
+                *failed = true;
+            }
+        }
+    }
+private:
+    std::function<void(size_t)> *fn;
+    size_t n;
+    std::atomic<size_t> *next;
+    std::atomic<bool> *failed;
+    std::string *error;
+    std::mutex *errorLock;
+};
+
+static std::string
+_parallelFor(size_t n, std::function<void(size_t)> fn)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::string error;
+    std::mutex errorLock;
+    size_t nthreads = MIN((size_t)Util_NumCPUs(), n);
+
+    if (nthreads <= 1) {
+        ExtractThread t(&fn, n, &next, &failed, &error, &errorLock);
+        t.run();
+        return error;
+    }
+
+    vector<ExtractThread *> threads;
+    for (size_t i = 0; i < nthreads; i++) {
+        threads.push_back(new ExtractThread(&fn, n, &next, &failed, &error,
+                                            &errorLock));
+        threads.back()->start();
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->wait();
+        delete threads[i];
+    }
+
+    return error;
 }
 
+static void
+_pwriteAll(int fd, const char *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+}
+
+static bool
+_isZero(const string &buf)
+{
+    for (size_t i = 0; i < buf.size(); i++) {
+        if (buf[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Writes the file with positional writes so chunks can be fetched and
+ * decompressed in parallel.  Every distinct chunk is fetched once.  The file
+ * is sized up front and chunks of zeros are never written, leaving holes on
+ * file systems that support them.  Remote repositories are asked for
+ * LBLOB_EXTRACT_BATCH chunks per getObjects request.
+ */
 void
 LargeBlob::extractFile(const std::string &path)
 {
-    std::map<uint64_t, LBlobEntry>::iterator it;
-
     const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
@@ -227,67 +615,157 @@ LargeBlob::extractFile(const std::string &path)
         return;
     }
 
-    for (it = parts.begin(); it != parts.end(); it++)
-    {
-        Object::sp o(repo->getObject((*it).second.hash));
-        const std::string tmp = o->getPayload();
-        ASSERT(tmp.length() == (*it).second.length);
+    if (::ftruncate(fd, totalSize()) < 0) {
+        perror("Cannot size large file");
+        PANIC();
+        ::close(fd);
+        return;
+    }
 
-        const int status = ::write(fd, tmp.data(), tmp.length());
-        if (status < 0) {
-            perror("write to large object failed");
-            PANIC();
-            return;
-        }
+    // Group the parts by hash and drop runs of zeros
+    map<ObjectHash, vector<size_t> > byHash;
+    for (size_t i = 0; i < parts.size(); i++)
+        byHash[parts[i].hash].push_back(i);
 
-        ASSERT(status == (int)tmp.length());
+    map<uint32_t, ObjectHash> zeroHashes;
+    vector<const vector<size_t> *> todo;
+    for (auto &it : byHash) {
+        // Only repeated chunks are worth checking against a zero hash
+        if (it.second.size() > 1) {
+            uint32_t len = parts[it.second[0]].length;
+            if (zeroHashes.find(len) == zeroHashes.end())
+                zeroHashes[len] = OriCrypt_HashString(string(len, '\0'));
+            if (zeroHashes[len] == it.first)
+                continue;
+        }
+        todo.push_back(&it.second);
     }
 
+    // Write one payload at each offset it occurs at
+    auto writeParts = [&](const vector<size_t> &ix, const string &payload) {
+        const LBlobEntry &e = parts[ix[0]];
+        if (payload.size() != e.length) {
+            WARNING("Large blob part %s has the wrong length",
+                    e.hash.hex().c_str());
+            throw SystemException(EIO);
+        }
 #ifdef DEBUG
-    ObjectHash extractedHash = OriCrypt_HashFile(path);
-    ASSERT(extractedHash == totalHash);
+        ASSERT(OriCrypt_HashString(payload) == e.hash);
 #endif /* DEBUG */
-}
+        if (_isZero(payload))
+            return;
+        for (size_t i = 0; i < ix.size(); i++)
+            _pwriteAll(fd, payload.data(), payload.size(), parts[ix[i]].offset);
+    };
 
-ssize_t
-LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
-{
-    std::map<uint64_t, LBlobEntry>::const_iterator it;
-    // XXX: Using upper/lower_bound should be faster
+    string error;
+    if (repo->distance() == 0) {
+        error = _parallelFor(todo.size(), [&](size_t i) {
+            Object::sp o(repo->getObject(parts[(*todo[i])[0]].hash));
+            if (!o)
+                throw SystemException(ENOENT);
+            writeParts(*todo[i], o->getPayload());
+        });
+    } else {
+        for (size_t b = 0; b < todo.size() && error.empty();
+             b += LBLOB_EXTRACT_BATCH) {
+            const size_t bend = MIN(b + LBLOB_EXTRACT_BATCH, todo.size());
+            ObjectHashVec hashes;
+            for (size_t i = b; i < bend; i++)
+                hashes.push_back(parts[(*todo[i])[0]].hash);
 
-    for (it = parts.begin(); it != parts.end(); ++it) {
-        if (static_cast<off_t>((*it).first) <= off && 
-            static_cast<off_t>(((*it).first + (*it).second.length)) > off)
-            break;
-    }
+            // One request per batch, each part is verified as it is read
+            vector<pair<ObjectInfo, string> > objs;
+            try {
+                bytestream::ap bs(repo->getObjects(hashes));
+                if (!bs.get())
+                    throw SystemException(EIO);
+                GroupReader gr(bs.get());
+                while (gr.nextGroup()) {
+                    while (gr.hasObject())
+                        objs.push_back(gr.readObject());
+                }
+            } catch (std::exception &e) {
+                error = e.what();
+                break;
+            }
 
-    if (it == parts.end()) {
-        LOG("offset %" PRIu64 " larger than large blob", off);
-        return 0;
+            map<ObjectHash, const vector<size_t> *> want;
+            for (size_t i = b; i < bend; i++)
+                want[parts[(*todo[i])[0]].hash] = todo[i];
+            if (objs.size() != want.size()) {
+                error = "missing large blob parts";
+                break;
+            }
+
+            error = _parallelFor(objs.size(), [&](size_t i) {
+                const ObjectInfo &info = objs[i].first;
+                map<ObjectHash, const vector<size_t> *>::iterator it =
+                    want.find(info.hash);
+                if (it == want.end())
+                    throw SystemException(EIO);
+
+                writeParts(*it->second, objs[i].second);
+            });
+        }
     }
 
-    const off_t part_off = off - (*it).first;
-    if (part_off >= (*it).second.length) {
-        LOG("offset %" PRIu64 " larger than last blob in LB", off);
-        ASSERT(false);
-        return 0;
+    if (!error.empty()) {
+        WARNING("Extracting large file %s failed: %s", path.c_str(),
+                error.c_str());
+        PANIC();
     }
-    if (part_off < 0) {
-        LOG("part_off less than 0");
+
+    ::close(fd);
+}
+
+static bool
+_partCmp(uint64_t off, const LBlobEntry &e)
+{
+    return off < e.offset;
+}
+
+std::vector<LBlobEntry>::const_iterator
+LargeBlob::findPart(uint64_t off) const
+{
+    std::vector<LBlobEntry>::const_iterator it =
+        upper_bound(parts.begin(), parts.end(), off, _partCmp);
+
+    if (it == parts.begin())
+        return parts.end();
+    --it;
+    if ((*it).offset + (*it).length <= off)
+        return parts.end();
+
+    return it;
+}
+
+void
+LargeBlob::addPart(const ObjectHash &hash, uint32_t length)
+{
+    parts.push_back(LBlobEntry(hash, totalSize(), length));
+}
+
+ssize_t
+LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
+{
+    if (off < 0) {
+        LOG("negative offset in large blob read");
         ASSERT(false);
         return -EIO;
     }
 
-    const int left = (*it).second.length - part_off;
-    if (left <= 0) {
-        LOG("incorrect computation of left! (%d)", left);
-        ASSERT(false);
-        return -EIO;
+    std::vector<LBlobEntry>::const_iterator it = findPart(off);
+    if (it == parts.end()) {
+        LOG("offset %" PRIu64 " larger than large blob", off);
+        return 0;
     }
 
-    const size_t to_read = std::min((size_t)left, s);
+    const off_t part_off = off - (*it).offset;
+    const size_t left = (*it).length - part_off;
+    const size_t to_read = std::min(left, s);
 
-    Object::sp o(repo->getObject((*it).second.hash));
+    Object::sp o(repo->getObject((*it).hash));
     ASSERT(o->getInfo().type == ObjectInfo::Blob);
     const std::string &payload = o->getPayload();
     memcpy(buf, payload.data()+part_off, to_read);
@@ -295,38 +773,92 @@ LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
     return to_read;
 }
 
+/*
+ * Manifest format
+ *
+ * Version 1 (no header):
+ *   total hash, number of parts (8), then per part the hash and a 16-bit
+ *   length.
+ *
+ * Version 2:
+ *   magic (4), version (4), total hash, number of parts (8), then per part
+ *   the hash and a 32-bit length.
+ *
+ * Part offsets are the running sum of the lengths and rebuilt on load.
+ */
+#define LBLOB_MAGIC "ORLB"
+#define LBLOB_VERSION 2
+#define LBLOB_V2_HDRSIZE (4 + 4 + ObjectHash::SIZE + 8)
+#define LBLOB_V2_PARTSIZE (ObjectHash::SIZE + 4)
+
 const string
 LargeBlob::getBlob()
 {
     strwstream ss;
+    ss.write(LBLOB_MAGIC, 4);
+    ss.writeUInt32(LBLOB_VERSION);
     ss.writeHash(totalHash);
 
     const size_t num = parts.size();
     ss.writeUInt64(num);
 
     for (auto &it : parts) {
-        ss.writeHash(it.second.hash);
-        ss.writeUInt16(it.second.length);
+        ss.writeHash(it.hash);
+        ss.writeUInt32(it.length);
     }
 
     return ss.str();
 }
 
+/*
+ * A version 1 manifest starts with the total hash, so the magic alone could
+ * match by chance.  The size must also agree with the part count.
+ */
+static bool
+_isV2Manifest(const string &blob)
+{
+    if (blob.size() < LBLOB_V2_HDRSIZE ||
+        memcmp(blob.data(), LBLOB_MAGIC, 4) != 0)
+        return false;
+
+    strstream ss(blob);
+    uint8_t magic[4];
+    ObjectHash hash;
+    ss.readExact(magic, 4);
+    if (ss.readUInt32() != LBLOB_VERSION)
+        return false;
+    ss.readHash(hash);
+
+    const uint64_t num = ss.readUInt64();
+    return (blob.size() - LBLOB_V2_HDRSIZE) / LBLOB_V2_PARTSIZE == num &&
+           (blob.size() - LBLOB_V2_HDRSIZE) % LBLOB_V2_PARTSIZE == 0;
+}
+
 void
 LargeBlob::fromBlob(const string &blob)
 {
     strstream ss(blob);
+    bool v2 = _isV2Manifest(blob);
+
+    if (v2) {
+        uint8_t magic[4];
+        ss.readExact(magic, 4);
+        ss.readUInt32();
+    }
     ss.readHash(totalHash);
 
     const size_t num = ss.readUInt64();
 
+    parts.clear();
+    parts.reserve(num);
+
     uint64_t off = 0;
     for (size_t i = 0; i < num; i++) {
         ObjectHash hash;
         ss.readHash(hash);
-        const size_t length = ss.readUInt16();
+        const uint32_t length = v2 ? ss.readUInt32() : ss.readUInt16();
 
-        parts.insert(make_pair(off, LBlobEntry(hash, length)));
+        parts.push_back(LBlobEntry(hash, off, length));
 
         off += length;
     }
@@ -335,11 +867,241 @@ LargeBlob::fromBlob(const string &blob)
 size_t
 LargeBlob::totalSize() const
 {
+    if (parts.empty())
+        return 0;
+
+    return parts.back().offset + parts.back().length;
+}
+
+/********************************************************************
+ *
+ *
+ * LargeBlobReader
+ *
+ *
+ ********************************************************************/
+
+class LargeBlobPrefetcher : public Thread
+{
+public:
+    LargeBlobPrefetcher(LargeBlobReader *r)
+        : Thread("LargeBlobPrefetcher"), reader(r)
+    {
+    }
+    virtual void run() override
+    {
+        reader->prefetchLoop();
+    }
+private:
+    LargeBlobReader *reader;
+};
+
+LargeBlobReader::LargeBlobReader(Repo *r, shared_ptr<const LargeBlob> l,
+                                 RWLock *rl)
+    : repo(r), lb(l), repoLock(rl), nextReadOff(0), prefetchedTo(0),
+      sequential(0), stopping(false), prefetcher(nullptr)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+LargeBlobReader::~LargeBlobReader()
+{
+    if (prefetcher) {
+        {
+            unique_lock<mutex> l(lock);
+            stopping = true;
+        }
+        prefetchCV.notify_all();
+        prefetcher->wait();
+        delete prefetcher;
+    }
+}
+
+ssize_t
+LargeBlobReader::read(uint8_t *buf, size_t s, off_t off)
+{
+    unique_lock<mutex> l(lock);
     size_t total = 0;
-    for (auto const &it : parts) {
-        total += it.second.length;
+
+    if (off < 0)
+        return -EIO;
+
+    while (total < s) {
+        const uint64_t pos = off + total;
+        vector<LBlobEntry>::const_iterator it = lb->findPart(pos);
+        if (it == lb->parts.end())
+            break;
+
+        Chunk c = getChunk(l, *it);
+        const size_t partOff = pos - (*it).offset;
+        const size_t len = MIN(c->size() - partOff, s - total);
+
+        memcpy(buf + total, c->data() + partOff, len);
+        total += len;
+    }
+
+    // Detect sequential access and keep the next chunks coming
+    if ((uint64_t)off == nextReadOff && off != 0) {
+        sequential++;
+    } else {
+        sequential = 0;
+        prefetchedTo = 0;
     }
+    nextReadOff = off + total;
+    if (sequential >= LBLOB_READER_SEQREADS && total != 0)
+        schedule(nextReadOff);
 
     return total;
 }
 
+LargeBlobReader::Stats
+LargeBlobReader::getStats()
+{
+    unique_lock<mutex> l(lock);
+    return stats;
+}
+
+/*
+ * Returns a decoded chunk, fetching it with the lock dropped if needed.  We
+ * never wait on the prefetcher since it may itself be waiting on repoLock.
+ */
+LargeBlobReader::Chunk
+LargeBlobReader::getChunk(unique_lock<mutex> &l, const LBlobEntry &e)
+{
+    map<uint64_t, Chunk>::iterator it = window.find(e.offset);
+    if (it != window.end()) {
+        stats.hits++;
+        return (*it).second;
+    }
+
+    stats.misses++;
+    l.unlock();
+    Chunk c;
+    try {
+        c = fetch(e);
+    } catch (...) {
+        l.lock();
+        throw;
+    }
+    l.lock();
+    insert(e.offset, c);
+
+    return c;
+}
+
+LargeBlobReader::Chunk
+LargeBlobReader::fetch(const LBlobEntry &e)
+{
+    Object::sp o(repo->getObject(e.hash));
+    if (!o) {
+        WARNING("Missing large blob part %s", e.hash.hex().c_str());
+        throw SystemException(EIO);
+    }
+    ASSERT(o->getInfo().type == ObjectInfo::Blob);
+
+    Chunk c = make_shared<const string>(o->getPayload());
+    if (c->size() != e.length) {
+        WARNING("Large blob part %s has the wrong length",
+                e.hash.hex().c_str());
+        throw SystemException(EIO);
+    }
+
+    return c;
+}
+
+void
+LargeBlobReader::insert(uint64_t off, Chunk c)
+{
+    if (!window.insert(make_pair(off, c)).second)
+        return;
+
+    windowOrder.push_back(off);
+    while (windowOrder.size() > LBLOB_READER_WINDOW) {
+        window.erase(windowOrder.front());
+        windowOrder.pop_front();
+    }
+}
+
+/*
+ * Queue the chunks following nextOff for prefetching, called with the lock
+ * held.
+ */
+void
+LargeBlobReader::schedule(uint64_t nextOff)
+{
+    vector<LBlobEntry>::const_iterator it = lb->findPart(nextOff);
+    bool queued = false;
+
+    for (int i = 0; i < LBLOB_READAHEAD && it != lb->parts.end(); i++, ++it) {
+        const uint64_t off = (*it).offset;
+
+        if (off < prefetchedTo)
+            continue;
+        prefetchedTo = off + 1;
+        if (window.count(off) != 0 || pending.count(off) != 0)
+            continue;
+
+        pending.insert(off);
+        prefetchQueue.push_back(off);
+        queued = true;
+    }
+
+    if (!queued)
+        return;
+
+    if (!prefetcher) {
+        prefetcher = new LargeBlobPrefetcher(this);
+        prefetcher->start();
+    }
+    prefetchCV.notify_one();
+}
+
+void
+LargeBlobReader::prefetchLoop()
+{
+    unique_lock<mutex> l(lock);
+
+    while (true) {
+        prefetchCV.wait(l, [this]() {
+            return stopping || !prefetchQueue.empty();
+        });
+        if (stopping)
+            return;
+
+        const uint64_t off = prefetchQueue.front();
+        prefetchQueue.pop_front();
+        if (window.count(off) != 0) {
+            pending.erase(off);
+            continue;
+        }
+
+        vector<LBlobEntry>::const_iterator it = lb->findPart(off);
+        ASSERT(it != lb->parts.end() && (*it).offset == off);
+
+        l.unlock();
+        Chunk c;
+        try {
+            /*
+             * Never block on repoLock, the writer holding it may be waiting
+             * for this reader to be destroyed.  Skipped chunks are simply
+             * read on demand.
+             */
+            RWKey::sp key;
+            if (repoLock)
+                key = repoLock->tryReadLock();
+            if (!repoLock || key)
+                c = fetch(*it);
+        } catch (exception &e) {
+            // The read that needs the chunk will report the error
+            WARNING("Large blob prefetch failed: %s", e.what());
+        }
+        l.lock();
+
+        pending.erase(off);
+        if (c) {
+            stats.prefetched++;
+            insert(off, c);
+        }
+    }
+}
+
@@ -43,6 +43,7 @@
 #include "tuneables.h"
 
 #include <oriutil/debug.h>
+#include <oriutil/codec.h>
 #include <ori/object.h>
 #include <ori/localobject.h>
 
@@ -51,14 +52,13 @@ using namespace std;
 /*
  * Object
  */
-LocalObject::LocalObject(PfTransaction::sp transaction, size_t ix)
-    : Object(transaction->infos[ix]), transaction(transaction), ix_tr(ix),
-      packfile()
+LocalObject::LocalObject(const ObjectInfo &info, const string &stored)
+    : Object(info), staged(true), stored(stored), packfile()
 {
 }
 
 LocalObject::LocalObject(Packfile::sp packfile, const IndexEntry &entry)
-    : Object(entry.info), packfile(packfile), entry(entry)
+    : Object(entry.info), staged(false), packfile(packfile), entry(entry)
 {
 }
 
@@ -66,22 +66,12 @@ LocalObject::~LocalObject()
 {
 }
 
-// XXX: Eliminate duplicate compression code!
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
         return packfile->getPayload(entry);
     }
-    if (transaction.get()) {
-        switch(info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
+    if (staged) {
+        return Codec_DecompressStream(info, new strstream(stored));
     }
     return nullptr;
 }
@@ -15,6 +15,8 @@
  */
 
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -34,6 +36,12 @@
 #include <iomanip>
 #include <iostream>
 #include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "tuneables.h"
 
 #include <ori/version.h>
 #include <oriutil/debug.h>
@@ -197,6 +205,7 @@ LocalRepoLock::~LocalRepoLock()
 
 LocalRepo::LocalRepo(const string &root)
     : opened(false),
+      codec(Codec_Default()),
       remoteRepo(nullptr)
 {
     rootPath = (root == "") ? findRootPath() : root;
@@ -271,6 +280,24 @@ LocalRepo::open(const string &root)
         throw e;
     }
     packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
+    index.setAccounting(packfiles.get());
+    if (!packfiles->hasPackStats())
+        rebuildPackStats();
+
+    // Codec for new objects, objects written with any codec stay readable
+    codec = Codec_Default();
+    const std::string codec_path = rootPath + ORI_PATH_CODEC;
+    if (OriFile_Exists(codec_path)) {
+        string name = OriFile_ReadFile(codec_path);
+        name.erase(name.find_last_not_of(" \n") + 1);
+        const Codec *c = Codec_Lookup(name);
+        if (c != nullptr) {
+            codec = c;
+        } else {
+            WARNING("LocalRepo::open: Codec '%s' is not supported, using %s",
+                    name.c_str(), codec->getName());
+        }
+    }
 
     // Scan for peers
     const std::string peer_path = rootPath + ORI_PATH_REMOTES;
@@ -301,7 +328,18 @@ LocalRepo::close()
 
     sync();
 
-    currTransaction.reset();
+    CompressionMemo::Stats cs = compressionMemo.getStats();
+    for (int i = 0; i < CompressionMemo::COMPPATH_MAX; i++) {
+        if (cs.paths[i] == 0)
+            continue;
+        LOG("Compression decisions (%s): %llu",
+            CompressionMemo::getStrForPath((CompressionMemo::Path)i),
+            (unsigned long long)cs.paths[i]);
+    }
+
+    writers.clear();
+    idleWriters.clear();
+    index.setAccounting(nullptr);
     index.close();
     snapshots.close();
     packfiles.reset();
@@ -426,11 +464,10 @@ LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
 {
     ASSERT(opened);
 
-    if (currTransaction.get()) {
-        if (currTransaction->has(objId)) {
-            return LocalObject::sp(new LocalObject(currTransaction,
-                        currTransaction->hashToIx[objId]));
-        }
+    ObjectInfo info;
+    string stored;
+    if (getStagedObject(objId, &info, &stored)) {
+        return LocalObject::sp(new LocalObject(info, stored));
     }
 
     /*
@@ -491,31 +528,21 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     ASSERT(opened);
     ASSERT(!hash.isEmpty());
 
-    purged.erase(hash);
+    if (!claimObject(hash)) return 0;
 
-    if (isObjectStored(hash)) return 0;
-
-    if (!currPackfile.get()) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
-    }
+    try {
+        ObjectInfo info(hash);
+        info.type = type;
+        info.payload_size = payload.size();
 
-    if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+        string stored = PfTransaction::preparePayload(info, payload, codec,
+                                                      &compressionMemo);
+        addStagedObject(info, stored);
+    } catch (...) {
+        releaseObject(hash);
+        throw;
     }
-
-    ObjectInfo info(hash);
-    info.type = type;
-    info.payload_size = payload.size();
-
-    currTransaction->addPayload(info, payload);
+    releaseObject(hash);
 
 
     /*string objPath = objIdToPath(hash);
@@ -535,6 +562,249 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     return 0;
 }
 
+int
+LocalRepo::addFileObject(const ObjectHash &hash, const string &payload,
+        const string &fileType)
+{
+    ASSERT(opened);
+    ASSERT(!hash.isEmpty());
+
+    if (!claimObject(hash)) return 0;
+
+    try {
+        ObjectInfo info(hash);
+        info.type = ObjectInfo::Blob;
+        info.payload_size = payload.size();
+
+        string stored = PfTransaction::preparePayload(info, payload, codec,
+                                                      &compressionMemo,
+                                                      fileType);
+        addStagedObject(info, stored);
+    } catch (...) {
+        releaseObject(hash);
+        throw;
+    }
+    releaseObject(hash);
+
+    return 0;
+}
+
+int
+LocalRepo::addPreparedObject(const ObjectInfo &info, const string &payload,
+        const string &stored)
+{
+    ASSERT(opened);
+    ASSERT(!info.hash.isEmpty());
+    ASSERT(info.payload_size == payload.size());
+
+    if (!claimObject(info.hash)) return 0;
+
+    try {
+        addStagedObject(info, stored);
+    } catch (...) {
+        releaseObject(info.hash);
+        throw;
+    }
+    releaseObject(info.hash);
+
+    return 0;
+}
+
+void
+LocalRepo::setCodec(const Codec *c)
+{
+    ASSERT(opened);
+    ASSERT(c != nullptr);
+
+    if (!OriFile_WriteFile(c->getName(), rootPath + ORI_PATH_CODEC))
+        throw SystemException();
+
+    // Start new transactions so the codec applies to new objects
+    commitWriters();
+    codec = c;
+}
+
+/*
+ * Checks out an idle packfile writer or creates one, the pool grows to the
+ * number of threads that write concurrently.
+ */
+LocalRepo::PackWriter::sp
+LocalRepo::acquireWriter()
+{
+    PackWriter::sp w;
+
+    writersLock.lock();
+    if (!idleWriters.empty()) {
+        w = idleWriters.back();
+        idleWriters.pop_back();
+    } else {
+        w.reset(new PackWriter());
+        writers.push_back(w);
+    }
+    writersLock.unlock();
+
+    w->lock.lock();
+    return w;
+}
+
+void
+LocalRepo::releaseWriter(PackWriter::sp w)
+{
+    w->lock.unlock();
+
+    writersLock.lock();
+    idleWriters.push_back(w);
+    writersLock.unlock();
+}
+
+/*
+ * Makes sure the writer has a transaction with room left, committing a full
+ * one and starting a new packfile once the current one is full.
+ */
+void
+LocalRepo::openTransaction(PackWriter::sp w)
+{
+    if (w->tr.get() && !w->tr->full())
+        return;
+
+    /*
+     * Committing publishes the objects to the index, the transaction stays
+     * visible to lookups until it is replaced so there is no window in which
+     * an object is in neither.
+     */
+    if (w->tr.get())
+        w->tr->commit();
+    if (!w->pf.get() || w->pf->full()) {
+        // Under the lock so gc never sees a packfile without its writer
+        writersLock.lock();
+        w->pf = packfiles->newPackfile();
+        writersLock.unlock();
+    }
+
+    PfTransaction::sp tr = w->pf->begin(&index, codec, &compressionMemo);
+    writersLock.lock();
+    w->tr = tr;
+    writersLock.unlock();
+}
+
+/*
+ * Claims an object for the calling thread so that concurrent adds of the same
+ * object store it once.  A thread that finds the object claimed waits for the
+ * claim to be dropped, so every add returns with the object staged.  Fails if
+ * the object is already stored.  The claim is dropped by releaseObject once
+ * the object is staged, the check after claiming therefore cannot miss an
+ * object added by a previous claimant.
+ */
+bool
+LocalRepo::claimObject(const ObjectHash &hash)
+{
+    if (isObjectStored(hash))
+        return false;
+
+    writersLock.lock();
+    while (claimedObjects.count(hash) != 0)
+        claimsCV.wait(writersLock);
+    claimedObjects.insert(hash);
+    writersLock.unlock();
+
+    if (isObjectStored(hash)) {
+        releaseObject(hash);
+        return false;
+    }
+
+    return true;
+}
+
+void
+LocalRepo::releaseObject(const ObjectHash &hash)
+{
+    writersLock.lock();
+    claimedObjects.erase(hash);
+    writersLock.unlock();
+    claimsCV.notify_all();
+}
+
+/*
+ * Stages an object prepared by PfTransaction::preparePayload.  Compression
+ * happens before a writer is checked out so it runs in parallel.
+ */
+void
+LocalRepo::addStagedObject(const ObjectInfo &info, const string &stored)
+{
+    PackWriter::sp w = acquireWriter();
+
+    try {
+        openTransaction(w);
+        w->tr->addPreparedPayload(info, stored);
+    } catch (...) {
+        releaseWriter(w);
+        throw;
+    }
+
+    releaseWriter(w);
+}
+
+/*
+ * Looks for an object in the uncommitted transactions of all writers.  The
+ * transactions must be checked before the index.
+ */
+bool
+LocalRepo::getStagedObject(const ObjectHash &objId, ObjectInfo *info,
+                           string *stored)
+{
+    vector<PfTransaction::sp> trs;
+
+    writersLock.lock();
+    for (size_t i = 0; i < writers.size(); i++) {
+        if (writers[i]->tr.get())
+            trs.push_back(writers[i]->tr);
+    }
+    writersLock.unlock();
+
+    for (size_t i = 0; i < trs.size(); i++) {
+        if (info == nullptr) {
+            if (trs[i]->has(objId))
+                return true;
+        } else if (trs[i]->get(objId, info, stored)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Commits the transactions of all writers, waiting for writers that are in
+ * use by other threads.  The packfiles stay open for the next transaction.
+ */
+void
+LocalRepo::commitWriters()
+{
+    vector<PackWriter::sp> all;
+
+    writersLock.lock();
+    all = writers;
+    writersLock.unlock();
+
+    for (size_t i = 0; i < all.size(); i++) {
+        PackWriter::sp w = all[i];
+
+        w->lock.lock();
+        if (w->tr.get()) {
+            try {
+                w->tr->commit();
+            } catch (...) {
+                w->lock.unlock();
+                throw;
+            }
+            writersLock.lock();
+            w->tr.reset();
+            writersLock.unlock();
+        }
+        w->lock.unlock();
+    }
+}
+
 /*
  * Add a tree to the repository.
  */
@@ -706,10 +976,10 @@ LocalRepo::verifyObject(const ObjectHash &objId)
         {
             LargeBlob lb(this);
             lb.fromBlob(o->getPayload());
-            for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+            for (vector<LBlobEntry>::iterator it = lb.parts.begin();
                  it != lb.parts.end(); it++)
             {
-                if (it->second.hash.isEmpty()) {
+                if (it->hash.isEmpty()) {
                     return "LargeBlob contains an empty hash!";
                 }
             }
@@ -770,18 +1040,10 @@ LocalRepo::listObjects()
 void
 LocalRepo::sync()
 {
-    bool full = false;
-    if (currTransaction.get()) {
-        full = currTransaction->full();
-        currTransaction->commit();
-        currTransaction.reset();
-        index.sync();
-        metadata.sync();
-    }
-    if (full) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
+    commitWriters();
+    index.sync();
+    packfiles->syncPackStats();
+    metadata.sync();
 }
 
 struct RebuildIndexStruct
@@ -811,6 +1073,7 @@ LocalRepo::rebuildIndex()
     index.close();
 
     OriFile_Delete(indexPath);
+    OriFile_Delete(indexPath + INDEX_BASE_EXT);
 
     index.open(indexPath);
 
@@ -825,10 +1088,60 @@ LocalRepo::rebuildIndex()
         ris.id = *it;
         pf->readEntries(rebuildIndexCb, (void *)&ris);
     }
+
+    // Move the rebuilt entries into a sorted base
+    index.rewrite();
+    rebuildPackStats();
     
     return true;
 }
 
+/*
+ * Recounts the live and dead bytes of every packfile.  An object is live
+ * while the index points at its copy in the pack.
+ */
+void
+LocalRepo::rebuildPackStats()
+{
+    std::vector<packid_t> pfIds = packfiles->getPackfileList();
+    std::map<packid_t, PackfileManager::PackStats> stats;
+
+    for (size_t i = 0; i < pfIds.size(); i++) {
+        Packfile::sp pf = packfiles->getPackfile(pfIds[i]);
+        std::vector<IndexEntry> entries = pf->getEntries();
+        PackfileManager::PackStats &st = stats[pfIds[i]];
+
+        st.live = 0;
+        st.dead = 0;
+        for (size_t j = 0; j < entries.size(); j++) {
+            const IndexEntry &e = entries[j];
+            bool live = false;
+            if (index.hasObject(e.info.hash)) {
+                IndexEntry ie = index.getEntry(e.info.hash);
+                live = ie.packfile == e.packfile && ie.offset == e.offset;
+            }
+            if (live)
+                st.live += e.packed_size;
+            else
+                st.dead += e.packed_size;
+        }
+    }
+
+    packfiles->setPackStats(stats);
+}
+
+std::map<packid_t, PackfileManager::PackStats>
+LocalRepo::getPackStats()
+{
+    return packfiles->getPackStats();
+}
+
+PackfileManager::Stats
+LocalRepo::getPackCacheStats()
+{
+    return packfiles->getStats();
+}
+
 void
 LocalRepo::dumpIndex()
 {
@@ -884,10 +1197,8 @@ LocalRepo::listSnapshots()
 ObjectHash
 LocalRepo::lookupSnapshot(const std::string &name)
 {
-    const auto snaps = snapshots.getList();
-    const auto it = snaps.find(name);
-    if (it != snaps.end())
-        return (*it).second;
+    if (snapshots.hasSnapshot(name))
+        return snapshots.getSnapshot(name);
 
     return ObjectHash();
 }
@@ -899,87 +1210,287 @@ LocalRepo::lookupSnapshot(const std::string &name)
 /*
  * Pull changes from the source repository.
  */
+/*
+ * Fetches objects from the remote and stores them, objs is cleared.  @returns
+ * false if the remote did not answer, its response was cut short, aborted or
+ * corrupt, or it left out any of the objects, in which case only the intact
+ * groups before the failure are kept.
+ */
+bool
+LocalRepo::pullObjects(Repo *r, ObjectHashVec &objs)
+{
+    if (objs.empty())
+        return true;
+
+    bytestream::ap bs(r->getObjects(objs));
+    if (!bs.get()) {
+        WARNING("Could not fetch %zu objects from the remote", objs.size());
+        return false;
+    }
+    try {
+        receive(bs.get());
+    } catch (std::exception &e) {
+        WARNING("Could not receive %zu objects from the remote: %s",
+                objs.size(), e.what());
+        return false;
+    }
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (!isObjectStored(objs[i])) {
+            WARNING("The remote did not send object %s",
+                    objs[i].hex().c_str());
+            return false;
+        }
+    }
+    objs.clear();
+
+    return true;
+}
+
+/*
+ * Commits to offer as haves when pulling wants.  Only the frontier is sent:
+ * the parents of wanted commits that are not wanted themselves and whose
+ * objects are all stored locally, or the local head if there are none.  The
+ * remote walks the tree of every have, offering all complete commits would
+ * make each pull cost as much as the history.  Commits that are being or
+ * have been purged, and commits from an interrupted pull, which have no
+ * status yet, are not complete.
+ */
+ObjectHashVec
+LocalRepo::listHaves(const vector<Commit> &wants)
+{
+    unordered_set<ObjectHash> wanted;
+    unordered_set<ObjectHash> seen;
+    ObjectHashVec haves;
+
+    auto complete = [&](const ObjectHash &hash) {
+        string status = metadata.getMeta(hash, "status");
+        return status != "" && status != "purging" && status != "purged";
+    };
+
+    for (size_t i = 0; i < wants.size(); i++)
+        wanted.insert(wants[i].hash());
+
+    for (size_t i = 0; i < wants.size(); i++) {
+        pair<ObjectHash, ObjectHash> p = wants[i].getParents();
+        ObjectHash parents[2] = { p.first, p.second };
+
+        for (int k = 0; k < 2; k++) {
+            const ObjectHash &h = parents[k];
+            if (h.isEmpty() || wanted.count(h) != 0 || !seen.insert(h).second)
+                continue;
+            if (complete(h))
+                haves.push_back(h);
+        }
+    }
+
+    if (haves.empty()) {
+        ObjectHash head = getHead();
+        if (!head.isEmpty() && complete(head))
+            haves.push_back(head);
+    }
+
+    return haves;
+}
+
+/*
+ * The frontier of the local complete commits is offered to the remote as
+ * haves so that it can send every object reachable from the wanted commits
+ * but not from the haves in a single response.  Objects the remote sends
+ * anyway are skipped when they are received.
+ *
+ * The wanted commits are then walked breadth first whether or not the
+ * negotiation succeeded, which checks that everything they reference is
+ * stored and fetches what a cut short response or a remote that cannot
+ * negotiate left out.  Stored trees are descended into as well, but each
+ * tree is compared with the tree at the same path in a base commit (a parent
+ * that is complete or pulled along) and entries both share are skipped, so
+ * the walk of stored objects is proportional to the changes.  Commits,
+ * trees and large blobs of one level are requested together in batches of
+ * PULL_BATCHOBJS since they must be parsed to find the next level.  Blobs
+ * and large blob chunks are leaves, they are collected across levels and
+ * requested once a batch reaches PULL_BATCHOBJS objects or PULL_BATCHBYTES
+ * bytes, which also bounds the size of a response.  The number of requests
+ * thereby depends on the depth of the trees and the amount of data rather
+ * than on the number of trees.  The commits only get their status once the
+ * walk has completed, a failed pull leaves them without one.
+ */
 void
 LocalRepo::pull(Repo *r)
 {
     vector<Commit> remoteCommits = r->listCommits();
-    deque<ObjectHash> toPull;
+    unordered_map<ObjectHash, ObjectHash> wantedTrees;
+    unordered_set<ObjectHash> queued;
+    // Objects to parse with the object they are compared against
+    vector<pair<ObjectHash, ObjectHash> > level;
+    ObjectHashVec blobs;
+    uint64_t blobBytes = 0;
+    size_t requests = 0;
 
     deque<Commit> newCommits;
+    vector<Commit> wants;
 
+    /*
+     * Commits of an interrupted pull are stored but have no status yet, they
+     * are pulled again to complete them.
+     */
     for (size_t i = 0; i < remoteCommits.size(); i++) {
         const ObjectHash hash = remoteCommits[i].hash();
-        if (!hasObject(hash)) {
-            toPull.push_back(hash);
+        if (metadata.getMeta(hash, "status") == "" &&
+            queued.insert(hash).second) {
+            wants.push_back(remoteCommits[i]);
+            wantedTrees[hash] = remoteCommits[i].getTree();
 
             // TODO: partial pull
         }
     }
+    if (wants.empty())
+        return;
 
-    //LocalRepoLock::sp _lock(lock());
+    // The tree of the first parent that is complete or pulled along
+    for (size_t i = 0; i < wants.size(); i++) {
+        pair<ObjectHash, ObjectHash> p = wants[i].getParents();
+        ObjectHash parents[2] = { p.first, p.second };
+        ObjectHash baseTree;
 
-    bytestream::ap objs(r->getObjects(toPull));
-    receive(objs.get());
+        for (int k = 0; k < 2 && baseTree.isEmpty(); k++) {
+            const ObjectHash &h = parents[k];
+            if (h.isEmpty())
+                continue;
+            if (wantedTrees.count(h) != 0) {
+                baseTree = wantedTrees[h];
+            } else {
+                string status = metadata.getMeta(h, "status");
+                if (status != "" && status != "purging" && status != "purged")
+                    baseTree = getCommit(h).getTree();
+            }
+        }
+        level.push_back(make_pair(wants[i].hash(), baseTree));
+    }
 
-    // Perform the pull
-    while (!toPull.empty()) {
-        ObjectHash hash = toPull.front();
-        toPull.pop_front();
+    //LocalRepoLock::sp _lock(lock());
 
-        Object::sp o(getObject(hash));
-        if (!o) {
-            printf("Error getting object %s\n", hash.hex().c_str());
-            continue;
+    ObjectHashVec wantHashes;
+    for (size_t i = 0; i < wants.size(); i++)
+        wantHashes.push_back(wants[i].hash());
+    bytestream::ap bs(r->getMissingObjects(wantHashes, listHaves(wants)));
+    if (bs.get()) {
+        try {
+            receive(bs.get());
+            DLOG("Pulled %zu commits in one request", wants.size());
+        } catch (std::exception &e) {
+            // The walk fetches whatever did not arrive intact
+            WARNING("Negotiated pull failed (%s), walking the remote instead",
+                    e.what());
         }
+    }
 
-        // Enqueue the object's references
-        ObjectType t = o->getInfo().type;
-        /*printf("Pulling object %s (%s)\n", hash.c_str(),
-                Object::getStrForType(t));*/
-
-        vector<ObjectHash> newObjs;
-        if (t == ObjectInfo::Commit) {
-            Commit c;
-            c.fromBlob(o->getPayload());
-            if (!hasObject(c.getTree())) {
-                toPull.push_back(c.getTree());
-                newObjs.push_back(c.getTree());
+    // Perform the pull
+    while (!level.empty()) {
+        vector<pair<ObjectHash, ObjectHash> > next;
+
+        for (size_t i = 0; i < level.size(); i += PULL_BATCHOBJS) {
+            const size_t end = MIN(i + PULL_BATCHOBJS, level.size());
+            ObjectHashVec batch;
+            for (size_t j = i; j < end; j++) {
+                if (!isObjectStored(level[j].first))
+                    batch.push_back(level[j].first);
             }
-            newCommits.push_back(c);
-        } else if (t == ObjectInfo::Tree) {
-            Tree t;
-            t.fromBlob(o->getPayload());
-            for (map<string, TreeEntry>::iterator it = t.tree.begin();
-                    it != t.tree.end();
-                    it++) {
-                const ObjectHash &entry_hash = (*it).second.hash;
-                if (!hasObject(entry_hash)) {
-                    if ((*it).second.type != TreeEntry::Blob) {
-                        toPull.push_back(entry_hash);
+            if (!batch.empty()) {
+                requests++;
+                if (!pullObjects(r, batch))
+                    return;
+            }
+
+            for (size_t j = i; j < end; j++) {
+                const ObjectHash &hash = level[j].first;
+                const ObjectHash &baseHash = level[j].second;
+                Object::sp o(getObject(hash));
+                if (!o) {
+                    WARNING("Pull incomplete, cannot read object %s",
+                            hash.hex().c_str());
+                    return;
+                }
+
+                // Enqueue the object's references
+                ObjectType t = o->getInfo().type;
+                vector<pair<ObjectHash, uint64_t> > leaves;
+                if (t == ObjectInfo::Commit) {
+                    Commit c;
+                    c.fromBlob(o->getPayload());
+                    const ObjectHash &tree = c.getTree();
+                    if (tree != baseHash && queued.insert(tree).second)
+                        next.push_back(make_pair(tree, baseHash));
+                    newCommits.push_back(c);
+                } else if (t == ObjectInfo::Tree) {
+                    Tree t, base;
+                    t.fromBlob(o->getPayload());
+                    // A base that is not stored yet is not compared against
+                    if (!baseHash.isEmpty() && isObjectStored(baseHash))
+                        base = getTree(baseHash);
+                    for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                            it != t.tree.end();
+                            it++) {
+                        const TreeEntry &te = (*it).second;
+                        map<string, TreeEntry>::iterator bit =
+                            base.tree.find((*it).first);
+                        ObjectHash teBase;
+                        if (bit != base.tree.end()) {
+                            if ((*bit).second.hash == te.hash)
+                                continue;
+                            if ((*bit).second.type == te.type)
+                                teBase = (*bit).second.hash;
+                        }
+
+                        if (te.type != TreeEntry::Blob) {
+                            if (queued.insert(te.hash).second)
+                                next.push_back(make_pair(te.hash, teBase));
+                        } else {
+                            uint64_t size = 0;
+                            if (te.attrs.has(ATTR_FILESIZE))
+                                size = te.attrs.getAs<size_t>(ATTR_FILESIZE);
+                            leaves.push_back(make_pair(te.hash, size));
+                        }
+                    }
+                } else if (t == ObjectInfo::LargeBlob) {
+                    LargeBlob lb(this);
+                    lb.fromBlob(o->getPayload());
+
+                    for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
+                            pit != lb.parts.end();
+                            pit++) {
+                        leaves.push_back(make_pair((*pit).hash,
+                                                   (*pit).length));
                     }
-                    newObjs.push_back(entry_hash);
                 }
-            }
-        } else if (t == ObjectInfo::LargeBlob) {
-            LargeBlob lb(this);
-            lb.fromBlob(o->getPayload());
 
-            for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
-                    pit != lb.parts.end();
-                    pit++) {
-                const ObjectHash &h = (*pit).second.hash;
-                if (!hasObject(h)) {
-                    //toPull.push_back(h);
-                    newObjs.push_back(h);
+                for (size_t k = 0; k < leaves.size(); k++) {
+                    const ObjectHash &h = leaves[k].first;
+                    if (isObjectStored(h) || !queued.insert(h).second)
+                        continue;
+                    blobs.push_back(h);
+                    blobBytes += leaves[k].second;
+                    if (blobs.size() >= PULL_BATCHOBJS ||
+                        blobBytes >= PULL_BATCHBYTES) {
+                        requests++;
+                        if (!pullObjects(r, blobs))
+                            return;
+                        blobBytes = 0;
+                    }
                 }
             }
         }
 
-        if (newObjs.size() > 0) {
-            objs.reset(r->getObjects(newObjs));
-            receive(objs.get());
-        }
+        level.swap(next);
     }
+    if (!blobs.empty()) {
+        requests++;
+        if (!pullObjects(r, blobs))
+            return;
+    }
+    if (requests != 0) {
+        DLOG("Pulled %zu objects in %zu requests", queued.size(), requests);
+    }
+
     while (!newCommits.empty()) {
         Commit nc = newCommits.front();
         newCommits.pop_front();
@@ -1000,225 +1511,705 @@ LocalRepo::pull(Repo *r)
 }
 
 
-struct MultiPullOp {
-    MultiPullOp(LocalRepo &r)
-        : repo(r)
+/*
+ * Multi-source pull.  Every peer has a worker thread that owns the peer's
+ * connection and fetches batches from the peer's own request queue.  The
+ * calling thread discovers peers and assigns newly found objects to the peer
+ * expected to deliver them first given its queue and measured throughput,
+ * skipping peers whose object filter rules the object out.  Workers parse
+ * what they receive and hand the referenced objects back for assignment.
+ *
+ * An idle worker steals from the back of the longest queue of a busy peer,
+ * so a slow peer cannot hold up the pull.  Objects that a peer turns out not
+ * to have are assigned to another peer, and the queue of a peer that fails
+ * is reassigned as a whole.  Objects that no peer can provide are retried
+ * with refreshed filters every MULTIPULL_RETRY_SECS until new peers show up
+ * or MULTIPULL_GIVEUP_SECS pass without progress.
+ */
+class MultiPullOp;
+
+class MultiPullPeer : public Thread
+{
+public:
+    MultiPullPeer(MultiPullOp *op, RemoteRepo::sp remote, int distance,
+                  ObjectFilter::sp filter)
+        : Thread("MultiPullPeer"), remote(remote), distance(distance),
+          filter(filter), inflight(0), rate(0.0), received(0), stolen(0),
+          failed(false), filterGen(0), op(op)
     {
     }
-    LocalRepo &repo;
+    virtual void run() override;
+
+    RemoteRepo::sp remote;
+    int distance;
 
-    // Pull queue
-    deque<ObjectHash> toPull;
-    unordered_set<ObjectHash> toPullSet;
+    // Protected by the MultiPullOp lock
+    ObjectFilter::sp filter;
+    deque<ObjectHash> queue;
+    size_t inflight;
+    double rate; // Objects per second, 0 until measured
+    uint64_t received;
+    uint64_t stolen;
+    bool failed;
+    uint64_t filterGen;
+private:
+    MultiPullOp *op;
+
+    bool fetch(const ObjectHashVec &batch, ObjectHashVec &absent);
+};
 
-    // Remotes
-    std::vector<RemoteRepo::sp> remotes;
-    std::vector<int> distances;
-    vector<ObjectHashVec> toMultiPull;
+class MultiPullOp
+{
+public:
+    MultiPullOp(LocalRepo &r, RemoteRepo::sp defaultRemote)
+        : repo(r), defaultRemote(defaultRemote), done(false), filterGen(0),
+          retryGen(0), totalObjs(0), closerObjs(0)
+    {
+    }
+    ~MultiPullOp();
+    LocalRepo &repo;
+    RemoteRepo::sp defaultRemote;
+
+    void addPeer(RemoteRepo::sp remote);
+    void addCandidate(const OriPeer &peer);
+    void enqueue(const ObjectHash &hash);
+    /// Assigns objects until the pull completes, false if objects are missing
+    bool run(struct event_base *evbase);
+    void printStats();
+
+    // Worker interface
+    bool nextBatch(MultiPullPeer *p, ObjectHashVec &batch, uint64_t *gen);
+    void setFilter(MultiPullPeer *p, ObjectFilter::sp filter, uint64_t gen);
+    void completeBatch(MultiPullPeer *p, const ObjectHashVec &batch,
+                       const ObjectHashVec &absent,
+                       const ObjectHashVec &children, uint64_t us);
+    void failPeer(MultiPullPeer *p, const ObjectHashVec &batch);
+private:
+    mutex lock;
+    condition_variable workCV;
+    condition_variable stateCV;
 
+    // Sorted by distance
+    vector<MultiPullPeer *> peers;
     std::set<std::string> hostnames;
 
-    void addCandidate(const OriPeer &peer) {
-        std::stringstream ss;
-        ss << "http://" << peer.hostname << ":" << peer.port << "/";
+    deque<ObjectHash> pending;
+    unordered_set<ObjectHash> queued;
+    unordered_map<ObjectHash, std::set<MultiPullPeer *> > absentAt;
+    // Objects no peer can provide at the moment
+    vector<ObjectHash> parked;
+    bool done;
+    uint64_t filterGen;
+    uint64_t retryGen;
+    uint64_t totalObjs, closerObjs;
+
+    bool _mayHave(MultiPullPeer *p, const ObjectHash &hash);
+    MultiPullPeer *_choosePeer(const ObjectHash &hash);
+    bool _steal(MultiPullPeer *p, bool dryRun);
+    bool _busy();
+    bool _filtersCurrent();
+};
 
-        if (hostnames.find(ss.str()) != hostnames.end()) {
-            return;
+/*
+ * Objects referenced by a pulled object that are not stored yet.
+ */
+static void
+_multiPullChildren(LocalRepo &repo, const ObjectHash &hash,
+                   ObjectHashVec &children)
+{
+    LocalObject::sp obj(repo.getLocalObject(hash));
+    ObjectType t = obj->getInfo().type;
+    ObjectHashVec refs;
+
+    if (t == ObjectInfo::Commit) {
+        Commit c;
+        c.fromBlob(obj->getPayload());
+        refs.push_back(c.getTree());
+    }
+    else if (t == ObjectInfo::Tree) {
+        Tree t;
+        t.fromBlob(obj->getPayload());
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                it != t.tree.end();
+                it++) {
+            refs.push_back((*it).second.hash);
         }
+    }
+    else if (t == ObjectInfo::LargeBlob) {
+        LargeBlob lb(&repo);
+        lb.fromBlob(obj->getPayload());
 
-        RemoteRepo::sp remote(new RemoteRepo());
-        if (!remote->connect(ss.str())) {
-            fprintf(stderr, "Error connecting to %s\n", ss.str().c_str());
-            return;
-        }
-        int dist = remote->get()->distance();
-        hostnames.insert(ss.str());
-
-        // Insert in sorted order
-        bool inserted = false;
-        for (size_t i = 0; i < distances.size(); i++) {
-            if (distances[i] >= dist) {
-                distances.insert(distances.begin()+i, dist);
-                remotes.insert(remotes.begin()+i, remote);
-                toMultiPull.insert(toMultiPull.begin()+i, ObjectHashVec());
-
-                inserted = true;
-                break;
-            }
+        for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
+                pit != lb.parts.end();
+                pit++) {
+            refs.push_back((*pit).hash);
         }
-        if (!inserted) {
-            distances.push_back(dist);
-            remotes.push_back(remote);
-            toMultiPull.push_back(ObjectHashVec());
+    }
+
+    for (size_t i = 0; i < refs.size(); i++) {
+        if (!repo.hasObject(refs[i]))
+            children.push_back(refs[i]);
+    }
+}
+
+void
+MultiPullPeer::run()
+{
+    ObjectHashVec batch;
+    uint64_t gen;
+
+    while (op->nextBatch(this, batch, &gen)) {
+        ObjectHashVec absent, children;
+
+        try {
+            if (batch.empty()) {
+                op->setFilter(this, remote->get()->getObjectFilter(), gen);
+                continue;
+            }
+
+            Stopwatch sw;
+            sw.start();
+            if (!fetch(batch, absent)) {
+                op->failPeer(this, batch);
+                return;
+            }
+            sw.stop();
+
+            set<ObjectHash> absentSet(absent.begin(), absent.end());
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (absentSet.find(batch[i]) == absentSet.end())
+                    _multiPullChildren(op->repo, batch[i], children);
+            }
+            op->completeBatch(this, batch, absent, children,
+                              sw.getElapsedTime());
+        } catch (exception &e) {
+            WARNING("Pulling from %s failed: %s", remote->getURL().c_str(),
+                    e.what());
+            op->failPeer(this, batch);
+            return;
         }
+    }
+}
 
-        fprintf(stderr, "Discovered new peer %s (dist %d), now %lu peers\n",
-                ss.str().c_str(), dist, distances.size());
+/*
+ * A response leaves out the requested objects the peer lacks, so only when
+ * objects are missing afterwards does the peer get asked which of them it
+ * has.
+ */
+bool
+MultiPullPeer::fetch(const ObjectHashVec &batch, ObjectHashVec &absent)
+{
+    fprintf(stderr, "Pulling %lu objects from %s\n", batch.size(),
+            remote->getURL().c_str());
+    bytestream::ap bs(remote->get()->getObjects(batch));
+    if (!bs.get())
+        return false;
+    op->repo.receive(bs.get());
+
+    ObjectHashVec missing;
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (!op->repo.isObjectStored(batch[i]))
+            missing.push_back(batch[i]);
+    }
+    if (missing.empty())
+        return true;
+
+    vector<bool> has = remote->get()->hasObjects(missing);
+    ObjectHashVec retry;
+    for (size_t i = 0; i < missing.size(); i++) {
+        if (has[i])
+            retry.push_back(missing[i]);
+        else
+            absent.push_back(missing[i]);
     }
+    if (retry.empty())
+        return true;
 
-    void enqueue(const ObjectHash &hash) {
-        if (repo.hasObject(hash)) return;
-        if (toPullSet.find(hash) != toPullSet.end()) return;
-        toPull.push_back(hash);
-        toPullSet.insert(hash);
+    bs.reset(remote->get()->getObjects(retry));
+    if (!bs.get())
+        return false;
+    op->repo.receive(bs.get());
+    for (size_t i = 0; i < retry.size(); i++) {
+        if (!op->repo.isObjectStored(retry[i]))
+            absent.push_back(retry[i]);
     }
-};
+
+    return true;
+}
+
+MultiPullOp::~MultiPullOp()
+{
+    {
+        unique_lock<mutex> l(lock);
+        done = true;
+    }
+    workCV.notify_all();
+
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i]->wait();
+        delete peers[i];
+    }
+}
 
 void
-LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
+MultiPullOp::addPeer(RemoteRepo::sp remote)
 {
-    MultiPullOp mpo(*this);
+    int dist = remote->get()->distance();
+    ObjectFilter::sp filter = remote->get()->getObjectFilter();
+    MultiPullPeer *p = new MultiPullPeer(this, remote, dist, filter);
 
-    struct event_base *evbase = event_base_new();
-#ifndef WITHOUT_MDNS 
-    struct event *mdns_event = MDNS_Browse(evbase);
-    event_add(mdns_event, nullptr);
-    MDNS_RegisterBrowseCallback(std::bind(&MultiPullOp::addCandidate,
-                &mpo, std::placeholders::_1));
-#endif
+    unique_lock<mutex> l(lock);
+    vector<MultiPullPeer *>::iterator it = peers.begin();
+    while (it != peers.end() && (*it)->distance < dist)
+        it++;
+    peers.insert(it, p);
+    p->filterGen = filterGen;
 
-    mpo.remotes.push_back(defaultRemote);
-    mpo.distances.push_back(defaultRemote->get()->distance());
-    mpo.toMultiPull.push_back(ObjectHashVec());
+    // The new peer may have what the others lack
+    pending.insert(pending.end(), parked.begin(), parked.end());
+    parked.clear();
 
-    event_base_loop(evbase, EVLOOP_NONBLOCK);
+    p->start();
+    stateCV.notify_one();
+}
 
+void
+MultiPullOp::addCandidate(const OriPeer &peer)
+{
+    std::stringstream ss;
+    ss << "http://" << peer.hostname << ":" << peer.port << "/";
 
-    // Commits to pull
-    vector<Commit> remoteCommits = defaultRemote->get()->listCommits();
-    for (size_t i = 0; i < remoteCommits.size(); i++) {
-        ObjectHash hash = remoteCommits[i].hash();
-        mpo.enqueue(hash);
-        fprintf(stderr, "Adding %s (commit)\n", hash.hex().c_str());
-        // TODO: partial pull
+    if (hostnames.find(ss.str()) != hostnames.end()) {
+        return;
     }
 
-    size_t totalObjs = 0, closerObjs = 0;
-    LocalRepoLock::sp _lock(lock());
+    RemoteRepo::sp remote(new RemoteRepo());
+    if (!remote->connect(ss.str())) {
+        fprintf(stderr, "Error connecting to %s\n", ss.str().c_str());
+        return;
+    }
+    hostnames.insert(ss.str());
+    addPeer(remote);
 
-    while (!mpo.toPull.empty()) {
-        // Consolidate pulls from remote repos
-        while (!mpo.toPull.empty()) {
-            // Look for new peers
-            event_base_loop(evbase, EVLOOP_NONBLOCK);
-
-            ObjectHash hash = mpo.toPull.front();
-            mpo.toPull.pop_front();
-
-            // Find a source for this object
-            bool found = false;
-            for (size_t i = 0; i < mpo.distances.size(); i++) {
-                const RemoteRepo::sp &remote = mpo.remotes[i];
-                if (remote->get()->hasObject(hash)) {
-                    mpo.toMultiPull[i].push_back(hash);
-                    found = true;
-                    if (remote.get() != defaultRemote.get())
-                        closerObjs++;
-                    break;
-                }
-            }
-            if (!found) {
-                fprintf(stderr, "No source for %s\n",
-                        hash.hex().c_str());
-                // TODO: keep retrying?
-                mpo.toPull.push_back(hash);
-                sleep(1);
-                continue;
+    fprintf(stderr, "Discovered new peer %s, now %lu peers\n",
+            ss.str().c_str(), peers.size());
+}
+
+void
+MultiPullOp::enqueue(const ObjectHash &hash)
+{
+    unique_lock<mutex> l(lock);
+
+    if (queued.insert(hash).second)
+        pending.push_back(hash);
+}
+
+bool
+MultiPullOp::_mayHave(MultiPullPeer *p, const ObjectHash &hash)
+{
+    if (p->failed)
+        return false;
+    if (p->filter && !p->filter->mayContain(hash))
+        return false;
+
+    unordered_map<ObjectHash, std::set<MultiPullPeer *> >::iterator it;
+    it = absentAt.find(hash);
+    return it == absentAt.end() || it->second.count(p) == 0;
+}
+
+/*
+ * Picks the peer that would deliver the object first if it kept its
+ * current rate.  Unmeasured peers are assumed to be as fast as the fastest
+ * peer so that they are tried, and ties go to the closest peer.
+ */
+MultiPullPeer *
+MultiPullOp::_choosePeer(const ObjectHash &hash)
+{
+    MultiPullPeer *best = nullptr;
+    double bestCost = 0.0;
+    double maxRate = 0.0;
+
+    for (size_t i = 0; i < peers.size(); i++)
+        maxRate = MAX(maxRate, peers[i]->rate);
+    if (maxRate == 0.0)
+        maxRate = 1.0;
+
+    for (size_t i = 0; i < peers.size(); i++) {
+        MultiPullPeer *p = peers[i];
+        if (!_mayHave(p, hash))
+            continue;
+
+        double rate = p->rate > 0.0 ? p->rate : maxRate;
+        double cost = (p->queue.size() + p->inflight + 1) / rate;
+        if (best == nullptr || cost < bestCost) {
+            best = p;
+            bestCost = cost;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Moves up to half of the queue of a busy peer to p, taking only objects p
+ * may have.  Peers with longer queues are robbed first.
+ */
+bool
+MultiPullOp::_steal(MultiPullPeer *p, bool dryRun)
+{
+    vector<pair<size_t, MultiPullPeer *> > victims;
+
+    for (size_t i = 0; i < peers.size(); i++) {
+        MultiPullPeer *q = peers[i];
+        if (q == p || q->failed || q->inflight == 0 || q->queue.empty())
+            continue;
+        victims.push_back(make_pair(q->queue.size(), q));
+    }
+    sort(victims.rbegin(), victims.rend());
+
+    for (size_t i = 0; i < victims.size(); i++) {
+        deque<ObjectHash> &vq = victims[i].second->queue;
+        size_t want = MIN((vq.size() + 1) / 2, (size_t)PULL_BATCHOBJS);
+        deque<ObjectHash> keep;
+
+        // A dry run leaves the queues alone
+        if (dryRun) {
+            for (size_t j = vq.size(); j > 0; j--) {
+                if (_mayHave(p, vq[j - 1]))
+                    return true;
             }
+            continue;
+        }
 
-            totalObjs++;
+        while (!vq.empty() && p->queue.size() < want) {
+            if (_mayHave(p, vq.back()))
+                p->queue.push_back(vq.back());
+            else
+                keep.push_front(vq.back());
+            vq.pop_back();
+        }
+        vq.insert(vq.end(), keep.begin(), keep.end());
+        if (!p->queue.empty()) {
+            p->stolen += p->queue.size();
+            return true;
         }
+    }
 
-        assert(mpo.toPull.size() == 0);
-        mpo.toPullSet.clear();
+    return false;
+}
 
-        // Perform the pulls
-        for (size_t i = 0; i < mpo.toMultiPull.size(); i++) {
-            ObjectHashVec &hashes = mpo.toMultiPull[i];
-            if (hashes.size() == 0) continue;
+/*
+ * Returns the next batch for p.  An empty batch asks the worker to refresh
+ * its filter for generation gen.
+ */
+bool
+MultiPullOp::nextBatch(MultiPullPeer *p, ObjectHashVec &batch, uint64_t *gen)
+{
+    unique_lock<mutex> l(lock);
 
-            fprintf(stderr, "Pulling %lu objects from %s\n", hashes.size(),
-                    mpo.remotes[i]->getURL().c_str());
-            bytestream::ap bs(mpo.remotes[i]->get()->getObjects(hashes));
-            receive(bs.get());
+    batch.clear();
+    workCV.wait(l, [this, p]() {
+        return done || p->filterGen != filterGen || !p->queue.empty() ||
+               _steal(p, true);
+    });
+    if (done)
+        return false;
+    if (p->filterGen != filterGen) {
+        *gen = filterGen;
+        return true;
+    }
 
-            // Load more objects
-            for (size_t ix_h = 0; ix_h < hashes.size(); ix_h++) {
-                LocalObject::sp obj(getLocalObject(hashes[ix_h]));
-                ObjectType t = obj->getInfo().type;
+    if (p->queue.empty())
+        _steal(p, false);
+    while (!p->queue.empty() && batch.size() < PULL_BATCHOBJS) {
+        batch.push_back(p->queue.front());
+        p->queue.pop_front();
+    }
+    p->inflight = batch.size();
 
-                if (t == ObjectInfo::Commit) {
-                    Commit c;
-                    c.fromBlob(obj->getPayload());
-                    mpo.enqueue(c.getTree());
-                }
-                else if (t == ObjectInfo::Tree) {
-                    Tree t;
-                    t.fromBlob(obj->getPayload());
-                    for (map<string, TreeEntry>::iterator it = t.tree.begin();
-                            it != t.tree.end();
-                            it++) {
-                        const ObjectHash &entry_hash = (*it).second.hash;
-                        mpo.enqueue(entry_hash);
-                    }
-                }
-                else if (t == ObjectInfo::LargeBlob) {
-                    LargeBlob lb(this);
-                    lb.fromBlob(obj->getPayload());
+    return true;
+}
 
-                    for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
-                            pit != lb.parts.end();
-                            pit++) {
-                        const ObjectHash &h = (*pit).second.hash;
-                        mpo.enqueue(h);
-                    }
-                }
+void
+MultiPullOp::setFilter(MultiPullPeer *p, ObjectFilter::sp filter,
+                       uint64_t gen)
+{
+    unique_lock<mutex> l(lock);
+
+    p->filter = filter;
+    p->filterGen = gen;
+    stateCV.notify_one();
+}
+
+void
+MultiPullOp::completeBatch(MultiPullPeer *p, const ObjectHashVec &batch,
+                           const ObjectHashVec &absent,
+                           const ObjectHashVec &children, uint64_t us)
+{
+    unique_lock<mutex> l(lock);
+    size_t received = batch.size() - absent.size();
+
+    p->inflight = 0;
+    p->received += received;
+    totalObjs += received;
+    if (p->remote != defaultRemote)
+        closerObjs += received;
+
+    if (received != 0 && us != 0) {
+        double rate = received * 1000000.0 / us;
+        if (p->rate == 0.0)
+            p->rate = rate;
+        else
+            p->rate += (rate - p->rate) * MULTIPULL_RATE_WEIGHT;
+    }
+
+    for (size_t i = 0; i < absent.size(); i++) {
+        absentAt[absent[i]].insert(p);
+        pending.push_back(absent[i]);
+    }
+    for (size_t i = 0; i < children.size(); i++) {
+        if (queued.insert(children[i]).second)
+            pending.push_back(children[i]);
+    }
+
+    stateCV.notify_one();
+    // Idle peers may steal what is left of the queue
+    workCV.notify_all();
+}
+
+void
+MultiPullOp::failPeer(MultiPullPeer *p, const ObjectHashVec &batch)
+{
+    unique_lock<mutex> l(lock);
+
+    WARNING("Lost peer %s, reassigning %zu objects",
+            p->remote->getURL().c_str(), batch.size() + p->queue.size());
+    p->failed = true;
+    p->inflight = 0;
+    pending.insert(pending.end(), batch.begin(), batch.end());
+    pending.insert(pending.end(), p->queue.begin(), p->queue.end());
+    p->queue.clear();
+
+    stateCV.notify_one();
+}
+
+bool
+MultiPullOp::_busy()
+{
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (!peers[i]->failed &&
+            (peers[i]->inflight != 0 || !peers[i]->queue.empty()))
+            return true;
+    }
+    return false;
+}
+
+bool
+MultiPullOp::_filtersCurrent()
+{
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (!peers[i]->failed && peers[i]->filterGen != filterGen)
+            return false;
+    }
+    return true;
+}
+
+bool
+MultiPullOp::run(struct event_base *evbase)
+{
+    unique_lock<mutex> l(lock);
+    time_t stuckSince = 0;
+    time_t lastRetry = 0;
+
+    while (true) {
+        while (!pending.empty()) {
+            ObjectHash hash = pending.front();
+            pending.pop_front();
+
+            MultiPullPeer *p = _choosePeer(hash);
+            if (p == nullptr)
+                parked.push_back(hash);
+            else
+                p->queue.push_back(hash);
+        }
+        workCV.notify_all();
+
+        if (_busy()) {
+            stuckSince = 0;
+        } else if (parked.empty()) {
+            break;
+        } else {
+            time_t now = time(nullptr);
+
+            if (stuckSince == 0)
+                stuckSince = now;
+            if (now - stuckSince >= MULTIPULL_GIVEUP_SECS) {
+                for (size_t i = 0; i < parked.size(); i++)
+                    fprintf(stderr, "No source for %s\n",
+                            parked[i].hex().c_str());
+                return false;
             }
 
-            hashes.clear();
+            // Peers may have received the objects since
+            if (retryGen == filterGen) {
+                if (now - lastRetry >= MULTIPULL_RETRY_SECS) {
+                    filterGen++;
+                    lastRetry = now;
+                    workCV.notify_all();
+                }
+            } else if (_filtersCurrent()) {
+                retryGen = filterGen;
+                absentAt.clear();
+                pending.insert(pending.end(), parked.begin(), parked.end());
+                parked.clear();
+                continue;
+            }
         }
+
+        stateCV.wait_for(l, chrono::milliseconds(MULTIPULL_POLL_MS));
+
+        // Look for new peers
+        l.unlock();
+        event_base_loop(evbase, EVLOOP_NONBLOCK);
+        l.lock();
     }
 
-    printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
+    return true;
 }
 
 void
-LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
+MultiPullOp::printStats()
+{
+    unique_lock<mutex> l(lock);
+
+    for (size_t i = 0; i < peers.size(); i++) {
+        DLOG("%s: %" PRIu64 " objects (%" PRIu64 " stolen), %.0f objects/s%s",
+             peers[i]->remote->getURL().c_str(), peers[i]->received,
+             peers[i]->stolen, peers[i]->rate,
+             peers[i]->failed ? ", failed" : "");
+    }
+    printf("Speed-up: %" PRIu64 " of %" PRIu64 " objects\n",
+           closerObjs, totalObjs);
+}
+
+/*
+ * Peers are additional sources known in advance, more are discovered with
+ * mDNS while pulling.
+ */
+void
+LocalRepo::multiPull(RemoteRepo::sp defaultRemote,
+                     const vector<RemoteRepo::sp> &peers)
+{
+    MultiPullOp mpo(*this, defaultRemote);
+
+    // Commits to pull (the connection belongs to its worker once added)
+    vector<Commit> remoteCommits = defaultRemote->get()->listCommits();
+    for (size_t i = 0; i < remoteCommits.size(); i++) {
+        ObjectHash hash = remoteCommits[i].hash();
+        if (hasObject(hash))
+            continue;
+        mpo.enqueue(hash);
+        fprintf(stderr, "Adding %s (commit)\n", hash.hex().c_str());
+        // TODO: partial pull
+    }
+
+    struct event_base *evbase = event_base_new();
+#ifndef WITHOUT_MDNS 
+    struct event *mdns_event = MDNS_Browse(evbase);
+    event_add(mdns_event, nullptr);
+    MDNS_RegisterBrowseCallback(std::bind(&MultiPullOp::addCandidate,
+                &mpo, std::placeholders::_1));
+#endif
+
+    mpo.addPeer(defaultRemote);
+    for (size_t i = 0; i < peers.size(); i++)
+        mpo.addPeer(peers[i]);
+
+    event_base_loop(evbase, EVLOOP_NONBLOCK);
+
+    LocalRepoLock::sp _lock(lock());
+
+    if (!mpo.run(evbase))
+        WARNING("Pull incomplete, no peer has the remaining objects");
+    mpo.printStats();
+}
+
+typedef std::pair<Packfile::sp, std::vector<IndexEntry> > TransmitGroup;
+
+/*
+ * Splits the objects into wire groups that each hold objects from one
+ * packfile, in packfile order, and at most TRANSMIT_GROUPOBJS objects or
+ * TRANSMIT_GROUPBYTES stored bytes (unless a single object is larger).
+ * Objects that are not in the index are left out, the receiver finds out
+ * which ones it did not get.
+ */
+void
+LocalRepo::planTransmit(const ObjectHashVec &objs, vector<TransmitGroup> &groups)
 {
-    DLOG("local transmit");
     unordered_set<ObjectHash> includedHashes;
 
     typedef std::vector<IndexEntry> IndexEntryVec;
     std::map<Packfile::sp, IndexEntryVec> packs;
 
-    try {
-        for (size_t i = 0; i < objs.size(); i++) {
-            if (includedHashes.find(objs[i]) == includedHashes.end()) {
-                const IndexEntry &ie = index.getEntry(objs[i]);
-                Packfile::sp pf = packfiles->getPackfile(ie.packfile);
-                packs[pf].push_back(ie);
-                includedHashes.insert(objs[i]);
-            } else {
-                DLOG("duplicate object in LocalRepo::transmit");
-            }
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (!index.hasObject(objs[i])) {
+            DLOG("object %s not stored, leaving it out of transmit",
+                 objs[i].hex().c_str());
+        } else if (includedHashes.find(objs[i]) == includedHashes.end()) {
+            const IndexEntry &ie = index.getEntry(objs[i]);
+            Packfile::sp pf = packfiles->getPackfile(ie.packfile);
+            packs[pf].push_back(ie);
+            includedHashes.insert(objs[i]);
+        } else {
+            DLOG("duplicate object in LocalRepo::transmit");
         }
+    }
 
-        for (std::map<Packfile::sp, IndexEntryVec>::iterator it = packs.begin();
-                it != packs.end();
-                it++) {
-            const Packfile::sp &pf = (*it).first;
-            //fprintf(stderr, "Transmitting %lu objects from %p\n",
-            //        (*it).second.size(), pf.get());
-            pf->transmit(bs, (*it).second);
+    for (std::map<Packfile::sp, IndexEntryVec>::iterator it = packs.begin();
+            it != packs.end();
+            it++) {
+        IndexEntryVec &entries = (*it).second;
+        uint64_t bytes = 0;
+
+        sort(entries.begin(), entries.end(),
+             [](const IndexEntry &a, const IndexEntry &b) {
+                 return a.offset < b.offset;
+             });
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (i == 0 || groups.back().second.size() >= TRANSMIT_GROUPOBJS ||
+                bytes + entries[i].packed_size > TRANSMIT_GROUPBYTES) {
+                groups.push_back(TransmitGroup((*it).first, IndexEntryVec()));
+                bytes = 0;
+            }
+            groups.back().second.push_back(entries[i]);
+            bytes += entries[i].packed_size;
         }
-    } catch (RuntimeException& e) {
-        if (e.getCode() == ORIEC_INDEXNOTFOUND) {
-            DLOG("failed to find objects, ending stream...");
-        } else {
-            DLOG("Exception: %s", e.what());
+    }
+}
+
+/*
+ * A failure ends the stream with NUMOBJS_ABORT so that the receiver cannot
+ * mistake what was sent for a complete response.
+ */
+void
+LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
+{
+    DLOG("local transmit");
+    vector<TransmitGroup> groups;
+
+    try {
+        planTransmit(objs, groups);
+        for (size_t i = 0; i < groups.size(); i++) {
+            groups[i].first->transmit(bs, groups[i].second);
         }
+    } catch (std::exception &e) {
+        WARNING("Aborting object stream: %s", e.what());
+        bs->writeUInt32(NUMOBJS_ABORT);
+        return;
     } catch (...)  {
-        DLOG("unexpected exception in transmit");
+        WARNING("Aborting object stream: unexpected exception");
+        bs->writeUInt32(NUMOBJS_ABORT);
+        return;
     }
     /* Write (numobjs_t)0 */
     bs->writeUInt32(0);
@@ -1227,21 +2218,126 @@ LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
 void
 LocalRepo::receive(bytestream *bs)
 {
+    PackWriter::sp w = acquireWriter();
     bool cont = true;
-    while (cont) {
-        if (!currPackfile.get() || currPackfile->full()) {
-            currPackfile = packfiles->newPackfile();
+
+    try {
+        // Staged objects go first so the packfile is only appended to here
+        if (w->tr.get()) {
+            w->tr->commit();
+            writersLock.lock();
+            w->tr.reset();
+            writersLock.unlock();
+        }
+        while (cont) {
+            if (!w->pf.get() || w->pf->full()) {
+                writersLock.lock();
+                w->pf = packfiles->newPackfile();
+                writersLock.unlock();
+            }
+            cont = w->pf->receive(bs, &index);
         }
-        cont = currPackfile->receive(bs, &index);
+    } catch (...) {
+        releaseWriter(w);
+        throw;
     }
+
+    releaseWriter(w);
 }
 
+/*
+ * Produces the same stream as LocalRepo::transmit but generates one wire
+ * group at a time as it is read, so a response is never held in memory as a
+ * whole.  A group that cannot be read aborts the stream, as does a stream
+ * created as failed.
+ */
+class TransmitStream : public bytestream
+{
+public:
+    TransmitStream(vector<TransmitGroup> &g, bool failed = false)
+        : next(0), off(0), done(false), failed(failed)
+    {
+        groups.swap(g);
+    }
+    bool ended() override
+    {
+        return off == buf.size() && done;
+    }
+    size_t read(uint8_t *out, size_t n) override
+    {
+        size_t total = 0;
+
+        while (total < n) {
+            if (off == buf.size() && !fill())
+                break;
+
+            size_t len = MIN(n - total, buf.size() - off);
+            memcpy(out + total, buf.data() + off, len);
+            off += len;
+            total += len;
+        }
+
+        return total;
+    }
+    size_t sizeHint() const override
+    {
+        return 0;
+    }
+private:
+    bool fill()
+    {
+        if (done)
+            return false;
+
+        buf.clear();
+        off = 0;
+        if (!failed && next < groups.size()) {
+            strwstream ss;
+            try {
+                groups[next].first->transmit(&ss, groups[next].second);
+                buf = ss.str();
+            } catch (std::exception &e) {
+                WARNING("Aborting object stream: %s", e.what());
+                failed = true;
+            }
+        }
+        if (!failed && next < groups.size()) {
+            // Release the packfile once its group is generated
+            groups[next++] = TransmitGroup();
+        } else {
+            /* Write (numobjs_t)0, or NUMOBJS_ABORT after a failure */
+            strwstream ss;
+            ss.writeUInt32(failed ? NUMOBJS_ABORT : 0);
+            buf = ss.str();
+            groups.clear();
+            done = true;
+        }
+
+        return true;
+    }
+
+    vector<TransmitGroup> groups;
+    size_t next;
+    string buf;
+    size_t off;
+    bool done;
+    bool failed;
+};
+
 bytestream *
 LocalRepo::getObjects(const ObjectHashVec &objs)
 {
-    strwstream ss;
-    transmit(&ss, objs);
-    return new strstream(ss.str());
+    vector<TransmitGroup> groups;
+
+    try {
+        planTransmit(objs, groups);
+    } catch (std::exception &e) {
+        WARNING("Aborting object stream: %s", e.what());
+        groups.clear();
+        return new TransmitStream(groups, true);
+    }
+
+    return new TransmitStream(groups);
 }
 
 /*
@@ -1251,10 +2347,10 @@ LocalRepo::getObjects(const ObjectHashVec &objs)
 void
 LocalRepo::addLargeBlobBackrefs(const LargeBlob &lb, MdTransaction::sp tr)
 {
-    for (map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.begin();
+    for (vector<LBlobEntry>::const_iterator it = lb.parts.begin();
             it != lb.parts.end();
             it++) {
-        const LBlobEntry &lbe = (*it).second;
+        const LBlobEntry &lbe = *it;
 
         metadata.addRef(lbe.hash, tr);
     }
@@ -1307,10 +2403,10 @@ LocalRepo::addCommitBackrefs(const Commit &c, MdTransaction::sp tr)
 void
 LocalRepo::copyObjectsFromLargeBlob(Repo *other, const LargeBlob &lb)
 {
-    for (map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.begin();
+    for (vector<LBlobEntry>::const_iterator it = lb.parts.begin();
             it != lb.parts.end();
             it++) {
-        const LBlobEntry &lbe = (*it).second;
+        const LBlobEntry &lbe = *it;
         if (hasObject(lbe.hash)) {
             continue;
         }
@@ -1437,41 +2533,153 @@ LocalRepo::commitFromObjects(const ObjectHash &treeHash, Repo *objects,
 }
 
 /*
- * Garbage Collect. Attempt to reduce wasted space from deleted objects and 
- * metadata.
+ * Garbage Collect.  Packfiles with at least GC_MINDEADFRAC dead bytes are
+ * compacted, most dead first, by relocating their live objects into the
+ * garbage collection packfile GC_STEPSIZE bytes at a time and deleting them
+ * once they are empty.  Only the packfiles being filled by writers are left
+ * alone, adding and reading objects continues throughout.
+ *
+ * maxCopy bounds the live bytes relocated by one call so the work can be
+ * spread over several calls, rateLimit bounds the bytes read plus written per
+ * second.
  */
 void
-LocalRepo::gc()
+LocalRepo::gc(uint64_t maxCopy, uint64_t rateLimit)
 {
+    Monitor lock(gcLock);
+    uint64_t copied = 0;
+    size_t compacted = 0;
+    Stopwatch sw;
+
+    // Packfiles retired by the last collection are no longer referenced
+    packfiles->reclaimRetired();
+
     // Commit all ongoing transactions
-    if (currTransaction.get()) {
-        currTransaction->commit();
-        currTransaction.reset();
-    }
+    commitWriters();
 
-    // Compact the index
-    index.rewrite();
+    // Compact the index once the log has grown large enough
+    if (index.getDeltaSize() >
+            index.getBaseSize() * GC_INDEX_MAXDELTAFRAC) {
+        index.rewrite();
+    }
 
     // Compact the metadata log
     metadata.rewrite();
 
-    // Do purges
-    std::set<packid_t> purgePacks;
-    for (std::set<ObjectHash>::iterator it = purged.begin();
-            it != purged.end();
-            it++) {
-        const IndexEntry &ie = index.getEntry((*it));
-        purgePacks.insert(ie.packfile);
+    std::vector<std::pair<double, packid_t> > victims = gcSelectPacks();
+    sw.start();
+    for (size_t i = 0; i < victims.size(); i++) {
+        if (maxCopy != 0 && copied >= maxCopy)
+            break;
+        if (gcCompactPack(victims[i].second, maxCopy, rateLimit,
+                          &copied, sw))
+            compacted++;
     }
+    sw.stop();
 
-    for (std::set<packid_t>::iterator it = purgePacks.begin();
-            it != purgePacks.end();
-            it++) {
-        Packfile::sp pack = packfiles->getPackfile((*it));
-        pack->purge(purged, &index);
+    LOG("gc: compacted %zu of %zu packfiles, relocated %llu bytes in %llu ms",
+        compacted, victims.size(), (unsigned long long)copied,
+        (unsigned long long)sw.getElapsedMS());
+}
+
+/*
+ * Returns the packfiles worth compacting ordered by their fraction of dead
+ * bytes as accounted by the packfile manager.  The accounting may be stale
+ * after a crash, gcCompactPack checks every object against the index.
+ */
+std::vector<std::pair<double, packid_t> >
+LocalRepo::gcSelectPacks()
+{
+    std::set<packid_t> busy;
+    std::vector<packid_t> pfIds;
+    std::vector<std::pair<double, packid_t> > victims;
+
+    // Writers only create packfiles while holding writersLock
+    writersLock.lock();
+    pfIds = packfiles->getPackfileList();
+    for (size_t i = 0; i < writers.size(); i++) {
+        if (writers[i]->pf.get())
+            busy.insert(writers[i]->pf->getPackfileID());
+    }
+    writersLock.unlock();
+    if (gcPackfile.get())
+        busy.insert(gcPackfile->getPackfileID());
+
+    std::map<packid_t, PackfileManager::PackStats> stats;
+    stats = packfiles->getPackStats();
+    for (size_t i = 0; i < pfIds.size(); i++) {
+        if (busy.find(pfIds[i]) != busy.end())
+            continue;
+
+        // Packfiles without any accounted bytes hold nothing indexed
+        double dead = 1.0;
+        std::map<packid_t, PackfileManager::PackStats>::iterator it;
+        it = stats.find(pfIds[i]);
+        if (it != stats.end() && (*it).second.live != 0) {
+            const PackfileManager::PackStats &st = (*it).second;
+            dead = (double)st.dead / (st.live + st.dead);
+        }
+        if (dead >= GC_MINDEADFRAC)
+            victims.push_back(std::make_pair(dead, pfIds[i]));
+    }
+
+    std::sort(victims.rbegin(), victims.rend());
+    return victims;
+}
+
+/*
+ * Relocates the live objects of a packfile in steps of GC_STEPSIZE bytes, each
+ * step is synced and published to the index on its own.  @returns true once
+ * the packfile was emptied and deleted, false if maxCopy ran out first.
+ */
+bool
+LocalRepo::gcCompactPack(packid_t id, uint64_t maxCopy, uint64_t rateLimit,
+                         uint64_t *copied, Stopwatch &sw)
+{
+    Packfile::sp pf = packfiles->getPackfile(id);
+    std::vector<IndexEntry> entries = pf->getEntries();
+    std::vector<IndexEntry> step;
+    uint64_t stepBytes = 0;
+
+    for (size_t i = 0; i <= entries.size(); i++) {
+        if (i < entries.size()) {
+            const IndexEntry &e = entries[i];
+            if (!index.hasObject(e.info.hash))
+                continue;
+            IndexEntry ie = index.getEntry(e.info.hash);
+            if (ie.packfile != e.packfile || ie.offset != e.offset)
+                continue;
+
+            step.push_back(ie);
+            stepBytes += ie.packed_size;
+            if (stepBytes < GC_STEPSIZE)
+                continue;
+        }
+        if (step.empty())
+            continue;
+
+        if (maxCopy != 0 && *copied >= maxCopy)
+            return false;
+        if (!gcPackfile.get() || gcPackfile->full())
+            gcPackfile = packfiles->newPackfile();
+        gcPackfile->relocate(pf.get(), step, &index);
+        *copied += stepBytes;
+        step.clear();
+        stepBytes = 0;
+
+        // Bytes are read once and written once
+        if (rateLimit != 0) {
+            double due = (double)*copied * 2 * 1000000 / rateLimit;
+            uint64_t elapsed;
+            while (due > (elapsed = sw.getElapsedTime()))
+                usleep((useconds_t)MIN(due - elapsed, 500000.0));
+        }
     }
 
-    purged.clear();
+    pf.reset();
+    packfiles->retirePackfile(id);
+
+    return true;
 }
 
 /*
@@ -1480,7 +2688,7 @@ LocalRepo::gc()
 bool
 LocalRepo::isObjectStored(const ObjectHash &objId)
 {
-    if (currTransaction.get() && currTransaction->has(objId)) {
+    if (getStagedObject(objId, nullptr, nullptr)) {
         return true;
     }
 
@@ -1502,6 +2710,16 @@ LocalRepo::hasObject(const ObjectHash &objId)
     return false;
 }
 
+/*
+ * Only covers the objects stored in this repository, not those of the
+ * remote it is attached to.
+ */
+ObjectFilter::sp
+LocalRepo::getObjectFilter()
+{
+    return index.getFilter();
+}
+
 /*
  * Return ObjectInfo through the fast path.
  */
@@ -1577,10 +2795,10 @@ LocalRepo::recomputeRefCounts()
                 Object::sp o(getObject(hash));
                 lb.fromBlob(o->getPayload());
 
-                for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+                for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
                         pit != lb.parts.end();
                         pit++) {
-                    ObjectHash h = (*pit).second.hash;
+                    ObjectHash h = (*pit).hash;
                     rval[h] += 1;
                 }
                 break;
@@ -1617,14 +2835,16 @@ LocalRepo::purgeObject(const ObjectHash &objId)
 {
     ASSERT(metadata.getRefCount(objId) == 0);
 
-    if (currTransaction.get())
-        currTransaction.reset();
-
-    /*const IndexEntry &ie = index.getEntry(objId);
-    Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
-    packfile->purge(objId);*/
+    // The object may still be staged
+    commitWriters();
 
-    purged.insert(objId);
+    // Its bytes become dead and are reclaimed by the next gc
+    if (index.hasObject(objId)) {
+        IndexBatch batch;
+        batch.remove(objId);
+        index.commit(batch);
+    }
+    invalidateObjectCache(objId);
 
     return true;
 }
@@ -1640,10 +2860,10 @@ LocalRepo::decrefLB(const ObjectHash &lbhash, MdTransaction::sp tr)
         // Going to be purged, decref children
         LargeBlob lb(this);
         lb.fromBlob(getPayload(lbhash));
-        for (std::map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+        for (std::vector<LBlobEntry>::iterator it = lb.parts.begin();
                 it != lb.parts.end();
                 it++) {
-            const LBlobEntry &entry = (*it).second;
+            const LBlobEntry &entry = *it;
             tr->decRef(entry.hash);
         }
     }
@@ -1772,11 +2992,11 @@ LocalRepo::getSubtreeObjects(const ObjectHash &treeId)
     treeQ.push(treeId);
 
     while (!treeQ.empty()) {
-        map<string, TreeEntry>::iterator it;
-        Tree t = getTree(treeQ.front());
+        map<string, TreeEntry>::const_iterator it;
+        shared_ptr<const Tree> t = getTreeRef(treeQ.front());
         treeQ.pop();
 
-        for (it = t.tree.begin(); it != t.tree.end(); it++) {
+        for (it = t->tree.begin(); it != t->tree.end(); it++) {
             TreeEntry e = (*it).second;
             set<ObjectHash>::iterator p = rval.find(e.hash);
 
@@ -1784,10 +3004,10 @@ LocalRepo::getSubtreeObjects(const ObjectHash &treeId)
                 if (e.type == TreeEntry::Tree) {
                     treeQ.push(e.hash);
                 } else if (e.type == TreeEntry::LargeBlob) {
-                    LargeBlob lb = getLargeBlob(e.hash);
-                    std::map<uint64_t, LBlobEntry>::iterator it;
-                    for (it = lb.parts.begin(); it != lb.parts.end(); it++) {
-                        rval.insert(it->second.hash);
+                    shared_ptr<const LargeBlob> lb = getLargeBlobRef(e.hash);
+                    std::vector<LBlobEntry>::const_iterator it;
+                    for (it = lb->parts.begin(); it != lb->parts.end(); it++) {
+                        rval.insert(it->hash);
                     }
                 }
                 rval.insert(e.hash);
@@ -1854,10 +3074,10 @@ LocalRepo::lookupTreeEntry(const Commit &c, const string &path)
     entry.hash = c.getTree();
 
     for (it = pv.begin(); it != pv.end(); it++) {
-	map<string, TreeEntry>::iterator e;
-        Tree t = getTree(entry.hash);
-	e = t.tree.find(*it);
-	if (e == t.tree.end()) {
+	map<string, TreeEntry>::const_iterator e;
+        shared_ptr<const Tree> t = getTreeRef(entry.hash);
+	e = t->tree.find(*it);
+	if (e == t->tree.end()) {
 	    entry = TreeEntry();
 	    entry.type = TreeEntry::Null;
 	    entry.hash = ObjectHash(); // Set empty hash
@@ -16,22 +16,29 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include <string>
 #include <iostream>
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include <unordered_map>
 
+#include "tuneables.h"
+
 #include <oriutil/debug.h>
 #include <oriutil/orifile.h>
 #include <oriutil/stream.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/runtimeexception.h>
 #include <ori/metadatalog.h>
 
 using namespace std;
@@ -56,7 +63,7 @@ void MdTransaction::addRef(const ObjectHash &hash)
 void MdTransaction::decRef(const ObjectHash &hash)
 {
     counts[hash] -= 1;
-    ASSERT(log->refcounts[hash] + counts[hash] >= 0);
+    ASSERT(log->getRefCount(hash) + counts[hash] >= 0);
 }
 
 void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
@@ -67,13 +74,101 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
 
 
 
+/*
+ * Snapshot layout (all integers are big endian):
+ *   magic (4), version (4), generation (8), number of refcounts (4),
+ *   number of metadata entries (4), refcount fanout (256 x 4),
+ *   metadata fanout (256 x 4),
+ *   refcounts sorted by hash (hash, count (4)),
+ *   metadata entries sorted by hash (hash, offset (8), length (4)),
+ *   metadata records (number of pairs (4), key and value strings)
+ *
+ * fanout[i] is the number of entries whose first hash byte is <= i.  Record
+ * offsets are relative to the start of the file.
+ */
+#define SNAP_MAGIC "ORIM"
+#define SNAP_VERSION 1
+#define SNAP_HDRSIZE (4 + 4 + 8 + 4 + 4 + 2 * 256 * 4)
+#define SNAP_REFSIZE (ObjectHash::SIZE + 4)
+#define SNAP_METASIZE (ObjectHash::SIZE + 8 + 4)
+/// Bytes buffered before writing a snapshot
+#define SNAP_WRITEBATCH (1024 * 1024)
+
+/*
+ * The log is a sequence of records, a length in host byte order followed by
+ * the number of refcounts and metadata entries and the entries.  A log
+ * written with a snapshot starts with a record without entries that holds
+ * the generation, older versions skip it as an empty transaction.
+ */
+#define LOG_MARKERSIZE (4 + 4 + 8)
+
+static uint32_t
+_readBE32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t
+_readBE64(const uint8_t *p)
+{
+    return ((uint64_t)_readBE32(p) << 32) | _readBE32(p + 4);
+}
+
+static void
+_writeAll(int fd, const string &buf)
+{
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        written += n;
+    }
+}
+
+static string
+_encodeRecord(const string &packet)
+{
+    uint32_t nbytes = packet.size();
+    string record((const char *)&nbytes, sizeof(uint32_t));
+
+    return record + packet;
+}
+
+static string
+_encodeMeta(const ObjMetadata &md)
+{
+    strwstream ws;
+
+    ws.writeUInt32(md.size());
+    for (ObjMetadata::const_iterator it = md.begin(); it != md.end(); it++) {
+        ws.writePStr((*it).first);
+        ws.writePStr((*it).second);
+    }
+
+    return ws.str();
+}
+
+static bool
+_hashCmp(const pair<ObjectHash, string> &a, const pair<ObjectHash, string> &b)
+{
+    return a.first < b.first;
+}
+
 /*
  * MetadataLog
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), generation(0), logSize(0), snap(nullptr), snapLen(0),
+      snapRefs(0), snapMetas(0)
 {
+    memset(refFanout, 0, sizeof(refFanout));
+    memset(metaFanout, 0, sizeof(metaFanout));
 }
 
 MetadataLog::~MetadataLog()
@@ -81,56 +176,89 @@ MetadataLog::~MetadataLog()
     if (fd != -1) {
         ::close(fd);
     }
+    _closeSnapshot();
 }
 
-// XXX: Handle crach detection and recovery
 void
 MetadataLog::open(const string &filename)
 {
+    this->filename = filename;
+
+    _openSnapshot(); // throws SystemException or RuntimeException
+
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
     if (fd < 0) {
         WARNING("MetadataLog open failed!");
         throw SystemException();
     }
 
-    this->filename = filename;
-
     struct stat sb;
     if (fstat(fd, &sb) < 0) {
         WARNING("MetadataLog fstat failed!");
         throw SystemException();
     }
 
-    size_t readSoFar = 0;
-    while (true) {
+    _replay(sb.st_size);
+
+    // Delete the files of an interrupted rewrite
+    if (OriFile_Exists(filename + ".tmp")) {
+        OriFile_Delete(filename + ".tmp");
+    }
+    if (OriFile_Exists(filename + MDLOG_SNAPSHOT_EXT ".tmp")) {
+        OriFile_Delete(filename + MDLOG_SNAPSHOT_EXT ".tmp");
+    }
+}
+
+/*
+ * Replays the log into memory.  A trailing record that is incomplete was torn
+ * by a crash before its transaction was synced and is truncated.
+ */
+void
+MetadataLog::_replay(size_t fileSize)
+{
+    size_t off = 0;
+
+    while (off < fileSize) {
         uint32_t nbytes;
-        int n = read(fd, &nbytes, sizeof(uint32_t));
-        readSoFar += sizeof(uint32_t);
-        if (n == 0)
+
+        if (fileSize - off < sizeof(uint32_t))
             break;
-        if (n < 0) {
+        if (pread(fd, &nbytes, sizeof(uint32_t), off) != sizeof(uint32_t)) {
             WARNING("MetadataLog read failed!");
             throw SystemException();
         }
-
-        if (readSoFar + nbytes > (size_t)sb.st_size) {
-            // TODO: truncate this entry
-            WARNING("Corrupted metadata log entry!");
-            throw SystemException();
-        }
+        if (nbytes < 2 * sizeof(uint32_t) ||
+            fileSize - off - sizeof(uint32_t) < nbytes)
+            break;
 
         string packet;
         packet.resize(nbytes);
-        if (read(fd, &packet[0], nbytes) < 0) {
+        if (pread(fd, &packet[0], nbytes, off + sizeof(uint32_t)) !=
+                (ssize_t)nbytes) {
             WARNING("MetadataLog read failed!");
             throw SystemException();
         }
-        readSoFar += nbytes;
 
         strstream ss(packet);
         uint32_t num_rc = ss.readUInt32();
         uint32_t num_md = ss.readUInt32();
 
+        if (off == 0) {
+            uint64_t logGeneration = 0;
+            if (num_rc == 0 && num_md == 0 && nbytes == LOG_MARKERSIZE)
+                logGeneration = ss.readUInt64();
+
+            if (logGeneration < generation) {
+                // A rewrite was interrupted after writing the snapshot
+                LOG("Discarding metadata log merged into the snapshot");
+                fileSize = 0;
+                break;
+            }
+            if (logGeneration > generation) {
+                WARNING("Metadata snapshot is older than the log!");
+            }
+        }
+
         //fprintf(stderr, "Reading %u refcount entries\n", num_rc);
         for (size_t i = 0; i < num_rc; i++) {
             ObjectHash hash;
@@ -153,6 +281,30 @@ MetadataLog::open(const string &filename)
                 metadata[hash][key] = value;
             }
         }
+
+        off += sizeof(uint32_t) + nbytes;
+    }
+
+    if (off < fileSize) {
+        WARNING("Truncating torn metadata log entry at offset %zu", off);
+    }
+    if (off != fileSize || off == 0) {
+        if (::ftruncate(fd, off) < 0) {
+            WARNING("MetadataLog truncate failed!");
+            throw SystemException();
+        }
+    }
+    logSize = off;
+
+    // Every log starts with the generation of its snapshot
+    if (logSize == 0) {
+        strwstream ws(LOG_MARKERSIZE);
+        ws.writeUInt32(0);
+        ws.writeUInt32(0);
+        ws.writeUInt64(generation);
+        string record = _encodeRecord(ws.str());
+        _writeAll(fd, record);
+        logSize = record.size();
     }
 }
 
@@ -160,37 +312,378 @@ void
 MetadataLog::sync()
 {
     ::fsync(fd);
+
+    if (logSize > MDLOG_CHECKPOINT_MINSIZE &&
+        logSize > snapLen * MDLOG_CHECKPOINT_FRAC) {
+        rewrite();
+    }
 }
 
+/*
+ * The snapshot is written before the new log.  If a crash prevents the log
+ * from being replaced, its generation is older than the snapshot and it is
+ * discarded at open, the snapshot already holds all of its transactions.
+ */
 void
 MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 {
-    if (refs == nullptr)
-        refs = &refcounts;
-    if (data == nullptr)
-        data = &metadata;
+    string snapFile = filename + MDLOG_SNAPSHOT_EXT;
+    string tmpSnap = snapFile + ".tmp";
+    string tmpLog = filename + ".tmp";
 
-    string tmpFilename = filename + ".tmp";
-    int newFd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    _writeSnapshot(tmpSnap, refs, data);
+
+    int newFd = ::open(tmpLog.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                       0644);
     if (newFd < 0) {
         perror("MetadataLog::rewrite open");
+        OriFile_Delete(tmpSnap);
         throw SystemException();
     }
 
-    int oldFd = fd;
-    fd = newFd;
+    strwstream ws(LOG_MARKERSIZE);
+    ws.writeUInt32(0);
+    ws.writeUInt32(0);
+    ws.writeUInt64(generation + 1);
+    string marker = _encodeRecord(ws.str());
+    try {
+        _writeAll(newFd, marker);
+        if (::fsync(newFd) < 0)
+            throw SystemException();
+    } catch (SystemException &e) {
+        WARNING("Could not write the metadata log: %s", e.what());
+        ::close(newFd);
+        OriFile_Delete(tmpLog);
+        OriFile_Delete(tmpSnap);
+        throw;
+    }
+
+    _closeSnapshot();
+    OriFile_Rename(tmpSnap, snapFile);
+    _openSnapshot();
 
-    ftruncate(fd, 0);
-    lseek(fd, 0, SEEK_SET);
-    MdTransaction::sp tr = begin();
-    tr->counts = *refs;
-    tr->metadata = *data;
+    OriFile_Rename(tmpLog, filename);
+    ::close(fd);
+    fd = newFd;
+    logSize = marker.size();
 
     refcounts.clear();
     metadata.clear();
+}
+
+/*
+ * Merges the snapshot and the changes since (or the given maps) into a new
+ * snapshot of the next generation.  Objects without references are dropped.
+ */
+void
+MetadataLog::_writeSnapshot(const string &path, const RefcountMap *refs,
+                            const MetadataMap *data)
+{
+    vector<pair<ObjectHash, string> > rv;
+    vector<pair<ObjectHash, string> > mv;
+
+    if (refs == nullptr) {
+        for (uint32_t i = 0; i < snapRefs; i++) {
+            const uint8_t *e = snap + SNAP_HDRSIZE + (size_t)i * SNAP_REFSIZE;
+            ObjectHash hash;
+            memcpy(hash.hash, e, ObjectHash::SIZE);
+            if (refcounts.find(hash) == refcounts.end())
+                rv.push_back(make_pair(hash, string((const char *)e +
+                                       ObjectHash::SIZE, 4)));
+        }
+        refs = &refcounts;
+    }
+    for (RefcountMap::const_iterator it = refs->begin();
+            it != refs->end();
+            it++) {
+        if ((*it).second == 0)
+            continue;
+        strwstream ws(4);
+        ws.writeInt32((*it).second);
+        rv.push_back(make_pair((*it).first, ws.str()));
+    }
+    sort(rv.begin(), rv.end(), _hashCmp);
 
-    OriFile_Rename(tmpFilename, filename);
-    ::close(oldFd);
+    if (data == nullptr) {
+        const uint8_t *metas = snap + SNAP_HDRSIZE +
+                               (size_t)snapRefs * SNAP_REFSIZE;
+        for (uint32_t i = 0; i < snapMetas; i++) {
+            const uint8_t *e = metas + (size_t)i * SNAP_METASIZE;
+            ObjectHash hash;
+            memcpy(hash.hash, e, ObjectHash::SIZE);
+            if (metadata.find(hash) != metadata.end())
+                continue;
+            uint64_t recOff = _readBE64(e + ObjectHash::SIZE);
+            uint32_t recLen = _readBE32(e + ObjectHash::SIZE + 8);
+            if (recOff > snapLen || recLen > snapLen - recOff) {
+                WARNING("Metadata snapshot record out of bounds!");
+                continue;
+            }
+            mv.push_back(make_pair(hash, string((const char *)snap + recOff,
+                                                recLen)));
+        }
+        for (MetadataMap::const_iterator it = metadata.begin();
+                it != metadata.end();
+                it++) {
+            mv.push_back(make_pair((*it).first,
+                                   _encodeMeta(_getAllMeta((*it).first))));
+        }
+    } else {
+        for (MetadataMap::const_iterator it = data->begin();
+                it != data->end();
+                it++) {
+            mv.push_back(make_pair((*it).first, _encodeMeta((*it).second)));
+        }
+    }
+    sort(mv.begin(), mv.end(), _hashCmp);
+
+    int fdNew = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fdNew < 0) {
+        perror("MetadataLog::_writeSnapshot open");
+        throw SystemException();
+    }
+
+    try {
+        uint32_t fanout[256];
+        strwstream ss(SNAP_WRITEBATCH);
+
+        ss.write(SNAP_MAGIC, 4);
+        ss.writeUInt32(SNAP_VERSION);
+        ss.writeUInt64(generation + 1);
+        ss.writeUInt32(rv.size());
+        ss.writeUInt32(mv.size());
+
+        memset(fanout, 0, sizeof(fanout));
+        for (size_t i = 0; i < rv.size(); i++)
+            fanout[rv[i].first.hash[0]]++;
+        for (uint32_t i = 0, total = 0; i < 256; i++) {
+            total += fanout[i];
+            ss.writeUInt32(total);
+        }
+        memset(fanout, 0, sizeof(fanout));
+        for (size_t i = 0; i < mv.size(); i++)
+            fanout[mv[i].first.hash[0]]++;
+        for (uint32_t i = 0, total = 0; i < 256; i++) {
+            total += fanout[i];
+            ss.writeUInt32(total);
+        }
+        ASSERT(ss.str().size() == SNAP_HDRSIZE);
+
+        for (size_t i = 0; i < rv.size(); i++) {
+            ss.writeHash(rv[i].first);
+            ss.write(rv[i].second.data(), rv[i].second.size());
+            if (ss.str().size() >= SNAP_WRITEBATCH) {
+                _writeAll(fdNew, ss.str());
+                ss = strwstream(SNAP_WRITEBATCH);
+            }
+        }
+
+        uint64_t recOff = SNAP_HDRSIZE + (uint64_t)rv.size() * SNAP_REFSIZE +
+                          (uint64_t)mv.size() * SNAP_METASIZE;
+        for (size_t i = 0; i < mv.size(); i++) {
+            ss.writeHash(mv[i].first);
+            ss.writeUInt64(recOff);
+            ss.writeUInt32(mv[i].second.size());
+            recOff += mv[i].second.size();
+            if (ss.str().size() >= SNAP_WRITEBATCH) {
+                _writeAll(fdNew, ss.str());
+                ss = strwstream(SNAP_WRITEBATCH);
+            }
+        }
+        for (size_t i = 0; i < mv.size(); i++) {
+            ss.write(mv[i].second.data(), mv[i].second.size());
+            if (ss.str().size() >= SNAP_WRITEBATCH) {
+                _writeAll(fdNew, ss.str());
+                ss = strwstream(SNAP_WRITEBATCH);
+            }
+        }
+        _writeAll(fdNew, ss.str());
+
+        if (::fsync(fdNew) < 0)
+            throw SystemException();
+    } catch (SystemException &e) {
+        WARNING("Could not write the metadata snapshot: %s", e.what());
+        ::close(fdNew);
+        OriFile_Delete(path);
+        throw;
+    }
+    ::close(fdNew);
+}
+
+void
+MetadataLog::_openSnapshot()
+{
+    string snapFile = filename + MDLOG_SNAPSHOT_EXT;
+    struct stat sb;
+
+    ASSERT(snap == nullptr);
+
+    int snapFd = ::open(snapFile.c_str(), O_RDONLY);
+    if (snapFd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the metadata snapshot!");
+        throw SystemException();
+    }
+
+    if (::fstat(snapFd, &sb) < 0) {
+        int errcode = errno;
+        ::close(snapFd);
+        WARNING("Could not fstat the metadata snapshot!");
+        throw SystemException(errcode);
+    }
+
+    if ((size_t)sb.st_size < SNAP_HDRSIZE) {
+        ::close(snapFd);
+        WARNING("Metadata snapshot is truncated!");
+        throw RuntimeException(ORIEC_METADATACORRUPT, "Metadata corrupt");
+    }
+
+    void *m = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, snapFd, 0);
+    ::close(snapFd);
+    if (m == MAP_FAILED) {
+        WARNING("Could not map the metadata snapshot!");
+        throw SystemException();
+    }
+
+    snap = (const uint8_t *)m;
+    snapLen = sb.st_size;
+
+    // Validate the header and fanout tables
+    bool valid = memcmp(snap, SNAP_MAGIC, 4) == 0 &&
+                 _readBE32(snap + 4) == SNAP_VERSION;
+    if (valid) {
+        generation = _readBE64(snap + 8);
+        snapRefs = _readBE32(snap + 16);
+        snapMetas = _readBE32(snap + 20);
+        for (int i = 0; i < 256; i++) {
+            refFanout[i] = _readBE32(snap + 24 + 4 * i);
+            metaFanout[i] = _readBE32(snap + 24 + 1024 + 4 * i);
+            if (i > 0 && (refFanout[i] < refFanout[i - 1] ||
+                          metaFanout[i] < metaFanout[i - 1]))
+                valid = false;
+        }
+        valid = valid && refFanout[255] == snapRefs &&
+            metaFanout[255] == snapMetas &&
+            snapLen >= SNAP_HDRSIZE + (size_t)snapRefs * SNAP_REFSIZE +
+                       (size_t)snapMetas * SNAP_METASIZE;
+    }
+
+    if (!valid) {
+        _closeSnapshot();
+        WARNING("Metadata snapshot is corrupt!");
+        throw RuntimeException(ORIEC_METADATACORRUPT, "Metadata corrupt");
+    }
+}
+
+void
+MetadataLog::_closeSnapshot()
+{
+    if (snap != nullptr) {
+        munmap((void *)snap, snapLen);
+        snap = nullptr;
+    }
+    snapLen = 0;
+    snapRefs = 0;
+    snapMetas = 0;
+    memset(refFanout, 0, sizeof(refFanout));
+    memset(metaFanout, 0, sizeof(metaFanout));
+}
+
+/*
+ * Binary search of a snapshot table within the fanout bucket of the first hash
+ * byte.  @returns the entry or nullptr.
+ */
+static const uint8_t *
+_findEntry(const uint8_t *table, size_t entrySize, const uint32_t *fanout,
+           const ObjectHash &hash)
+{
+    uint8_t first = hash.hash[0];
+    uint32_t lo = (first == 0) ? 0 : fanout[first - 1];
+    uint32_t hi = fanout[first];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = table + (size_t)mid * entrySize;
+        int cmp = memcmp(e, hash.hash, ObjectHash::SIZE);
+        if (cmp == 0)
+            return e;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return nullptr;
+}
+
+bool
+MetadataLog::_findRef(const ObjectHash &hash, refcount_t *count) const
+{
+    if (snapRefs == 0)
+        return false;
+
+    const uint8_t *e = _findEntry(snap + SNAP_HDRSIZE, SNAP_REFSIZE,
+                                  refFanout, hash);
+    if (e == nullptr)
+        return false;
+
+    *count = (refcount_t)_readBE32(e + ObjectHash::SIZE);
+    return true;
+}
+
+bool
+MetadataLog::_findMeta(const ObjectHash &hash, ObjMetadata *md) const
+{
+    if (snapMetas == 0)
+        return false;
+
+    const uint8_t *e = _findEntry(snap + SNAP_HDRSIZE +
+                                  (size_t)snapRefs * SNAP_REFSIZE,
+                                  SNAP_METASIZE, metaFanout, hash);
+    if (e == nullptr)
+        return false;
+
+    uint64_t recOff = _readBE64(e + ObjectHash::SIZE);
+    uint32_t recLen = _readBE32(e + ObjectHash::SIZE + 8);
+    if (recOff > snapLen || recLen < 4 || recLen > snapLen - recOff) {
+        WARNING("Metadata snapshot record out of bounds!");
+        return false;
+    }
+
+    mmapstream ss(nullptr, snap + recOff, recLen);
+    uint32_t num_mde = ss.readUInt32();
+    for (size_t i = 0; i < num_mde; i++) {
+        string key, value;
+        ss.readPStr(key);
+        ss.readPStr(value);
+        (*md)[key] = value;
+    }
+
+    return true;
+}
+
+/*
+ * Returns the metadata of an object with the changes since the snapshot
+ * applied.
+ */
+ObjMetadata
+MetadataLog::_getAllMeta(const ObjectHash &hash) const
+{
+    ObjMetadata md;
+
+    _findMeta(hash, &md);
+
+    MetadataMap::const_iterator it = metadata.find(hash);
+    if (it != metadata.end()) {
+        for (ObjMetadata::const_iterator mit = (*it).second.begin();
+                mit != (*it).second.end();
+                mit++) {
+            md[(*mit).first] = (*mit).second;
+        }
+    }
+
+    return md;
 }
 
 void
@@ -206,20 +699,32 @@ MetadataLog::addRef(const ObjectHash &hash, MdTransaction::sp trs)
 refcount_t
 MetadataLog::getRefCount(const ObjectHash &hash) const
 {
+    refcount_t count = 0;
+
     RefcountMap::const_iterator it = refcounts.find(hash);
-    if (it == refcounts.end())
-        return 0;
-    return (*it).second;
+    if (it != refcounts.end())
+        return (*it).second;
+
+    _findRef(hash, &count);
+    return count;
 }
 
 string
 MetadataLog::getMeta(const ObjectHash &hash, const string &key) const
 {
+    ObjMetadata md;
+
     MetadataMap::const_iterator it = metadata.find(hash);
-    if (it == metadata.end())
+    if (it != metadata.end()) {
+        ObjMetadata::const_iterator mit = (*it).second.find(key);
+        if (mit != (*it).second.end())
+            return (*mit).second;
+    }
+
+    if (!_findMeta(hash, &md))
         return "";
-    ObjMetadata::const_iterator mit = (*it).second.find(key);
-    if (mit == (*it).second.end())
+    ObjMetadata::const_iterator mit = md.find(key);
+    if (mit == md.end())
         return "";
     return (*mit).second;
 }
@@ -252,7 +757,7 @@ MetadataLog::commit(MdTransaction *tr)
         ASSERT(!hash.isEmpty());
 
         ws.writeHash(hash);
-        refcount_t final_count = refcounts[hash] + (*it).second;
+        refcount_t final_count = getRefCount(hash) + (*it).second;
         ASSERT(final_count >= 0);
 
         refcounts[hash] = final_count;
@@ -282,10 +787,10 @@ MetadataLog::commit(MdTransaction *tr)
     //ObjectHash commitHash = Util_HashString(ws.str());
     //ws.write(commitHash.data(), commitHash.size());
 
-    const string &str = ws.str();
-    uint32_t nbytes = str.size();
-    write(fd, &nbytes, sizeof(uint32_t));
-    write(fd, str.data(), str.size());
+    // One write so a crash tears at most the last record
+    string record = _encodeRecord(ws.str());
+    _writeAll(fd, record);
+    logSize += record.size();
 
     tr->counts.clear();
     tr->metadata.clear();
@@ -297,6 +802,15 @@ MetadataLog::dumpRefs() const
     RefcountMap::const_iterator it;
 
     cout << "Reference Counts:" << endl;
+    for (uint32_t i = 0; i < snapRefs; i++) {
+        const uint8_t *e = snap + SNAP_HDRSIZE + (size_t)i * SNAP_REFSIZE;
+        ObjectHash hash;
+        memcpy(hash.hash, e, ObjectHash::SIZE);
+        if (refcounts.find(hash) != refcounts.end())
+            continue;
+        cout << hash.hex() << ": "
+             << (refcount_t)_readBE32(e + ObjectHash::SIZE) << endl;
+    }
     for (it = refcounts.begin(); it != refcounts.end(); it++)
     {
         cout << (*it).first.hex() << ": " << (*it).second << endl;
@@ -308,14 +822,26 @@ MetadataLog::dumpMeta() const
 {
     MetadataMap::const_iterator it;
 
-    cout << "Metadata:" << endl;
+    vector<ObjectHash> hashes;
+    const uint8_t *metas = snap + SNAP_HDRSIZE + (size_t)snapRefs * SNAP_REFSIZE;
+    for (uint32_t i = 0; i < snapMetas; i++) {
+        ObjectHash hash;
+        memcpy(hash.hash, metas + (size_t)i * SNAP_METASIZE, ObjectHash::SIZE);
+        if (metadata.find(hash) == metadata.end())
+            hashes.push_back(hash);
+    }
     for (it = metadata.begin(); it != metadata.end(); it++)
+        hashes.push_back((*it).first);
+
+    cout << "Metadata:" << endl;
+    for (size_t i = 0; i < hashes.size(); i++)
     {
+        ObjMetadata md = _getAllMeta(hashes[i]);
         ObjMetadata::const_iterator mit;
 
-        cout << (*it).first.hex() << ":" << endl;
+        cout << hashes[i].hex() << ":" << endl;
 
-        for (mit = (*it).second.begin(); mit != (*it).second.end(); mit++)
+        for (mit = md.begin(); mit != md.end(); mit++)
         {
             cout << "  " << (*mit).first << " = " << (*mit).second << endl;
         }
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <exception>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/stream.h>
+#include <ori/objectfilter.h>
+
+using namespace std;
+
+#define OBJFILTER_VERSION 2
+/// Each probe uses 32 bits of the object hash
+#define OBJFILTER_MAXLOG2BITS 32
+#define OBJFILTER_MINLOG2BITS 10
+
+ObjectFilter::ObjectFilter()
+    : log2Bits(OBJFILTER_MINLOG2BITS), count(0),
+      bits(1 << (OBJFILTER_MINLOG2BITS - 3), 0)
+{
+}
+
+ObjectFilter::ObjectFilter(uint64_t capacity)
+    : log2Bits(OBJFILTER_MINLOG2BITS), count(0)
+{
+    while (log2Bits < OBJFILTER_MAXLOG2BITS &&
+           (1ULL << log2Bits) < capacity * OBJFILTER_BITSPEROBJ)
+        log2Bits++;
+    bits.resize((1ULL << log2Bits) / 8, 0);
+}
+
+ObjectFilter::~ObjectFilter()
+{
+}
+
+uint64_t
+ObjectFilter::probe(const ObjectHash &objId, int i) const
+{
+    // Big endian so that filters mean the same on every host
+    const uint8_t *p = objId.hash + 4 * i;
+    uint32_t word = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                    ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+
+    return word & ((1ULL << log2Bits) - 1);
+}
+
+void
+ObjectFilter::add(const ObjectHash &objId)
+{
+    for (int i = 0; i < OBJFILTER_PROBES; i++) {
+        uint64_t b = probe(objId, i);
+        bits[b / 8] |= 1 << (b % 8);
+    }
+    count++;
+}
+
+bool
+ObjectFilter::mayContain(const ObjectHash &objId) const
+{
+    for (int i = 0; i < OBJFILTER_PROBES; i++) {
+        uint64_t b = probe(objId, i);
+        if ((bits[b / 8] & (1 << (b % 8))) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+uint64_t
+ObjectFilter::getCapacity() const
+{
+    return (1ULL << log2Bits) / OBJFILTER_BITSPEROBJ;
+}
+
+string
+ObjectFilter::getBlob() const
+{
+    strwstream ss;
+
+    ss.writeUInt8(OBJFILTER_VERSION);
+    ss.writeUInt8(log2Bits);
+    ss.writeUInt8(OBJFILTER_PROBES);
+    ss.writeUInt64(count);
+    ss.write(bits.data(), bits.size());
+
+    return ss.str();
+}
+
+bool
+ObjectFilter::fromBlob(const string &blob)
+{
+    strstream ss(blob);
+
+    try {
+        uint8_t version = ss.readUInt8();
+        uint8_t l2 = ss.readUInt8();
+        uint8_t probes = ss.readUInt8();
+        uint64_t n = ss.readUInt64();
+
+        if (version != OBJFILTER_VERSION || probes != OBJFILTER_PROBES ||
+            l2 < OBJFILTER_MINLOG2BITS || l2 > OBJFILTER_MAXLOG2BITS) {
+            WARNING("Unsupported object filter (version %u, %u probes)",
+                    version, probes);
+            return false;
+        }
+
+        vector<uint8_t> b((1ULL << l2) / 8);
+        if (!ss.readExact(b.data(), b.size()) || !ss.ended()) {
+            WARNING("Object filter has the wrong size");
+            return false;
+        }
+
+        log2Bits = l2;
+        count = n;
+        bits.swap(b);
+    } catch (exception &e) {
+        WARNING("Truncated object filter");
+        return false;
+    }
+
+    return true;
+}
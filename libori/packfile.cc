@@ -15,15 +15,22 @@
  */
 
 
+#include <limits.h>
 #include <unistd.h>
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
+#include <string.h>
 
 #include <string>
 #include <set>
 #include <list>
+#include <map>
 #include <vector>
 #include <sstream>
 #include <stdexcept>
@@ -36,15 +43,153 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
+#include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/runtimeexception.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
 
 using namespace std;
 
-PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+/*
+ * CompressionMemo
+ */
+
+CompressionMemo::CompressionMemo()
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+CompressionMemo::~CompressionMemo()
+{
+}
+
+CompressionMemo::Decision
+CompressionMemo::lookup(const string &fileType)
+{
+    Decision d = Unknown;
+
+    if (fileType.empty())
+        return Unknown;
+
+    lock.lock();
+    unordered_map<string, TypeEntry>::iterator it = types.find(fileType);
+    if (it != types.end()) {
+        TypeEntry &e = it->second;
+        uint32_t total = e.compressed + e.stored;
+
+        // Trusted types are checked again once in a while
+        if (total >= COMPMEMO_SAMPLES && ++e.lookups % COMPMEMO_REPROBE != 0) {
+            if (e.compressed * COMPMEMO_SAMPLES <= total)
+                d = Store;
+            else if (e.stored * COMPMEMO_SAMPLES <= total)
+                d = Compress;
+        }
+    }
+    lock.unlock();
+
+    return d;
+}
+
+void
+CompressionMemo::record(const string &fileType, Path path, Path outcome)
+{
+    bool learn = outcome == COMPPATH_COMPRESSED ||
+                 outcome == COMPPATH_RATIO_STORE ||
+                 outcome == COMPPATH_ENTROPY_STORE;
+
+    lock.lock();
+    stats.paths[path]++;
+
+    if (!learn || fileType.empty()) {
+        lock.unlock();
+        return;
+    }
+
+    unordered_map<string, TypeEntry>::iterator it = types.find(fileType);
+    if (it == types.end() && types.size() < COMPMEMO_MAXTYPES) {
+        TypeEntry e = { 0, 0, 0 };
+        it = types.insert(make_pair(fileType, e)).first;
+    }
+
+    if (it != types.end()) {
+        TypeEntry &e = it->second;
+        if (outcome == COMPPATH_COMPRESSED)
+            e.compressed++;
+        else
+            e.stored++;
+
+        // Age old outcomes so a type can change its mind
+        if (e.compressed + e.stored >= 4 * COMPMEMO_SAMPLES) {
+            e.compressed /= 2;
+            e.stored /= 2;
+        }
+    }
+    lock.unlock();
+}
+
+CompressionMemo::Stats
+CompressionMemo::getStats()
+{
+    Stats st;
+
+    lock.lock();
+    st = stats;
+    lock.unlock();
+
+    return st;
+}
+
+string
+CompressionMemo::fileType(const string &path)
+{
+    size_t slash = path.rfind('/');
+    size_t base = (slash == string::npos) ? 0 : slash + 1;
+    size_t dot = path.rfind('.');
+
+    // No extension or a hidden file without one
+    if (dot == string::npos || dot <= base || dot + 1 == path.size())
+        return "";
+    if (path.size() - dot - 1 > COMPMEMO_MAXEXTLEN)
+        return "";
+
+    string ext = path.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++)
+        ext[i] = tolower(ext[i]);
+
+    return ext;
+}
+
+const char *
+CompressionMemo::getStrForPath(Path path)
+{
+    switch (path) {
+        case COMPPATH_SMALL:
+            return "small";
+        case COMPPATH_MEMO_STORE:
+            return "memo store";
+        case COMPPATH_MEMO_COMPRESS:
+            return "memo compress";
+        case COMPPATH_ENTROPY_STORE:
+            return "entropy store";
+        case COMPPATH_COMPRESSED:
+            return "compressed";
+        case COMPPATH_RATIO_STORE:
+            return "ratio store";
+        default:
+            return nullptr;
+    }
+}
+
+/*
+ * PfTransaction
+ */
+
+PfTransaction::PfTransaction(Packfile *pf, Index *idx, const Codec *codec,
+                             CompressionMemo *memo)
+    : totalSize(0), committed(false), pf(pf), idx(idx), codec(codec),
+      memo(memo)
 {
 }
 
@@ -67,7 +212,83 @@ PfTransaction::_checkCompressionRatio(const string &payload)
 }
 
 void
-PfTransaction::addPayload(ObjectInfo info, const string &payload)
+PfTransaction::addPayload(ObjectInfo info, const string &payload,
+                          const string &fileType)
+{
+    string stored = preparePayload(info, payload, codec, memo, fileType);
+    addPreparedPayload(info, stored);
+}
+
+/*
+ * Picks the storage algorithm for a payload and returns the bytes to store.
+ * Only the arguments (and the thread safe memo) are touched, so chunks can
+ * be compressed on worker threads before they are added to a transaction.
+ *
+ * The codec only runs when the file type memo or the entropy estimate
+ * suggest the payload compresses, its output is still discarded if it does
+ * not reach COMPCHECK_RATIO.
+ */
+string
+PfTransaction::preparePayload(ObjectInfo &info, const string &payload,
+                              const Codec *codec, CompressionMemo *memo,
+                              const string &fileType)
+{
+    CompressionMemo::Path path;
+
+    if (codec->getAlgo() == ObjectInfo::ZIPALGO_NONE) {
+        info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        return payload;
+    }
+
+    if (payload.size() <= ZIP_MINIMUM_SIZE) {
+        path = CompressionMemo::COMPPATH_SMALL;
+    } else {
+        CompressionMemo::Decision d = CompressionMemo::Unknown;
+        if (memo != nullptr)
+            d = memo->lookup(fileType);
+
+        if (d == CompressionMemo::Store) {
+            path = CompressionMemo::COMPPATH_MEMO_STORE;
+        } else if (d == CompressionMemo::Unknown &&
+                   Codec_EstimateEntropy((const uint8_t *)payload.data(),
+                                         payload.size()) >
+                   COMPCHECK_MAXENTROPY) {
+            path = CompressionMemo::COMPPATH_ENTROPY_STORE;
+        } else {
+            string stored;
+            bool kept = codec->compress((const uint8_t *)payload.data(),
+                                        payload.size(), stored) &&
+                        stored.size() <= payload.size() * COMPCHECK_RATIO;
+            CompressionMemo::Path outcome = kept ?
+                CompressionMemo::COMPPATH_COMPRESSED :
+                CompressionMemo::COMPPATH_RATIO_STORE;
+
+            // Trusted types are counted once under the memo path
+            if (memo != nullptr)
+                memo->record(fileType,
+                             d == CompressionMemo::Compress ?
+                             CompressionMemo::COMPPATH_MEMO_COMPRESS : outcome,
+                             outcome);
+            if (kept) {
+                info.setAlgo(codec->getAlgo());
+                return stored;
+            }
+            info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+            return payload;
+        }
+    }
+
+    if (memo != nullptr)
+        memo->record(fileType, path);
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    return payload;
+}
+
+/*
+ * Adds a payload returned by preparePayload, info must be the updated info.
+ */
+void
+PfTransaction::addPreparedPayload(const ObjectInfo &info, const string &stored)
 {
     if (committed) {
         throw runtime_error("Adding payload to already-committed transaction!");
@@ -83,59 +304,42 @@ PfTransaction::addPayload(ObjectInfo info, const string &payload)
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
-            payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
-        }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
-
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
-    }
-
+    lock.lock();
+    payloads.push_back(stored);
+    totalSize += stored.size();
     infos.push_back(info);
     hashToIx[info.hash] = infos.size()-1;
+    lock.unlock();
 }
 
 bool PfTransaction::has(const ObjectHash &hash) const
 {
-    return hashToIx.find(hash) != hashToIx.end();
+    bool found;
+
+    lock.lock();
+    found = hashToIx.find(hash) != hashToIx.end();
+    lock.unlock();
+
+    return found;
+}
+
+bool
+PfTransaction::get(const ObjectHash &hash, ObjectInfo *info,
+                   string *stored) const
+{
+    unordered_map<ObjectHash, size_t>::const_iterator it;
+    bool found = false;
+
+    lock.lock();
+    it = hashToIx.find(hash);
+    if (it != hashToIx.end()) {
+        *info = infos[(*it).second];
+        *stored = payloads[(*it).second];
+        found = true;
+    }
+    lock.unlock();
+
+    return found;
 }
 
 void PfTransaction::commit()
@@ -150,6 +354,39 @@ void PfTransaction::commit()
 // stored length + offset
 #define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * Writes all buffers with as few writev calls as IOV_MAX allows, restarting
+ * after short writes.
+ */
+static void
+_writevAll(int fd, vector<struct iovec> &iov)
+{
+    size_t first = 0;
+    while (first < iov.size()) {
+        int cnt = MIN(iov.size() - first, (size_t)IOV_MAX);
+        ssize_t n = writev(fd, &iov[first], cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+
+        // Skip fully written buffers and advance into a partial one
+        while (first < iov.size() && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (n > 0) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+}
+
 Packfile::Packfile(const string &filename, packid_t id)
     : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
 {
@@ -176,6 +413,18 @@ Packfile::~Packfile()
         close(fd);
 }
 
+packid_t
+Packfile::getPackfileID() const
+{
+    return packid;
+}
+
+size_t
+Packfile::getSize() const
+{
+    return fileSize;
+}
+
 bool Packfile::full() const
 {
     return numObjects >= PACKFILE_MAXOBJS ||
@@ -183,9 +432,11 @@ bool Packfile::full() const
 }
 
 PfTransaction::sp
-Packfile::begin(Index *idx)
+Packfile::begin(Index *idx, const Codec *codec, CompressionMemo *memo)
 {
-    return PfTransaction::sp(new PfTransaction(this, idx));
+    if (codec == nullptr)
+        codec = Codec_Default();
+    return PfTransaction::sp(new PfTransaction(this, idx, codec, memo));
 }
 
 void
@@ -195,132 +446,184 @@ Packfile::commit(PfTransaction *t, Index *idx)
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
 
+    IndexBatch batch;
+    _append(t->infos, t->payloads, &batch);
+
+    // The packfile must be durable before the index refers to it
+    ::fsync(fd);
+    idx->commit(batch);
+    t->committed = true;
+}
+
+/*
+ * Appends a group of objects and adds their locations to batch.
+ */
+void
+Packfile::_append(const vector<ObjectInfo> &infos,
+                  const vector<string> &payloads, IndexBatch *batch)
+{
     lseek(fd, 0, SEEK_END);
     vector<offset_t> offsets;
-    size_t headers_size = t->infos.size() * ENTRYSIZE;
+    size_t headers_size = infos.size() * ENTRYSIZE;
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     
     strwstream headers_ss;
     ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-    headers_ss.writeUInt32(t->infos.size());
-    for (size_t i = 0; i < t->infos.size(); i++) {
-        headers_ss.write(t->infos[i].toString().data(), ObjectInfo::SIZE);
-        headers_ss.writeUInt32(t->payloads[i].size());
+    headers_ss.writeUInt32(infos.size());
+    for (size_t i = 0; i < infos.size(); i++) {
+        headers_ss.write(infos[i].toString().data(), ObjectInfo::SIZE);
+        headers_ss.writeUInt32(payloads[i].size());
         ASSERT(sizeof(uint32_t) == sizeof(offset_t));
         headers_ss.writeUInt32(off);
 
         offsets.push_back(off);
-        off += t->payloads[i].size();
+        off += payloads[i].size();
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
+    // Headers and payloads go out in one vectored write
+    const string &headers = headers_ss.str();
+    vector<struct iovec> iov;
+    iov.reserve(payloads.size() + 1);
+    iov.push_back({(void *)headers.data(), headers.size()});
+    fileSize += headers.size();
 
-    for (size_t i = 0; i < t->payloads.size(); i++) {
-        write(fd, t->payloads[i].data(), t->payloads[i].size());
-        fileSize += t->payloads[i].size();
+    for (size_t i = 0; i < payloads.size(); i++) {
+        if (payloads[i].size() > 0) {
+            iov.push_back({(void *)payloads[i].data(), payloads[i].size()});
+        }
+        fileSize += payloads[i].size();
         numObjects++;
 
         IndexEntry ie;
-        ie.info = t->infos[i];
+        ie.info = infos[i];
         ie.offset = offsets[i];
-        ie.packed_size = t->payloads[i].size();
+        ie.packed_size = payloads[i].size();
         ie.packfile = packid;
 
-        idx->updateEntry(ie.info.hash, ie);
+        batch->add(ie);
     }
 
-    ::fsync(fd);
-    t->committed = true;
+    _writevAll(fd, iov);
 }
 
-bytestream *Packfile::getPayload(const IndexEntry &entry)
+PackMapping::PackMapping(int fd, size_t length)
+    : addr(nullptr), length(length)
 {
-    ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
-   
-    switch (entry.info.getAlgo()) {
-        case ObjectInfo::ZIPALGO_NONE:
-            return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    if (length == 0)
+        return;
+
+    void *m = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        perror("PackMapping mmap");
+        throw SystemException();
     }
-    return 0;
+    addr = (uint8_t *)m;
 }
 
-bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
+PackMapping::~PackMapping()
 {
-    PfTransaction::sp tr = begin(idx);
-    
-    // Read the current contents
-    lseek(fd, 0, SEEK_SET);
-    vector<uint32_t> storedSizes;
-
-    fdstream fs(fd, 0);
-    while (!fs.ended()) {
-        string payload;
-        set<size_t> skip;
+    if (addr != nullptr)
+        munmap(addr, length);
+}
 
-        numobjs_t num;
+/*
+ * Returns a mapping that covers at least the first end bytes.  Packfiles only
+ * grow until they are purged, so a stale mapping is replaced with one of the
+ * current file size.
+ */
+PackMapping::sp
+Packfile::_getMapping(size_t end)
+{
+    mapLock.lock();
+    if (!mapping || mapping->size() < end) {
+        struct stat sb;
+        if (fstat(fd, &sb) < 0) {
+            mapLock.unlock();
+            perror("Packfile fstat");
+            throw SystemException();
+        }
         try {
-            num = fs.readUInt32();
-        } catch (ios_base::failure &e) {
-            break;
+            mapping.reset(new PackMapping(fd, sb.st_size));
+        } catch (SystemException &e) {
+            mapLock.unlock();
+            throw;
         }
+    }
+    PackMapping::sp m = mapping;
+    mapLock.unlock();
 
-        storedSizes.resize(num);
+    return m;
+}
 
-        // Read headers
-        for (size_t i = 0; i < num; i++) {
-            ObjectInfo info;
-            fs.readInfo(info);
-            uint32_t ssize = fs.readUInt32();
-            offset_t off = fs.readUInt32();
-            (void)off;
+size_t
+Packfile::getMappedSize()
+{
+    size_t len = 0;
 
-            storedSizes[i] = ssize;
+    mapLock.lock();
+    if (mapping)
+        len = mapping->size();
+    mapLock.unlock();
 
-            if (hset.find(info.hash) != hset.end()) {
-                skip.insert(i);
-            }
-            else {
-                tr->infos.push_back(info);
-            }
-        }
+    return len;
+}
 
-        // Read payloads
-        for (size_t i = 0; i < num; i++) {
-            payload.resize(storedSizes[i]);
-            fs.read((uint8_t*)&payload[0], storedSizes[i]);
+bytestream *Packfile::getPayload(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+    size_t end = (size_t)entry.offset + entry.packed_size;
+    PackMapping::sp m = _getMapping(end);
+    if (m->size() < end) {
+        WARNING("Object %s lies beyond the end of packfile %u",
+                entry.info.hash.hex().c_str(), packid);
+        throw SystemException(EIO);
+    }
+    bytestream *stored = new mmapstream(m, m->data() + entry.offset,
+                                        entry.packed_size);
 
-            if (skip.find(i) != skip.end()) {
-                continue;
-            }
+    return Codec_DecompressStream(entry.info, stored);
+}
 
-            tr->payloads.push_back(payload);
-        }
-    }
+/*
+ * Copies the stored bytes of objects in src to the end of this packfile.  The
+ * copy is synced before the index entries are replaced in one batch, so
+ * lookups see either the old or the new location.
+ */
+void
+Packfile::relocate(Packfile *src, const vector<IndexEntry> &entries,
+                   Index *idx)
+{
+    vector<ObjectInfo> infos;
+    vector<string> payloads;
+    IndexBatch batch(true);
 
-    // Make a tempfile
-    string tmpFilename = filename + ".tmp";
-    int oldFd = fd;
-    fd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Packfile::purge open");
-        throw SystemException();
+    if (entries.empty())
+        return;
+
+    size_t end = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(entries[i].packfile == src->packid);
+        end = MAX(end, (size_t)entries[i].offset + entries[i].packed_size);
     }
 
-    ::close(oldFd);
-    OriFile_Rename(tmpFilename, filename);
+    PackMapping::sp m = src->_getMapping(end);
+    if (m->size() < end) {
+        WARNING("Relocated objects lie beyond the end of packfile %u",
+                src->packid);
+        throw SystemException(EIO);
+    }
 
-    // Commit the transaction
-    bool empty = tr->payloads.size() == 0;
-    tr.reset();
+    infos.reserve(entries.size());
+    payloads.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        infos.push_back(entries[i].info);
+        payloads.push_back(string((const char *)m->data() + entries[i].offset,
+                                  entries[i].packed_size));
+    }
 
-    return empty;
+    _append(infos, payloads, &batch);
+    ::fsync(fd);
+    idx->commit(batch);
 }
 
 void
@@ -356,6 +659,35 @@ _offsetCmp(const IndexEntry &ie1, const IndexEntry &ie2)
     return ie1.offset < ie2.offset;
 }
 
+vector<IndexEntry>
+Packfile::getEntries()
+{
+    vector<IndexEntry> entries;
+    offset_t groupOffset = 0;
+
+    while (groupOffset < fileSize) {
+        fdstream readStream(fd, groupOffset);
+        numobjs_t objs = readStream.readUInt32();
+
+        // Skip the header of an empty group
+        groupOffset += sizeof(numobjs_t);
+        for (size_t i = 0; i < objs; i++) {
+            IndexEntry entry;
+
+            readStream.readInfo(entry.info);
+            entry.packed_size = readStream.readUInt32();
+            entry.offset = readStream.readUInt32();
+            entry.packfile = packid;
+            entries.push_back(entry);
+
+            ASSERT(groupOffset <= entry.offset + entry.packed_size);
+            groupOffset = entry.offset + entry.packed_size;
+        }
+    }
+
+    return entries;
+}
+
 void
 Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
 {
@@ -425,130 +757,391 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     bs->writeUInt32(totalObjs);
     bs->write(infos_ss.str().data(), infos_ss.str().size());
 
-    // Transmit objects
+    // Transmit objects, reading large blocks piecewise
     vector<uint8_t> buf;
     for (map<offset_t, offset_t>::iterator it = blocks.begin();
             it != blocks.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
 	ASSERT((*it).second >= (*it).first);
-        ssize_t len = (*it).second - (*it).first;
-        buf.resize(len);
-        ssize_t n = read(fd, &buf[0], len);
-        if (n < 0 || n != len) {
-            throw SystemException();
-        }
-        ASSERT(n == len);
-        //fprintf(stderr, "Wrote block size %ld\n", len);
+        offset_t off = (*it).first;
+        while (off < (*it).second) {
+            size_t len = MIN((*it).second - off, (offset_t)TRANSMIT_READSIZE);
+            buf.resize(len);
+            ssize_t n = pread(fd, &buf[0], len, off);
+            if (n < 0 || (size_t)n != len) {
+                throw SystemException();
+            }
 
-        bs->write(&buf[0], len);
+            bs->write(&buf[0], len);
+            off += len;
+        }
     }
     ASSERT(!bs->error());
 }
 
+/*
+ * GroupReader
+ */
+
+GroupReader::GroupReader(bytestream *bs)
+    : bs(bs), next(0)
+{
+}
 
 bool
-Packfile::receive(bytestream *bs, Index *idx)
+GroupReader::nextGroup()
 {
-    ASSERT(sizeof(uint32_t) == sizeof(numobjs_t));
+    // Objects left unread would be taken for the next group's headers
+    ASSERT(next == infos.size());
+
+    infos.clear();
+    sizes.clear();
+    next = 0;
+
     numobjs_t num = bs->readUInt32();
-    if (num == 0) return false;
+    if (num == 0)
+        return false;
+    if (num == NUMOBJS_ABORT) {
+        WARNING("The sender aborted the object stream");
+        throw RuntimeException(ORIEC_BSCORRUPT, "Object stream aborted");
+    }
 
-    lseek(fd, 0, SEEK_END);
-    size_t headers_size = num * ENTRYSIZE;
-    offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
-    vector<size_t> obj_sizes;
-    
-    strwstream headers_ss;
-    ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
-    headers_ss.writeUInt32(num);
     for (size_t i = 0; i < num; i++) {
         string info_str(ObjectInfo::SIZE, '\0');
         bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
         ObjectInfo info;
         info.fromString(info_str);
-        //info.print();
 
-        uint32_t obj_size = bs->readUInt32();
-        obj_sizes.push_back(obj_size);
-
-        headers_ss.write(info_str.data(), ObjectInfo::SIZE);
-        headers_ss.writeUInt32(obj_size);
-        ASSERT(sizeof(offset_t) == sizeof(uint32_t));
-        headers_ss.writeUInt32(off);
+        infos.push_back(info);
+        sizes.push_back(bs->readUInt32());
+    }
 
-        IndexEntry ie = {info, off, obj_size, packid};
-        idx->updateEntry(info.hash, ie);
+    return true;
+}
 
-        off += obj_size;
+pair<ObjectInfo, string>
+GroupReader::readObject(string *stored)
+{
+    ASSERT(next < infos.size());
+
+    string buf;
+    string &data = stored ? *stored : buf;
+    const ObjectInfo &info = infos[next];
+
+    data.resize(sizes[next]);
+    if (!data.empty())
+        bs->readExact((uint8_t*)&data[0], data.size());
+    next++;
+
+    if (info.type == ObjectInfo::Purged)
+        return make_pair(info, string());
+
+    string payload = Codec_Decompress(info, (const uint8_t *)data.data(),
+                                      data.size());
+    if (OriCrypt_HashString(payload) != info.hash) {
+        WARNING("Received object %s does not match its hash",
+                info.hash.hex().c_str());
+        throw RuntimeException(ORIEC_BSCORRUPT, "Object hash mismatch");
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
+    return make_pair(info, payload);
+}
 
-    vector<uint8_t> data;
-    for (size_t i = 0; i < num; i++) {
-        //fprintf(stderr, "Reading %lu packed size %lu\n", i, obj_sizes[i]);
-        data.resize(obj_sizes[i]);
-        bs->readExact(&data[0], obj_sizes[i]);
-        
-        write(fd, &data[0], obj_sizes[i]);
-        fileSize += obj_sizes[i];
-        numObjects++;
+/*
+ * Appends one group from the stream.  Objects are written as they arrive so
+ * that only one object is held in memory, and each is checked against its
+ * hash first.  Objects that are already indexed are read and dropped.  The
+ * group is indexed once all of it is durable, if the stream ends early or
+ * holds a corrupt object the packfile is truncated back to the start of the
+ * group and the exception is passed on.
+ */
+bool
+Packfile::receive(bytestream *bs, Index *idx)
+{
+    ASSERT(sizeof(uint32_t) == sizeof(numobjs_t));
+    GroupReader gr(bs);
+    if (!gr.nextGroup()) return false;
+
+    const vector<ObjectInfo> &infos = gr.getInfos();
+    const vector<uint32_t> &sizes = gr.getSizes();
+    unordered_set<ObjectHash> seen;
+    vector<bool> keep(infos.size());
+    size_t num = 0;
+    for (size_t i = 0; i < infos.size(); i++) {
+        keep[i] = !idx->hasObject(infos[i].hash) &&
+                  seen.insert(infos[i].hash).second;
+        if (keep[i])
+            num++;
     }
 
-    return true;
-}
+    // Nothing new, the group is consumed without touching the packfile
+    if (num == 0) {
+        string data;
+        while (gr.hasObject())
+            gr.readObject(&data);
+        return true;
+    }
+
+    const size_t startSize = fileSize;
+    const size_t startObjects = numObjects;
+    size_t headers_size = num * ENTRYSIZE;
+    offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
+    IndexBatch batch;
+
+    try {
+        strwstream headers_ss;
+        ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
+        headers_ss.writeUInt32(num);
+        for (size_t i = 0; i < infos.size(); i++) {
+            if (!keep[i])
+                continue;
+            headers_ss.write(infos[i].toString().data(), ObjectInfo::SIZE);
+            headers_ss.writeUInt32(sizes[i]);
+            ASSERT(sizeof(offset_t) == sizeof(uint32_t));
+            headers_ss.writeUInt32(off);
+
+            off += sizes[i];
+        }
+
+        const string &headers = headers_ss.str();
+        vector<struct iovec> iov(1);
+        iov[0].iov_base = (void *)headers.data();
+        iov[0].iov_len = headers.size();
+        lseek(fd, 0, SEEK_END);
+        _writevAll(fd, iov);
+        fileSize += headers.size();
 
+        string data;
+        for (size_t i = 0; i < infos.size(); i++) {
+            IndexEntry ie = {infos[i], (offset_t)fileSize, sizes[i], packid};
 
+            gr.readObject(&data);
+            if (!keep[i])
+                continue;
+
+            iov[0].iov_base = (void *)data.data();
+            iov[0].iov_len = data.size();
+            _writevAll(fd, iov);
+            fileSize += data.size();
+            numObjects++;
+            batch.add(ie);
+        }
+    } catch (...) {
+        if (ftruncate(fd, startSize) < 0)
+            WARNING("Could not truncate packfile %u: %s",
+                    packid, strerror(errno));
+        fileSize = startSize;
+        numObjects = startObjects;
+        throw;
+    }
 
+    // Index the objects only once their data is durable
+    ::fsync(fd);
+    idx->commit(batch);
+
+    return true;
+}
 
 /*
  * PackfileManager
  */
 
 PackfileManager::PackfileManager(const string &rootPath)
-    : rootPath(rootPath)
+    : rootPath(rootPath), statsLoaded(false), statsDirty(false),
+      maxFds(PFMGR_MAXFDS), maxMapped(PFMGR_MAXMAPPED),
+      hits(0), misses(0), evictions(0)
 {
     if (!_loadFreeList()) {
         _recomputeFreeList();
         _writeFreeList();
     }
+    statsLoaded = _loadPackStats();
 }
 
 PackfileManager::~PackfileManager()
 {
+    // No handles remain so retired ids can be reused
+    reclaimRetired();
     _writeFreeList();
+    syncPackStats();
 }
 
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
-    if (!_packfileCache.hasKey(id)) {
-        Packfile::sp pf(new Packfile(_getPackfileName(id), id));
-
-        _packfileCache.put(id, pf);
+    cacheLock.lock();
+    unordered_map<packid_t, Handle>::iterator it = handles.find(id);
+    if (it != handles.end()) {
+        Handle &h = (*it).second;
+        lru.splice(lru.end(), lru, h.lruIt);
+        hits++;
+        Packfile::sp pf = h.pf;
+        cacheLock.unlock();
         return pf;
     }
+    misses++;
+    cacheLock.unlock();
+
+    // Open outside of the lock, if another thread raced us its handle wins
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+
+    cacheLock.lock();
+    it = handles.find(id);
+    if (it != handles.end()) {
+        pf = (*it).second.pf;
+    } else {
+        _insertHandle(id, pf);
+    }
+    cacheLock.unlock();
 
-    return _packfileCache.get(id);
+    return pf;
 }
 
 Packfile::sp
 PackfileManager::newPackfile()
 {
+    freeListLock.lock();
     ASSERT(freeList.size() > 0);
     packid_t id = freeList[0];
-    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
     if (freeList.size() == 1) {
         freeList[0] += 1;
     }
     else {
         freeList.pop_front();
     }
+    freeListLock.unlock();
+
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    // Share one handle and mapping between the writer and readers
+    cacheLock.lock();
+    unordered_map<packid_t, Handle>::iterator it = handles.find(id);
+    if (it != handles.end()) {
+        lru.erase((*it).second.lruIt);
+        handles.erase(it);
+    }
+    _insertHandle(id, pf);
+    cacheLock.unlock();
     return pf;
 }
 
+void
+PackfileManager::setBudget(size_t fds, size_t mapped)
+{
+    cacheLock.lock();
+    maxFds = fds;
+    maxMapped = mapped;
+    _enforceBudget();
+    cacheLock.unlock();
+}
+
+PackfileManager::Stats
+PackfileManager::getStats()
+{
+    Stats st;
+
+    cacheLock.lock();
+    st.hits = hits;
+    st.misses = misses;
+    st.evictions = evictions;
+    st.openHandles = handles.size();
+    st.mappedBytes = 0;
+    for (unordered_map<packid_t, Handle>::iterator it = handles.begin();
+            it != handles.end();
+            it++) {
+        st.mappedBytes += (*it).second.pf->getMappedSize();
+    }
+    cacheLock.unlock();
+
+    return st;
+}
+
+/*
+ * Called with cacheLock held.
+ */
+void
+PackfileManager::_insertHandle(packid_t id, Packfile::sp pf)
+{
+    Handle h;
+
+    h.pf = pf;
+    h.lruIt = lru.insert(lru.end(), id);
+    handles[id] = h;
+
+    _enforceBudget();
+}
+
+/*
+ * Closes idle handles from the cold end of the LRU until both budgets are
+ * met.  Handles referenced outside of the cache are pinned and skipped.
+ * Called with cacheLock held.
+ */
+void
+PackfileManager::_enforceBudget()
+{
+    size_t mapped = 0;
+    for (unordered_map<packid_t, Handle>::iterator it = handles.begin();
+            it != handles.end();
+            it++) {
+        mapped += (*it).second.pf->getMappedSize();
+    }
+
+    HandleLRU::iterator it = lru.begin();
+    while (it != lru.end() && (handles.size() > maxFds || mapped > maxMapped)) {
+        Handle &h = handles[*it];
+        if (h.pf.use_count() > 1) {
+            // Pinned
+            it++;
+            continue;
+        }
+
+        mapped -= h.pf->getMappedSize();
+        handles.erase(*it);
+        it = lru.erase(it);
+        evictions++;
+    }
+}
+
+void
+PackfileManager::retirePackfile(packid_t id)
+{
+    OriFile_Delete(_getPackfileName(id));
+
+    freeListLock.lock();
+    retired.push_back(id);
+    freeListLock.unlock();
+
+    statsLock.lock();
+    packStats.erase(id);
+    statsDirty = true;
+    statsLock.unlock();
+}
+
+void
+PackfileManager::reclaimRetired()
+{
+    vector<packid_t> ids;
+
+    freeListLock.lock();
+    ids.swap(retired);
+    freeListLock.unlock();
+
+    cacheLock.lock();
+    for (size_t i = 0; i < ids.size(); i++) {
+        unordered_map<packid_t, Handle>::iterator it = handles.find(ids[i]);
+        if (it != handles.end()) {
+            lru.erase((*it).second.lruIt);
+            handles.erase(it);
+        }
+    }
+    cacheLock.unlock();
+
+    // The last entry is the next unused id
+    freeListLock.lock();
+    for (size_t i = 0; i < ids.size(); i++)
+        freeList.push_front(ids[i]);
+    freeListLock.unlock();
+}
+
 bool
 PackfileManager::hasPackfile(packid_t id)
 {
@@ -652,6 +1245,147 @@ PackfileManager::_writeFreeList()
     close(fd);
 }
 
+void
+PackfileManager::addLive(packid_t id, uint64_t bytes)
+{
+    statsLock.lock();
+    PackStats &st = packStats[id];
+    st.live += bytes;
+    statsDirty = true;
+    statsLock.unlock();
+}
+
+/*
+ * Moves bytes from live to dead.  The counters are advisory (they may be
+ * stale after a crash) so they saturate instead of underflowing.
+ */
+void
+PackfileManager::addDead(packid_t id, uint64_t bytes)
+{
+    statsLock.lock();
+    PackStats &st = packStats[id];
+    st.live -= MIN(st.live, bytes);
+    st.dead += bytes;
+    statsDirty = true;
+    statsLock.unlock();
+}
+
+map<packid_t, PackfileManager::PackStats>
+PackfileManager::getPackStats()
+{
+    map<packid_t, PackStats> stats;
+
+    statsLock.lock();
+    stats = packStats;
+    statsLock.unlock();
+
+    return stats;
+}
+
+void
+PackfileManager::setPackStats(const map<packid_t, PackStats> &stats)
+{
+    statsLock.lock();
+    packStats = stats;
+    statsLoaded = true;
+    statsDirty = true;
+    statsLock.unlock();
+}
+
+bool
+PackfileManager::hasPackStats()
+{
+    bool loaded;
+
+    statsLock.lock();
+    loaded = statsLoaded;
+    statsLock.unlock();
+
+    return loaded;
+}
+
+void
+PackfileManager::syncPackStats()
+{
+    statsLock.lock();
+    if (statsDirty) {
+        try {
+            _writePackStats();
+        } catch (SystemException &e) {
+            statsLock.unlock();
+            throw;
+        }
+        statsDirty = false;
+    }
+    statsLock.unlock();
+}
+
+bool
+PackfileManager::_loadPackStats()
+{
+    string statsPath = rootPath + PFMGR_PACKSTATS;
+    int fd = ::open(statsPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    fdstream fs(fd, 0);
+    uint32_t numEntries = fs.readUInt32();
+    for (size_t i = 0; i < numEntries && !fs.error(); i++) {
+        PackStats st;
+        packid_t id = fs.readUInt32();
+        st.live = fs.readUInt64();
+        st.dead = fs.readUInt64();
+        packStats[id] = st;
+    }
+    bool ok = !fs.error();
+    close(fd);
+
+    if (!ok) {
+        WARNING("Ignoring corrupt packfile statistics");
+        packStats.clear();
+    }
+
+    return ok;
+}
+
+/*
+ * Called with statsLock held.  The file is replaced atomically so a crash
+ * leaves either the old or the new counters.
+ */
+void
+PackfileManager::_writePackStats()
+{
+    strwstream ss;
+    ss.writeUInt32(packStats.size());
+    for (map<packid_t, PackStats>::iterator it = packStats.begin();
+            it != packStats.end();
+            it++) {
+        ss.writeUInt32((*it).first);
+        ss.writeUInt64((*it).second.live);
+        ss.writeUInt64((*it).second.dead);
+    }
+
+    string statsPath = rootPath + PFMGR_PACKSTATS;
+    string tmpPath = statsPath + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("PackfileManager::_writePackStats open");
+        throw SystemException();
+    }
+    const string &str = ss.str();
+    if (write(fd, str.data(), str.size()) != (ssize_t)str.size()) {
+        close(fd);
+        throw SystemException();
+    }
+    close(fd);
+
+    if (rename(tmpPath.c_str(), statsPath.c_str()) < 0) {
+        perror("PackfileManager::_writePackStats rename");
+        throw SystemException();
+    }
+}
+
 string
 PackfileManager::_getPackfileName(packid_t id)
 {
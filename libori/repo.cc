@@ -19,7 +19,10 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
 #include <queue>
+#include <unordered_set>
+#include <atomic>
 #include <iostream>
 
 #include "tuneables.h"
@@ -29,9 +32,11 @@
 #include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/dag.h>
+#include <oriutil/shardedcache.h>
 
 #include <ori/object.h>
 #include <ori/largeblob.h>
+#include <ori/packfile.h>
 #include <ori/repo.h>
 
 using namespace std;
@@ -53,6 +58,48 @@ ObjectHash::fromHex("c8877087da56e072870daa843f176e9453115929094c3a40c463a196c29
  * Repo
  */
 
+struct RepoObjectCache
+{
+    RepoObjectCache()
+        : hits(0), misses(0), pathHits(0), pathMisses(0) { }
+
+    ShardedCache<ObjectHash, shared_ptr<const Tree>,
+                 REPO_TREECACHE_SIZE> trees;
+    ShardedCache<ObjectHash, shared_ptr<const Commit>,
+                 REPO_COMMITCACHE_SIZE> commits;
+    ShardedCache<ObjectHash, shared_ptr<const LargeBlob>,
+                 REPO_LBLOBCACHE_SIZE> lblobs;
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+
+    /// Keyed by the binary root tree hash followed by "/a/b"
+    struct PathEntry {
+        ObjectHash hash;
+        TreeEntry::EntryType type;
+    };
+    ShardedCache<string, PathEntry, REPO_PATHCACHE_SIZE> paths;
+    atomic<uint64_t> pathHits;
+    atomic<uint64_t> pathMisses;
+};
+
+Repo::Repo()
+    : objCache(new RepoObjectCache())
+{
+}
+
+Repo::Repo(const Repo &r)
+    : objCache(new RepoObjectCache())
+{
+}
+
+Repo &
+Repo::operator=(const Repo &r)
+{
+    // Cached large blobs point back at their repository
+    objCache.reset(new RepoObjectCache());
+    return *this;
+}
+
 Repo::~Repo() {
 }
 
@@ -72,6 +119,12 @@ Repo::hasObjects(const ObjectHashVec &ids)
     return rval;
 }
 
+ObjectFilter::sp
+Repo::getObjectFilter()
+{
+    return ObjectFilter::sp();
+}
+
 /*
  * High-level operations
  */
@@ -82,6 +135,20 @@ Repo::copyFrom(Object *other)
     addObject(other->getInfo().type, other->getInfo().hash, other->getPayload());
 }
 
+int
+Repo::addPreparedObject(const ObjectInfo &info, const string &payload,
+                        const string &stored)
+{
+    return addObject(info.type, info.hash, payload);
+}
+
+int
+Repo::addFileObject(const ObjectHash &hash, const string &payload,
+                    const string &fileType)
+{
+    return addObject(ObjectInfo::Blob, hash, payload);
+}
+
 /*
  * Add a blob to the repository. This is a low-level interface.
  */
@@ -104,6 +171,100 @@ Repo::getObjects(const std::deque<ObjectHash> &objs)
     return getObjects(vec);
 }
 
+/*
+ * Marks a tree and everything it references as known to the caller.  Trees
+ * shared between commits are only walked once.
+ */
+static void
+_markKnown(Repo *r, const ObjectHash &treeId, unordered_set<ObjectHash> &known)
+{
+    if (!known.insert(treeId).second || !r->hasObject(treeId))
+        return;
+
+    shared_ptr<const Tree> t = r->getTreeRef(treeId);
+    for (map<string, TreeEntry>::const_iterator it = t->tree.begin();
+            it != t->tree.end();
+            it++) {
+        const TreeEntry &te = (*it).second;
+        if (te.type == TreeEntry::Tree) {
+            _markKnown(r, te.hash, known);
+        } else if (te.type == TreeEntry::LargeBlob) {
+            // Chunks are shared between versions of a file
+            if (!known.insert(te.hash).second || !r->hasObject(te.hash))
+                continue;
+            shared_ptr<const LargeBlob> lb = r->getLargeBlobRef(te.hash);
+            for (size_t i = 0; i < lb->parts.size(); i++)
+                known.insert(lb->parts[i].hash);
+        } else {
+            known.insert(te.hash);
+        }
+    }
+}
+
+static void
+_addMissing(Repo *r, const ObjectHash &treeId, unordered_set<ObjectHash> &known,
+            ObjectHashVec &objs)
+{
+    if (!known.insert(treeId).second)
+        return;
+    objs.push_back(treeId);
+
+    shared_ptr<const Tree> t = r->getTreeRef(treeId);
+    for (map<string, TreeEntry>::const_iterator it = t->tree.begin();
+            it != t->tree.end();
+            it++) {
+        const TreeEntry &te = (*it).second;
+        if (te.type == TreeEntry::Tree) {
+            _addMissing(r, te.hash, known, objs);
+        } else if (te.type == TreeEntry::LargeBlob) {
+            if (!known.insert(te.hash).second)
+                continue;
+            objs.push_back(te.hash);
+            shared_ptr<const LargeBlob> lb = r->getLargeBlobRef(te.hash);
+            for (size_t i = 0; i < lb->parts.size(); i++) {
+                if (known.insert(lb->parts[i].hash).second)
+                    objs.push_back(lb->parts[i].hash);
+            }
+        } else if (known.insert(te.hash).second) {
+            objs.push_back(te.hash);
+        }
+    }
+}
+
+/*
+ * Only commits whose objects are all present may be passed as haves.  Haves
+ * that this repository does not know are ignored.
+ */
+ObjectHashVec
+Repo::listMissingObjects(const ObjectHashVec &wants, const ObjectHashVec &haves)
+{
+    unordered_set<ObjectHash> known;
+    ObjectHashVec objs;
+
+    for (size_t i = 0; i < haves.size(); i++) {
+        if (!hasObject(haves[i]) || !known.insert(haves[i]).second)
+            continue;
+        shared_ptr<const Commit> c = getCommitRef(haves[i]);
+        _markKnown(this, c->getTree(), known);
+    }
+
+    for (size_t i = 0; i < wants.size(); i++) {
+        if (!hasObject(wants[i]) || !known.insert(wants[i]).second)
+            continue;
+        objs.push_back(wants[i]);
+        shared_ptr<const Commit> c = getCommitRef(wants[i]);
+        _addMissing(this, c->getTree(), known, objs);
+    }
+
+    return objs;
+}
+
+bytestream *
+Repo::getMissingObjects(const ObjectHashVec &wants, const ObjectHashVec &haves)
+{
+    return getObjects(listMissingObjects(wants, haves));
+}
+
 
 /*
  * Add a file to the repository. This is a low-level interface.
@@ -112,7 +273,11 @@ ObjectHash
 Repo::addSmallFile(const string &path)
 {
     diskstream ds(path);
-    return addBlob(ObjectInfo::Blob, ds.readAll());
+    string blob = ds.readAll();
+    ObjectHash hash = OriCrypt_HashString(blob);
+
+    addFileObject(hash, blob, CompressionMemo::fileType(path));
+    return hash;
 }
 
 /*
@@ -130,10 +295,10 @@ Repo::addLargeFile(const string &path)
     // TODO: this should only be called when committing,
     // we'll take care of backrefs then
     /*if (!hasObject(hash)) {
-        map<uint64_t, LBlobEntry>::iterator it;
+        vector<LBlobEntry>::iterator it;
 
         for (it = lb.parts.begin(); it != lb.parts.end(); it++) {
-            addBackref((*it).second.hash);
+            addBackref((*it).hash);
         }
     }*/
 
@@ -161,6 +326,31 @@ Repo::addFile(const string &path)
 Tree
 Repo::getTree(const ObjectHash &treeId)
 {
+    return *getTreeRef(treeId);
+}
+
+Commit
+Repo::getCommit(const ObjectHash &commitId)
+{
+    return *getCommitRef(commitId);
+}
+
+LargeBlob
+Repo::getLargeBlob(const ObjectHash &objId)
+{
+    return *getLargeBlobRef(objId);
+}
+
+shared_ptr<const Tree>
+Repo::getTreeRef(const ObjectHash &treeId)
+{
+    shared_ptr<const Tree> cached;
+    if (objCache->trees.get(treeId, cached)) {
+        objCache->hits++;
+        return cached;
+    }
+    objCache->misses++;
+
     Object::sp o(getObject(treeId));
     if (!o.get()) {
         throw std::runtime_error("Object not found");
@@ -169,50 +359,94 @@ Repo::getTree(const ObjectHash &treeId)
 
     ASSERT(treeId == EMPTYFILE_HASH || o->getInfo().type == ObjectInfo::Tree);
 
-    Tree t;
-    t.fromBlob(blob);
+    shared_ptr<Tree> t(new Tree());
+    t->fromBlob(blob);
+
+    objCache->trees.put(treeId, t);
 
     return t;
 }
 
-Commit
-Repo::getCommit(const ObjectHash &commitId)
+shared_ptr<const Commit>
+Repo::getCommitRef(const ObjectHash &commitId)
 {
+    shared_ptr<const Commit> cached;
+    if (objCache->commits.get(commitId, cached)) {
+        objCache->hits++;
+        return cached;
+    }
+    objCache->misses++;
+
     Object::sp o(getObject(commitId));
     std::string blob = o->getPayload();
 
     ASSERT(commitId == EMPTYFILE_HASH || o->getInfo().type == ObjectInfo::Commit);
 
-    Commit c;
+    shared_ptr<Commit> c(new Commit());
     if (blob.empty()) {
         printf("Error getting commit blob\n");
         PANIC();
         return c;
     }
-    c.fromBlob(blob);
+    c->fromBlob(blob);
+
+    objCache->commits.put(commitId, c);
 
     return c;
 }
 
-LargeBlob
-Repo::getLargeBlob(const ObjectHash &objId)
+shared_ptr<const LargeBlob>
+Repo::getLargeBlobRef(const ObjectHash &objId)
 {
+    shared_ptr<const LargeBlob> cached;
+    if (objCache->lblobs.get(objId, cached)) {
+        objCache->hits++;
+        return cached;
+    }
+    objCache->misses++;
+
     Object::sp o(getObject(objId));
     string blob = o->getPayload();
 
     ASSERT(objId == EMPTYFILE_HASH || o->getInfo().type == ObjectInfo::LargeBlob);
 
-    LargeBlob lb(this);
+    shared_ptr<LargeBlob> lb(new LargeBlob(this));
     if (blob.size() == 0) {
         printf("Error getting commit blob\n");
         PANIC();
         return lb;
     }
-    lb.fromBlob(blob);
+    lb->fromBlob(blob);
+
+    objCache->lblobs.put(objId, lb);
 
     return lb;
 }
 
+Repo::ObjectCacheStats
+Repo::getObjectCacheStats()
+{
+    ObjectCacheStats st;
+
+    st.hits = objCache->hits;
+    st.misses = objCache->misses;
+    st.entries = objCache->trees.size() + objCache->commits.size() +
+                 objCache->lblobs.size();
+    st.pathHits = objCache->pathHits;
+    st.pathMisses = objCache->pathMisses;
+    st.pathEntries = objCache->paths.size();
+
+    return st;
+}
+
+void
+Repo::invalidateObjectCache(const ObjectHash &objId)
+{
+    objCache->trees.invalidate(objId);
+    objCache->commits.invalidate(objId);
+    objCache->lblobs.invalidate(objId);
+}
+
 DAG<ObjectHash, Commit>
 Repo::getCommitDag()
 {
@@ -240,9 +474,21 @@ Repo::getCommitDag()
  */
 ObjectHash
 Repo::lookup(const Commit &c, const std::string &path)
+{
+    return lookupPath(c.getTree(), path);
+}
+
+/*
+ * Lookup a path relative to a tree.  Trees are immutable so the result for a
+ * (tree, path) pair never changes.  Every prefix that is resolved is cached,
+ * a later lookup resumes from the longest cached prefix and a repeated lookup
+ * takes a single cache probe.  Missing paths are cached as an empty hash.
+ */
+ObjectHash
+Repo::lookupPath(const ObjectHash &treeId, const std::string &path)
 {
     const std::vector<std::string> pv = Util_PathToVector(path);
-    ObjectHash objId = c.getTree();
+    ObjectHash objId = treeId;
 
     if (path == "/")
         return objId;
@@ -250,13 +496,56 @@ Repo::lookup(const Commit &c, const std::string &path)
     if (pv.empty())
         return ObjectHash();
 
+    vector<string> keys;
+    keys.reserve(pv.size());
+    string key = treeId.bin();
     for (size_t i = 0; i < pv.size(); ++i) {
-        Tree t = getTree(objId);
-        const auto e = t.tree.find(pv[i]);
-        if (e == t.tree.end()) {
+        key += "/" + pv[i];
+        keys.push_back(key);
+    }
+
+    RepoObjectCache::PathEntry pe;
+    if (objCache->paths.get(keys.back(), pe)) {
+        objCache->pathHits++;
+        return pe.hash;
+    }
+    objCache->pathMisses++;
+
+    // Missing paths and children of files resolve to nothing
+    RepoObjectCache::PathEntry missing;
+    missing.type = TreeEntry::Null;
+
+    // Resume from the longest resolved prefix
+    size_t start = 0;
+    for (size_t i = pv.size() - 1; i > 0; --i) {
+        if (objCache->paths.get(keys[i - 1], pe)) {
+            if (pe.type != TreeEntry::Tree) {
+                objCache->paths.put(keys.back(), missing);
+                return ObjectHash();
+            }
+            objId = pe.hash;
+            start = i;
+            break;
+        }
+    }
+
+    for (size_t i = start; i < pv.size(); ++i) {
+        shared_ptr<const Tree> t = getTreeRef(objId);
+        const auto e = t->tree.find(pv[i]);
+        if (e == t->tree.end()) {
+            objCache->paths.put(keys[i], missing);
+            objCache->paths.put(keys.back(), missing);
+            return ObjectHash();
+        }
+        pe.hash = (*e).second.hash;
+        pe.type = (*e).second.type;
+        objCache->paths.put(keys[i], pe);
+
+        if (i + 1 < pv.size() && pe.type != TreeEntry::Tree) {
+            objCache->paths.put(keys.back(), missing);
             return ObjectHash();
         }
-        objId = t.tree[pv[i]].hash;
+        objId = pe.hash;
     }
 
     return objId;
@@ -36,6 +36,7 @@
 #include <oriutil/oricrypt.h>
 
 #include "rkchunker.h"
+#include "gearchunker.h"
 
 using namespace std;
 
@@ -153,6 +154,10 @@ chunkFile(const string &path)
     FChunker<32*1024> c = FChunker<32*1024>();
 #endif /* ORI_USE_FIXED */
 
+#ifdef ORI_USE_GEAR
+    GearChunker<4096, 2048, 8192> c;
+#endif /* ORI_USE_GEAR */
+
     status = cb.open(path);
     if (status < 0) {
         perror("Cannot open large file for chunking");
@@ -182,6 +182,12 @@ SnapshotIndex::delSnapshot(const std::string &name)
     rewrite();
 }
 
+bool
+SnapshotIndex::hasSnapshot(const string &name) const
+{
+    return snapshots.find(name) != snapshots.end();
+}
+
 const ObjectHash &
 SnapshotIndex::getSnapshot(const string &name) const
 {
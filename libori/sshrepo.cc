@@ -30,6 +30,7 @@
 #include <vector>
 
 #include <oriutil/debug.h>
+#include <oriutil/codec.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
 #include <ori/packfile.h>
@@ -106,37 +107,14 @@ Object::sp SshRepo::getObject(const ObjectHash &id)
     objs.push_back(id);
     bytestream::ap bs(getObjects(objs));
     if (bs.get()) {
-        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-        numobjs_t num = bs->readUInt32();
-        ASSERT(num == 1);
-
-        std::string info_str(ObjectInfo::SIZE, '\0');
-        bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
-        ObjectInfo info;
-        info.fromString(info_str);
-
-        uint32_t objSize = bs->readUInt32();
-        std::string payload(objSize, '\0');
-        bs->readExact((uint8_t*)&payload[0], objSize);
-
-        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-        num = bs->readUInt32();
-        ASSERT(num == 0);
-
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
-        return Object::sp(new SshObject(this, info));
+        GroupReader gr(bs.get());
+        // The remote leaves out objects it does not have
+        if (!gr.nextGroup())
+            return Object::sp();
+
+        pair<ObjectInfo, string> o = gr.readObject();
+        payloads[o.first.hash] = o.second;
+        return Object::sp(new SshObject(this, o.first));
     }
     return Object::sp();
 }
@@ -162,6 +140,57 @@ SshRepo::getObjects(const ObjectHashVec &objs)
     return nullptr;
 }
 
+/*
+ * Older servers reject getmissing before reading the request, so the
+ * connection stays usable for the fallback.
+ */
+bytestream *
+SshRepo::getMissingObjects(const ObjectHashVec &wants,
+                          const ObjectHashVec &haves)
+{
+    client->sendCommand("getmissing");
+    if (!client->respIsOK())
+        return nullptr;
+
+    strwstream ss;
+    ss.writeUInt32(wants.size());
+    for (size_t i = 0; i < wants.size(); i++) {
+        ss.writeHash(wants[i]);
+    }
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+    client->sendData(ss.str());
+    DLOG("Requesting missing objects for %lu wants", wants.size());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return nullptr;
+}
+
+ObjectFilter::sp
+SshRepo::getObjectFilter()
+{
+    client->sendCommand("get objfilter");
+
+    bool ok = client->respIsOK();
+    if (!ok)
+        return ObjectFilter::sp();
+
+    bytestream::ap bs(client->getStream());
+    std::string blob(bs->readUInt64(), '\0');
+    bs->readExact((uint8_t *)&blob[0], blob.size());
+
+    ObjectFilter::sp filter(new ObjectFilter());
+    if (!filter->fromBlob(blob))
+        return ObjectFilter::sp();
+    return filter;
+}
+
 ObjectInfo
 SshRepo::getObjectInfo(const ObjectHash &id)
 {
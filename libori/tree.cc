@@ -286,9 +286,9 @@ _recFlatten(
         rval->insert(make_pair(prefix + it.first, te));
         if (te.type == TreeEntry::Tree) {
             // Recurse further
-            Tree subtree = r->getTree(te.hash);
+            shared_ptr<const Tree> subtree = r->getTreeRef(te.hash);
             _recFlatten(prefix + it.first + "/",
-                    &subtree, rval, r);
+                    subtree.get(), rval, r);
         }
     }
 }
@@ -23,16 +23,93 @@
 
 // Minimum compressable object (FastLZ requires 66 bytes)
 #define ZIP_MINIMUM_SIZE 512
-// How much of a payload to check for compressibility
-#define COMPCHECK_BYTES 1024
 // Maximum compression ratio (0.8 means compressed file is 80% size of original)
 #define COMPCHECK_RATIO 0.95
+// Payloads with a higher estimated entropy (bits per byte) are not compressed
+#define COMPCHECK_MAXENTROPY 7.5
+// Outcomes seen before a file type decides alone, 1/SAMPLES of outcomes may
+// disagree; trusted types are checked again every REPROBE lookups
+#define COMPMEMO_SAMPLES 16
+#define COMPMEMO_REPROBE 64
+#define COMPMEMO_MAXTYPES 1024
+#define COMPMEMO_MAXEXTLEN 8
+
+// Large file ingestion: chunks in flight and hashing/compression threads
+#define LBLOB_PIPELINE_DEPTH 1024
+#define LBLOB_PIPELINE_MAXWORKERS 16
+// Large file reads: decoded chunks kept per reader, chunks prefetched and the
+// number of back to back reads that count as sequential access
+#define LBLOB_READER_WINDOW 64
+#define LBLOB_READAHEAD 16
+#define LBLOB_READER_SEQREADS 2
+// Chunks requested per getObjects call when extracting from a remote
+#define LBLOB_EXTRACT_BATCH 1024
+
+// Objects and (approximate) bytes requested per getObjects call when pulling
+#define PULL_BATCHOBJS 4096
+#define PULL_BATCHBYTES (32 * 1024 * 1024)
+// Multi-source pull: weight of the latest batch in a peer's measured rate,
+// how often to look for new peers, and how long to wait for a source
+#define MULTIPULL_RATE_WEIGHT 0.25
+#define MULTIPULL_POLL_MS 100
+#define MULTIPULL_RETRY_SECS 1
+#define MULTIPULL_GIVEUP_SECS 60
+// Objects are sent in wire groups of at most this many objects and stored
+// bytes, groups are generated one at a time when streaming a response, and
+// packfile data is read and sent in pieces of at most TRANSMIT_READSIZE
+#define TRANSMIT_GROUPOBJS 1024
+#define TRANSMIT_GROUPBYTES (4 * 1024 * 1024)
+#define TRANSMIT_READSIZE (1024 * 1024)
+// Bytes per chunk of a streamed HTTP reply, a chunk is only read from the
+// stream once the previous one has been written to the socket
+#define HTTP_CHUNKSIZE (256 * 1024)
+
+// Minimum index log entries per thread when verifying checksums in parallel
+#define INDEX_VERIFY_MINENTRIES (16 * 1024)
+
+// Object filter bits and probes per object (about 1% false positives)
+#define OBJFILTER_BITSPEROBJ 10
+#define OBJFILTER_PROBES 7
+// The index's object filter is rebuilt with room for this factor more objects
+#define OBJFILTER_GROWTH 2
+
+// Parsed objects cached per repository (see Repo::getTreeRef)
+#define REPO_TREECACHE_SIZE 8192
+#define REPO_COMMITCACHE_SIZE 1024
+#define REPO_LBLOBCACHE_SIZE 512
+// Resolved (tree, path) pairs cached per repository (see Repo::lookupPath)
+#define REPO_PATHCACHE_SIZE (64 * 1024)
 
 // These are soft maximums ("heuristics")
 // 64 MB
 #define PACKFILE_MAXSIZE (1024*1024*64)
 #define PACKFILE_MAXOBJS (2048)
 
+// Pack handle cache budgets (open descriptors and mapped bytes)
+#define PFMGR_MAXFDS 256
+#if defined(__LP64__) || defined(_LP64)
+#define PFMGR_MAXMAPPED (16ULL * 1024 * 1024 * 1024)
+#else
+#define PFMGR_MAXMAPPED (512 * 1024 * 1024)
+#endif
+
+// Garbage collection: packs with at least this fraction of dead bytes are
+// compacted, live bytes relocated per step (one packfile sync and index batch)
+// and the index is only compacted once its log exceeds this fraction of the
+// base
+#define GC_MINDEADFRAC 0.25
+#define GC_STEPSIZE (4 * 1024 * 1024)
+#define GC_INDEX_MAXDELTAFRAC 0.125
+
+// The metadata log is merged into a new snapshot on sync once it exceeds both
+// the minimum size and this fraction of the snapshot size
+#define MDLOG_CHECKPOINT_MINSIZE (1024 * 1024)
+#define MDLOG_CHECKPOINT_FRAC 0.25
+// Likewise the index log is merged into a new base on sync once it holds more
+// than the minimum number of entries and this fraction of the base
+#define INDEX_CHECKPOINT_MINENTRIES (64 * 1024)
+#define INDEX_CHECKPOINT_FRAC 0.25
+
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
 //#define ORI_USE_SKEIN
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Concurrent writer stress test.  Each thread adds its own objects to one
+ * repository and reads back objects it added while the other threads keep
+ * writing and a sync thread keeps committing.  All threads also add the same
+ * shared objects, which must be stored once.  Afterwards the repository is
+ * reopened and every object is verified against the packfiles.  The
+ * repository is created in a new directory under DIRECTORY and left there.
+ *
+ * Usage: writer_stress [THREADS] [OBJECTS] [DIRECTORY]
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/thread.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OBJECTS 2000
+#define SYNC_INTERVAL_US 20000
+#define SHARED_OBJECTS 64
+#define SHARED_WRITER 0xFFFFFFFF
+
+/*
+ * Payloads are a deterministic function of the writer and object number so
+ * that any thread can check them.  Every other payload is compressible.
+ */
+static string
+makePayload(uint32_t writer, uint32_t i)
+{
+    uint64_t seed = ((uint64_t)writer << 32) | i;
+    size_t len = 64 + (seed * 2654435761ULL) % (32 * 1024);
+    string payload(len, '\0');
+
+    for (size_t j = 0; j < len; j++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        payload[j] = (i % 2 == 0) ? 'a' + (j / 64) % 26 : (char)(seed >> 56);
+    }
+    snprintf(&payload[0], len, "%u/%u", writer, i);
+
+    return payload;
+}
+
+class WriterThread : public Thread
+{
+public:
+    WriterThread(LocalRepo *repo, uint32_t writer, uint32_t objects)
+        : Thread("writer"), errors(0), repo(repo), writer(writer),
+          objects(objects), seed(writer) { }
+    virtual void run()
+    {
+        vector<ObjectHash> added;
+
+        for (uint32_t i = 0; i < objects; i++) {
+            string payload = makePayload(writer, i);
+            ObjectHash hash = OriCrypt_HashString(payload);
+
+            repo->addObject(ObjectInfo::Blob, hash, payload);
+            added.push_back(hash);
+
+            uint32_t j = (i + writer) % SHARED_OBJECTS;
+            string shared = makePayload(SHARED_WRITER, j);
+            repo->addObject(ObjectInfo::Blob, OriCrypt_HashString(shared),
+                            shared);
+
+            // Objects must be readable whether staged or committed
+            uint32_t check = rand_r(&seed) % added.size();
+            Object::sp o = repo->getObject(added[check]);
+            if (!o || o->getPayload() != makePayload(writer, check)) {
+                printf("writer %u: object %u unreadable\n", writer, check);
+                errors++;
+            }
+        }
+    }
+    uint32_t errors;
+private:
+    LocalRepo *repo;
+    uint32_t writer;
+    uint32_t objects;
+    unsigned int seed;
+};
+
+class SyncThread : public Thread
+{
+public:
+    SyncThread(LocalRepo *repo) : Thread("sync"), syncs(0), repo(repo) { }
+    virtual void run()
+    {
+        while (!interruptionRequested()) {
+            repo->sync();
+            syncs++;
+            usleep(SYNC_INTERVAL_US);
+        }
+    }
+    uint32_t syncs;
+private:
+    LocalRepo *repo;
+};
+
+int
+main(int argc, char *argv[])
+{
+    uint32_t threads = DEFAULT_THREADS;
+    uint32_t objects = DEFAULT_OBJECTS;
+    string dir = "/tmp";
+    vector<WriterThread *> writers;
+    uint32_t errors = 0;
+    Stopwatch sw;
+
+    if (argc > 1)
+        threads = strtoul(argv[1], nullptr, 10);
+    if (argc > 2)
+        objects = strtoul(argv[2], nullptr, 10);
+    if (argc > 3)
+        dir = argv[3];
+    if (threads == 0 || objects == 0) {
+        printf("writer_stress requires positive thread and object counts!\n");
+        return 1;
+    }
+
+    string path = dir + "/writer_stress.XXXXXX";
+    if (mkdtemp(&path[0]) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (LocalRepo_Init(path, true) != 0) {
+        printf("Could not create the repository!\n");
+        return 1;
+    }
+
+    {
+        LocalRepo repo;
+        repo.open(path);
+        SyncThread syncer(&repo);
+
+        sw.start();
+        syncer.start();
+        for (uint32_t t = 0; t < threads; t++) {
+            writers.push_back(new WriterThread(&repo, t, objects));
+            writers.back()->start();
+        }
+        for (uint32_t t = 0; t < threads; t++) {
+            writers[t]->wait();
+            errors += writers[t]->errors;
+            delete writers[t];
+        }
+        syncer.interrupt();
+        syncer.wait();
+        repo.sync();
+        sw.stop();
+
+        printf("%u writers, %u objects each: %" PRIu64 " ms, %u syncs\n",
+               threads, objects, sw.getElapsedMS(), syncer.syncs);
+        repo.close();
+    }
+
+    {
+        LocalRepo repo;
+        repo.open(path);
+
+        for (uint32_t t = 0; t < threads; t++) {
+            for (uint32_t i = 0; i < objects; i++) {
+                string payload = makePayload(t, i);
+                Object::sp o = repo.getObject(OriCrypt_HashString(payload));
+                if (!o || o->getPayload() != payload) {
+                    printf("object %u/%u lost after reopen\n", t, i);
+                    errors++;
+                }
+            }
+        }
+        set<uint32_t> shared;
+        for (uint32_t t = 0; t < threads; t++) {
+            for (uint32_t i = 0; i < objects && i < SHARED_OBJECTS; i++)
+                shared.insert((i + t) % SHARED_OBJECTS);
+        }
+        if (repo.listObjects().size() !=
+                (size_t)threads * objects + shared.size()) {
+            printf("index holds %zu objects\n", repo.listObjects().size());
+            errors++;
+        }
+
+        // A shared object stored twice leaves a dead copy behind
+        map<packid_t, PackfileManager::PackStats> stats = repo.getPackStats();
+        for (auto &it : stats) {
+            if (it.second.dead != 0) {
+                printf("packfile %u holds %" PRIu64 " dead bytes\n",
+                       it.first, it.second.dead);
+                errors++;
+            }
+        }
+        repo.close();
+    }
+
+    if (errors != 0) {
+        printf("FAILED: %u errors in %s\n", errors, path.c_str());
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
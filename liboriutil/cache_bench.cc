@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cache contention benchmark.  Compares LRUCache with ShardedCache for a read
+ * mostly workload on 1 to 64 threads.
+ *
+ * Usage: cache_bench [OPERATIONS PER THREAD]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/lrucache.h>
+#include <oriutil/shardedcache.h>
+
+using namespace std;
+
+#define CACHE_SIZE 4096
+// Keys are drawn from a range slightly larger than the cache
+#define KEY_RANGE (CACHE_SIZE + CACHE_SIZE / 8)
+#define DEFAULT_OPS (1000 * 1000)
+
+typedef LRUCache<uint64_t, uint64_t, CACHE_SIZE> BenchLRU;
+typedef ShardedCache<uint64_t, uint64_t, CACHE_SIZE> BenchSharded;
+
+template <class Cache>
+class BenchThread : public Thread
+{
+public:
+    BenchThread(Cache *cache, uint64_t ops, unsigned int seed)
+        : cache(cache), ops(ops), seed(seed), hits(0)
+    {
+    }
+    virtual void run() override
+    {
+        for (uint64_t i = 0; i < ops; i++) {
+            uint64_t key = rand_r(&seed) % KEY_RANGE;
+            uint64_t val;
+
+            if (cache->get(key, val)) {
+                hits++;
+            } else {
+                cache->put(key, key);
+            }
+        }
+    }
+    Cache *cache;
+    uint64_t ops;
+    unsigned int seed;
+    uint64_t hits;
+};
+
+template <class Cache>
+static void
+runBench(const char *name, int nthreads, uint64_t ops)
+{
+    Cache *cache = new Cache();
+    vector<BenchThread<Cache> *> threads;
+    Stopwatch sw;
+    uint64_t hits = 0;
+
+    for (uint64_t i = 0; i < CACHE_SIZE; i++)
+        cache->put(i, i);
+
+    for (int i = 0; i < nthreads; i++)
+        threads.push_back(new BenchThread<Cache>(cache, ops, i + 1));
+
+    sw.start();
+    for (int i = 0; i < nthreads; i++)
+        threads[i]->start();
+    for (int i = 0; i < nthreads; i++)
+        threads[i]->wait();
+    sw.stop();
+
+    for (int i = 0; i < nthreads; i++) {
+        hits += threads[i]->hits;
+        delete threads[i];
+    }
+    delete cache;
+
+    uint64_t ms = sw.getElapsedMS();
+    uint64_t total = ops * nthreads;
+    printf("%-8s %2d threads: %6" PRIu64 " ms, %8.2f Mops/s, %5.1f%% hits\n",
+           name, nthreads, ms,
+           ms ? (double)total / ms / 1000.0 : 0.0,
+           100.0 * hits / total);
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint64_t ops = DEFAULT_OPS;
+
+    if (argc > 1)
+        ops = strtoull(argv[1], nullptr, 10);
+
+    for (int n = 1; n <= 64; n *= 2) {
+        runBench<BenchLRU>("LRU", n, ops);
+        runBench<BenchSharded>("Sharded", n, ops);
+    }
+
+    return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "tuneables.h"
+
+#include "fastlz.h"
+#include "snappy.h"
+#ifdef ORI_HAVE_ZSTD
+#include <zstd.h>
+#endif /* ORI_HAVE_ZSTD */
+
+#include <oriutil/debug.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/stream.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/codec.h>
+
+using namespace std;
+
+/*
+ * Stores objects as is
+ */
+class NoneCodec : public Codec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_NONE; }
+    const char *getName() const { return "none"; }
+    bool compress(const uint8_t *in, size_t len, string &out) const
+    {
+        out.assign((const char *)in, len);
+        return true;
+    }
+    bool decompress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const
+    {
+        if (len != outLen)
+            return false;
+        memcpy(out, in, len);
+        return true;
+    }
+};
+
+/*
+ * FastLZ, payloads up to a block are a single FastLZ block as written by
+ * older versions, larger ones use the block framed zipstream format.
+ */
+class FastLZCodec : public Codec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_FASTLZ; }
+    const char *getName() const { return "fastlz"; }
+    bool compress(const uint8_t *in, size_t len, string &out) const
+    {
+        if (len > ZIPSTREAM_BLOCKSIZE) {
+            zipstream zs(new mmapstream(shared_ptr<const void>(), in, len),
+                         COMPRESS);
+            out = zs.readAll();
+            return zs.error() == nullptr;
+        }
+
+        // FastLZ needs 5% of slack and at least 66 bytes
+        out.resize(len + len / 16 + 66);
+        int outLen = fastlz_compress(in, (int)len, &out[0]);
+        if (outLen <= 0)
+            return false;
+        out.resize(outLen);
+        return true;
+    }
+    bool decompress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const
+    {
+        zipstream zs(new mmapstream(shared_ptr<const void>(), in, len),
+                     DECOMPRESS, outLen);
+        size_t total = 0;
+
+        while (total < outLen) {
+            size_t n = zs.read(out + total, outLen - total);
+            if (n == 0)
+                break;
+            total += n;
+        }
+
+        uint8_t extra;
+        return total == outLen && zs.read(&extra, 1) == 0 &&
+            zs.error() == nullptr;
+    }
+};
+
+class SnappyCodec : public Codec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_SNAPPY; }
+    const char *getName() const { return "snappy"; }
+    bool compress(const uint8_t *in, size_t len, string &out) const
+    {
+        snappy::Compress((const char *)in, len, &out);
+        return true;
+    }
+    bool decompress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const
+    {
+        size_t actual;
+        if (!snappy::GetUncompressedLength((const char *)in, len, &actual) ||
+            actual != outLen)
+            return false;
+        return snappy::RawUncompress((const char *)in, len, (char *)out);
+    }
+};
+
+#ifdef ORI_HAVE_ZSTD
+class ZstdCodec : public Codec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_ZSTD; }
+    const char *getName() const { return "zstd"; }
+    bool compress(const uint8_t *in, size_t len, string &out) const
+    {
+        out.resize(ZSTD_compressBound(len));
+        size_t outLen = ZSTD_compress(&out[0], out.size(), in, len,
+                                      ZSTD_CODEC_LEVEL);
+        if (ZSTD_isError(outLen))
+            return false;
+        out.resize(outLen);
+        return true;
+    }
+    bool decompress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const
+    {
+        size_t actual = ZSTD_decompress(out, outLen, in, len);
+        return !ZSTD_isError(actual) && actual == outLen;
+    }
+};
+#endif /* ORI_HAVE_ZSTD */
+
+static const NoneCodec noneCodec;
+static const FastLZCodec fastlzCodec;
+static const SnappyCodec snappyCodec;
+#ifdef ORI_HAVE_ZSTD
+static const ZstdCodec zstdCodec;
+#endif /* ORI_HAVE_ZSTD */
+
+static const Codec *codecs[] = {
+    &noneCodec,
+    &fastlzCodec,
+    &snappyCodec,
+#ifdef ORI_HAVE_ZSTD
+    &zstdCodec,
+#endif /* ORI_HAVE_ZSTD */
+};
+
+#define NUM_CODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const Codec *
+Codec_Get(ObjectInfo::ZipAlgo algo)
+{
+    for (size_t i = 0; i < NUM_CODECS; i++) {
+        if (codecs[i]->getAlgo() == algo)
+            return codecs[i];
+    }
+
+    return nullptr;
+}
+
+const Codec *
+Codec_Lookup(const string &name)
+{
+    for (size_t i = 0; i < NUM_CODECS; i++) {
+        if (name == codecs[i]->getName())
+            return codecs[i];
+    }
+
+    return nullptr;
+}
+
+const Codec *
+Codec_Default()
+{
+#if defined(ORI_USE_ZSTD) && defined(ORI_HAVE_ZSTD)
+    return &zstdCodec;
+#elif defined(ORI_USE_SNAPPY)
+    return &snappyCodec;
+#elif defined(ORI_USE_FASTLZ)
+    return &fastlzCodec;
+#else
+    return &noneCodec;
+#endif
+}
+
+vector<const Codec *>
+Codec_List()
+{
+    return vector<const Codec *>(codecs, codecs + NUM_CODECS);
+}
+
+/*
+ * Fills four histograms in turn, so runs of the same byte do not wait on
+ * the previous increment of the same counter.
+ */
+static void
+entropyHistogram(uint32_t (*hist)[256], const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, sizeof(w));
+        hist[0][w & 0xff]++;
+        hist[1][(w >> 8) & 0xff]++;
+        hist[2][(w >> 16) & 0xff]++;
+        hist[3][w >> 24]++;
+    }
+    for (; i < len; i++)
+        hist[0][p[i]]++;
+}
+
+/*
+ * Returns n * log2(n) from a table covering every count of a sample.
+ */
+static inline float
+entropyTerm(uint32_t n)
+{
+    static struct Table {
+        float v[ENTROPY_SAMPLE_BYTES + 1];
+        Table() {
+            v[0] = 0.0f;
+            for (int i = 1; i <= ENTROPY_SAMPLE_BYTES; i++)
+                v[i] = i * log2f((float)i);
+        }
+    } table;
+
+    return table.v[n];
+}
+
+float
+Codec_EstimateEntropy(const uint8_t *buf, size_t len)
+{
+    uint32_t hist[4][256];
+    size_t n;
+
+    if (len == 0)
+        return 0.0f;
+
+    memset(hist, 0, sizeof(hist));
+    if (len <= ENTROPY_SAMPLE_BYTES) {
+        entropyHistogram(hist, buf, len);
+        n = len;
+    } else {
+        size_t block = ENTROPY_SAMPLE_BYTES / ENTROPY_SAMPLE_BLOCKS;
+        size_t stride = len / ENTROPY_SAMPLE_BLOCKS;
+        for (int i = 0; i < ENTROPY_SAMPLE_BLOCKS; i++)
+            entropyHistogram(hist, buf + i * stride, block);
+        n = block * ENTROPY_SAMPLE_BLOCKS;
+    }
+
+    // H = log2(n) - sum(c * log2(c)) / n
+    float sum = 0.0f;
+    for (int i = 0; i < 256; i++)
+        sum += entropyTerm(hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i]);
+
+    return log2f((float)n) - sum / n;
+}
+
+string
+Codec_Decompress(const ObjectInfo &info, const uint8_t *stored, size_t len)
+{
+    const Codec *codec = Codec_Get(info.getAlgo());
+    if (codec == nullptr) {
+        WARNING("Object %s uses an unsupported codec (flags %08x)",
+                info.hash.hex().c_str(), info.flags);
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Object compressed with an unsupported codec");
+    }
+
+    string payload(info.payload_size, '\0');
+    if (!codec->decompress(stored, len, (uint8_t *)&payload[0],
+                           payload.size())) {
+        WARNING("Object %s failed to decompress (%s)",
+                info.hash.hex().c_str(), codec->getName());
+        throw RuntimeException(ORIEC_BSCORRUPT, "Object payload corrupt");
+    }
+
+    return payload;
+}
+
+string
+Codec_Decompress(const ObjectInfo &info, const string &stored)
+{
+    if (info.getAlgo() == ObjectInfo::ZIPALGO_NONE)
+        return stored;
+
+    return Codec_Decompress(info, (const uint8_t *)stored.data(),
+                            stored.size());
+}
+
+bytestream *
+Codec_DecompressStream(const ObjectInfo &info, bytestream *stored)
+{
+    if (info.getAlgo() == ObjectInfo::ZIPALGO_NONE)
+        return stored;
+    // Decompressed a block at a time
+    if (info.getAlgo() == ObjectInfo::ZIPALGO_FASTLZ)
+        return new zipstream(stored, DECOMPRESS, info.payload_size);
+
+    string payload;
+    try {
+        // Work directly on mapped input instead of copying it
+        mmapstream *ms = dynamic_cast<mmapstream *>(stored);
+        if (ms != nullptr) {
+            payload = Codec_Decompress(info, ms->data(), ms->remaining());
+        } else {
+            payload = Codec_Decompress(info, stored->readAll());
+        }
+    } catch (...) {
+        delete stored;
+        throw;
+    }
+    delete stored;
+
+    return new strstream(payload);
+}
+
+int
+Codec_selfTest(void)
+{
+    const size_t sizes[] = { 600, ZIPSTREAM_BLOCKSIZE + 1, 300000 };
+    vector<const Codec *> all = Codec_List();
+
+    cout << "Testing Codec ..." << endl;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        string payload;
+        for (size_t i = 0; payload.size() < sizes[s]; i++)
+            payload += "line " + to_string(i % 97) + "\n";
+        payload.resize(sizes[s]);
+
+        for (size_t c = 0; c < all.size(); c++) {
+            string stored;
+            string out(payload.size(), '\0');
+
+            assert(all[c]->compress((const uint8_t *)payload.data(),
+                                    payload.size(), stored));
+            assert(all[c]->decompress((const uint8_t *)stored.data(),
+                                      stored.size(), (uint8_t *)&out[0],
+                                      out.size()));
+            assert(out == payload);
+        }
+
+        // Streaming in both directions and seeking into a block
+        string framed = zipstream(new strstream(payload), COMPRESS).readAll();
+        string back = zipstream(new strstream(framed), DECOMPRESS,
+                                payload.size()).readAll();
+        assert(back == payload);
+
+        zipstream zs(new mmapstream(shared_ptr<const void>(),
+                                    (const uint8_t *)framed.data(),
+                                    framed.size()), DECOMPRESS);
+        size_t off = payload.size() - 100;
+        uint8_t buf[100];
+        assert(zs.seek(off));
+        assert(zs.read(buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, payload.data() + off, sizeof(buf)) == 0);
+    }
+
+    // Reject truncated input
+    string payload(300000, 'x');
+    string framed = zipstream(new strstream(payload), COMPRESS).readAll();
+    string out(payload.size(), '\0');
+    assert(!Codec_Get(ObjectInfo::ZIPALGO_FASTLZ)->decompress(
+                (const uint8_t *)framed.data(), framed.size() / 2,
+                (uint8_t *)&out[0], out.size()));
+
+    return 0;
+}
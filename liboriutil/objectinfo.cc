@@ -33,6 +33,7 @@
 #endif
 
 #include "tuneables.h"
+#include "byteswap.h"
 
 #include <oriutil/debug.h>
 #include <oriutil/stream.h>
@@ -75,16 +76,28 @@ void
 ObjectInfo::fromString(const std::string &info)
 {
     ASSERT(info.size() == SIZE);
-    strstream ss(info);
+    fromBytes((const uint8_t *)info.data());
+}
+
+void
+ObjectInfo::fromBytes(const uint8_t *buf)
+{
+    char type_str[ORI_OBJECT_TYPESIZE+1];
+    uint32_t val;
 
-    std::string type_str(ORI_OBJECT_TYPESIZE+1, '\0');
-    ss.read((uint8_t*)&type_str[0], ORI_OBJECT_TYPESIZE);
-    type = getTypeForStr(type_str.c_str());
+    memcpy(type_str, buf, ORI_OBJECT_TYPESIZE);
+    type_str[ORI_OBJECT_TYPESIZE] = '\0';
+    type = getTypeForStr(type_str);
     ASSERT(type != Null);
+    buf += ORI_OBJECT_TYPESIZE;
 
-    ss.readHash(hash);
-    flags = ss.readUInt32();
-    payload_size = ss.readUInt32();
+    memcpy(hash.hash, buf, ObjectHash::SIZE);
+    buf += ObjectHash::SIZE;
+
+    memcpy(&val, buf, sizeof(uint32_t));
+    flags = be32toh(val);
+    memcpy(&val, buf + sizeof(uint32_t), sizeof(uint32_t));
+    payload_size = be32toh(val);
 }
 
 bool
@@ -113,6 +126,10 @@ ObjectInfo::getAlgo() const {
             return ZIPALGO_FASTLZ;
         case ORI_FLAG_LZMA:
             return ZIPALGO_LZMA;
+        case ORI_FLAG_SNAPPY:
+            return ZIPALGO_SNAPPY;
+        case ORI_FLAG_ZSTD:
+            return ZIPALGO_ZSTD;
         default:
             return ZIPALGO_UNKNOWN;
     }
@@ -121,6 +138,7 @@ ObjectInfo::getAlgo() const {
 void
 ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
 {
+    flags &= ~ORI_FLAG_ZIPMASK;
     switch (algo) {
         case ZIPALGO_NONE:
             flags |= ORI_FLAG_UNCOMPRESSED;
@@ -131,6 +149,12 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
         case ZIPALGO_LZMA:
             flags |= ORI_FLAG_LZMA;
             break;
+        case ZIPALGO_SNAPPY:
+            flags |= ORI_FLAG_SNAPPY;
+            break;
+        case ZIPALGO_ZSTD:
+            flags |= ORI_FLAG_ZSTD;
+            break;
         case ZIPALGO_UNKNOWN:
         default:
             NOT_IMPLEMENTED(false);
@@ -140,6 +140,35 @@ OriCrypt_HashFile(const string &path)
     return hash;
 }
 
+OriCrypt_HashContext::OriCrypt_HashContext()
+{
+    SHA256_CTX *ctx = new SHA256_CTX;
+
+    SHA256_Init(ctx);
+    state = ctx;
+}
+
+OriCrypt_HashContext::~OriCrypt_HashContext()
+{
+    delete (SHA256_CTX *)state;
+}
+
+void
+OriCrypt_HashContext::update(const uint8_t *data, size_t len)
+{
+    SHA256_Update((SHA256_CTX *)state, data, len);
+}
+
+ObjectHash
+OriCrypt_HashContext::final()
+{
+    ObjectHash hash;
+
+    SHA256_Final(hash.hash, (SHA256_CTX *)state);
+
+    return hash;
+}
+
 #endif
 
 
@@ -175,6 +175,17 @@ int Util_SetBlocking(int fd, bool block) {
     return 0;
 }
 
+/*
+ * Number of online processors (at least one)
+ */
+int
+Util_NumCPUs()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n < 1) ? 1 : (int)n;
+}
+
 /*
  * Generate a UUID
  */
@@ -80,8 +80,10 @@ RWKey::sp RWLock::readLock()
 
 RWKey::sp RWLock::tryReadLock()
 {
-    NOT_IMPLEMENTED(false);
     if (pthread_rwlock_tryrdlock(&lockHandle) == 0) {
+#if CHECK_LOCK_ORDER == 1
+        _updateLocked();
+#endif
         return RWKey::sp(new ReaderKey(this));
     }
     return RWKey::sp();
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+
+#include <iostream>
+#include <memory>
+
+#include <oriutil/debug.h>
+#include <oriutil/shardedcache.h>
+
+using namespace std;
+
+int
+ShardedCache_selfTest(void)
+{
+    // A single shard makes eviction order deterministic
+    ShardedCache<string, string, 4, 1> cache;
+
+    cout << "Testing ShardedCache ..." << endl;
+
+    cache.put("A", "1");
+    cache.put("B", "2");
+    cache.put("C", "3");
+    cache.put("D", "4");
+
+    assert(cache.hasKey("A"));
+    assert(cache.hasKey("B"));
+    assert(cache.hasKey("C"));
+    assert(cache.hasKey("D"));
+
+    // Test eviction
+    cache.put("E", "5");
+
+    assert(cache.hasKey("E"));
+    assert(!cache.hasKey("A"));
+
+    // Referenced entries get a second chance
+    assert(cache.get("B") == "2");
+    cache.put("F", "6");
+
+    assert(cache.hasKey("B"));
+    assert(!cache.hasKey("C"));
+
+    // Replacing key's should not evict
+    cache.put("B", "NEW");
+
+    assert(cache.get("B") == "NEW");
+    assert(cache.hasKey("D"));
+    assert(cache.hasKey("E"));
+    assert(cache.hasKey("F"));
+
+    // Invalidated slots are reused
+    cache.invalidate("D");
+    assert(!cache.hasKey("D"));
+    cache.put("G", "7");
+    assert(cache.hasKey("E"));
+    assert(cache.size() == 4);
+
+    // Sharded
+    ShardedCache<int, int, 64, 8> sharded;
+    for (int i = 0; i < 1000; i++) {
+        sharded.put(i, i * 2);
+    }
+    assert(sharded.size() <= 64);
+
+    int v;
+    assert(sharded.get(999, v) && v == 1998);
+
+    sharded.clear();
+    assert(sharded.size() == 0);
+    assert(!sharded.hasKey(999));
+
+    return 0;
+}
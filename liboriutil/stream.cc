@@ -27,9 +27,7 @@
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
 #include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
 
 #include <string>
 
@@ -481,6 +479,33 @@ size_t fdstream::sizeHint() const {
     return 0;
 }
 
+/*
+ * mmapstream
+ */
+
+mmapstream::mmapstream(std::shared_ptr<const void> owner, const uint8_t *buf,
+                       size_t length)
+    : owner(owner), buf(buf), length(length), off(0)
+{
+}
+
+bool mmapstream::ended() {
+    return off >= length;
+}
+
+size_t mmapstream::read(uint8_t *out, size_t n)
+{
+    const size_t to_read = std::min(n, length - off);
+    memcpy(out, buf + off, to_read);
+    off += to_read;
+    return to_read;
+}
+
+size_t mmapstream::sizeHint() const
+{
+    return length;
+}
+
 /*
  * diskstream
  */
@@ -521,10 +546,10 @@ size_t diskstream::sizeHint() const {
 #ifdef ORI_USE_LZMA
 
 /*
- * LZMA zipstream
+ * LZMA stream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
+lzmastream::lzmastream(bytestream *source, bool compress, size_t size_hint)
     : source(source), size_hint(size_hint), output_ended(false)
 {
     assert(source != nullptr);
@@ -544,15 +569,15 @@ zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
     }
 }
 
-zipstream::~zipstream() {
+lzmastream::~lzmastream() {
     delete source;
 }
 
-bool zipstream::ended() {
+bool lzmastream::ended() {
     return output_ended || error();
 }
 
-size_t zipstream::read(uint8_t *buf, size_t n) {
+size_t lzmastream::read(uint8_t *buf, size_t n) {
     if (output_ended) return 0;
 
     lzma_action action = source->ended() ? LZMA_FINISH : LZMA_RUN;
@@ -586,11 +611,11 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
     return strm.total_out - begin_total;
 }
 
-size_t zipstream::sizeHint() const {
+size_t lzmastream::sizeHint() const {
     return size_hint;
 }
 
-size_t zipstream::inputConsumed() const {
+size_t lzmastream::inputConsumed() const {
     return strm.total_in;
 }
 
@@ -623,7 +648,7 @@ const char *lzma_ret_str(lzma_ret ret) {
     }
 }
 
-void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
+void lzmastream::setLzmaErr(const char *msg, lzma_ret ret)
 {
     char buf[512];
     snprintf(buf, 512, "lzmastream %s: %s (%d)\n", msg, lzma_ret_str(ret), ret);
@@ -633,25 +658,38 @@ void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
-
 /*
  * FastLZ zipstream
  */
 
+#define ZIPSTREAM_MAGIC "OZB1"
+#define ZIPSTREAM_RAWBLOCK 0x80000000U
+
 zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
     : source(source),
       size_hint(size_hint),
-
       compress(compress),
-      input_processed(false),
+
+      map(nullptr),
+      mapLength(0),
+      consumed(0),
+
+      started(false),
+      legacy(false),
+      finished(false),
+      blockSize(ZIPSTREAM_BLOCKSIZE),
+      produced(0),
 
       offset(0),
       output_ended(false)
 {
     assert(source != nullptr);
-    if (size_hint > 0) {
-        output.resize(size_hint);
+
+    // Work directly on mapped input instead of copying it
+    mmapstream *ms = dynamic_cast<mmapstream *>(source);
+    if (ms != nullptr) {
+        map = ms->data();
+        mapLength = ms->remaining();
     }
 }
 
@@ -660,47 +698,33 @@ zipstream::~zipstream() {
 }
 
 bool zipstream::ended() {
-    return output_ended; // || error();
+    return output_ended;
 }
 
 size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
-
-    if (!input_processed) {
-        input = source->readAll();
-        if (output.size() == 0) {
-            NOT_IMPLEMENTED(compress);
-            output.resize(input.size() * 1.3);
-        }
+    size_t total = 0;
 
-        int finalSize = 0;
-	if (compress) {
-	    finalSize = fastlz_compress(&input[0], input.size(), &output[0]);
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't compress";
-                return 0;
-            }
-	} else {
-	    finalSize = fastlz_decompress(&input[0], input.size(), &output[0],
-                    output.size());
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't decompress";
-                return 0;
+    while (total < n && !output_ended) {
+        if (offset == output.size()) {
+            output.clear();
+            offset = 0;
+            if (!(compress ? fillCompress() : fillDecompress())) {
+                output_ended = true;
+                break;
             }
-	}
+        }
 
-        output.resize(finalSize);
-	input_processed = true;
+        size_t to_copy = MIN(n - total, output.size() - offset);
+        memcpy(buf + total, &output[offset], to_copy);
+        offset += to_copy;
+        total += to_copy;
     }
 
-    size_t to_copy = MIN(n, output.size() - offset);
-    memcpy(buf, &output[offset], to_copy);
-    offset += to_copy;
-
-    if (offset == output.size())
-	output_ended = true;
+    // Report the end as soon as the last block is drained
+    if (offset == output.size() && finished)
+        output_ended = true;
 
-    return to_copy;
+    return total;
 }
 
 size_t zipstream::sizeHint() const {
@@ -708,10 +732,294 @@ size_t zipstream::sizeHint() const {
 }
 
 size_t zipstream::inputConsumed() const {
-    return (size_t)((offset / (float)output.size()) * input.size());
+    return consumed;
+}
+
+bool zipstream::seek(size_t off) {
+    if (compress || map == nullptr)
+        return false;
+
+    if (!started) {
+        output.clear();
+        offset = 0;
+        if (!fillDecompress() && !legacy)
+            return false;
+    }
+
+    if (legacy) {
+        if (off > output.size())
+            return false;
+        offset = off;
+        output_ended = (offset == output.size());
+        return true;
+    }
+
+    // Locate the block through the trailing offsets
+    if (mapLength < 12)
+        return false;
+    uint32_t count;
+    memcpy(&count, map + mapLength - 4, 4);
+    count = be32toh(count);
+    if ((uint64_t)count * 4 + 4 > mapLength)
+        return false;
+    const uint8_t *index = map + mapLength - 4 - (size_t)count * 4;
+
+    size_t block = off / blockSize;
+    if (block >= count)
+        return false;
+    uint32_t blockOff;
+    memcpy(&blockOff, index + block * 4, 4);
+    blockOff = be32toh(blockOff);
+    if (blockOff >= (size_t)(index - map))
+        return false;
+
+    consumed = blockOff;
+    finished = false;
+    output.clear();
+    offset = 0;
+    if (!fillDecompress() || off % blockSize > output.size())
+        return false;
+
+    offset = off % blockSize;
+    output_ended = false;
+    return true;
+}
+
+/*
+ * Returns the next n input bytes, valid until the next call
+ */
+const uint8_t *zipstream::fetch(size_t n) {
+    if (map != nullptr) {
+        if (mapLength - consumed < n)
+            return nullptr;
+        consumed += n;
+        return map + consumed - n;
+    }
+
+    input.resize(n);
+    try {
+        if (n > 0 && !source->readExact(&input[0], n))
+            return nullptr;
+    } catch (std::ios_base::failure &e) {
+        return nullptr;
+    }
+    consumed += n;
+    return input.data();
 }
 
-#endif /* ORI_USE_FASTLZ */
+bool zipstream::fetchUInt32(uint32_t &val) {
+    const uint8_t *p = fetch(sizeof(val));
+    if (p == nullptr)
+        return false;
+    memcpy(&val, p, sizeof(val));
+    val = be32toh(val);
+    return true;
+}
+
+void zipstream::putUInt32(uint32_t val) {
+    uint32_t be = htobe32(val);
+    output.insert(output.end(), (uint8_t *)&be, (uint8_t *)&be + sizeof(be));
+}
+
+void zipstream::fail(const char *msg) {
+    last_error = msg;
+    finished = true;
+    output.clear();
+    offset = 0;
+}
+
+/*
+ * Produces the header, the next compressed block or the trailer
+ */
+bool zipstream::fillCompress() {
+    if (finished)
+        return false;
+
+    if (!started) {
+        started = true;
+        output.insert(output.end(), ZIPSTREAM_MAGIC, ZIPSTREAM_MAGIC + 4);
+        putUInt32(blockSize);
+        produced += output.size();
+        return true;
+    }
+
+    const uint8_t *in;
+    size_t avail = 0;
+    if (map != nullptr) {
+        avail = MIN((size_t)blockSize, mapLength - consumed);
+        in = map + consumed;
+    } else {
+        input.resize(blockSize);
+        while (avail < blockSize) {
+            size_t n = source->read(&input[avail], blockSize - avail);
+            if (source->error()) {
+                fail(source->error());
+                return false;
+            }
+            if (n == 0)
+                break;
+            avail += n;
+        }
+        in = input.data();
+    }
+    consumed += avail;
+
+    if (avail == 0) {
+        putUInt32(0);
+        putUInt32(0);
+        for (size_t i = 0; i < blockOffsets.size(); i++)
+            putUInt32(blockOffsets[i]);
+        putUInt32(blockOffsets.size());
+        produced += output.size();
+        finished = true;
+        return true;
+    }
+
+    if (produced > UINT32_MAX) {
+        fail("zipstream output too large");
+        return false;
+    }
+    blockOffsets.push_back(produced);
+
+    putUInt32(avail);
+    size_t hdr = output.size();
+    putUInt32(0);
+
+    // FastLZ needs 16 input bytes, 5% of slack and at least 66 bytes
+    uint32_t stored = 0;
+    output.resize(hdr + 4 + avail + avail / 16 + 66);
+    if (avail >= 16) {
+        int len = fastlz_compress(in, avail, &output[hdr + 4]);
+        if (len > 0 && (size_t)len < avail)
+            stored = len;
+    }
+    if (stored == 0) {
+        memcpy(&output[hdr + 4], in, avail);
+        stored = avail | ZIPSTREAM_RAWBLOCK;
+    }
+    output.resize(hdr + 4 + (stored & ~ZIPSTREAM_RAWBLOCK));
+
+    uint32_t be = htobe32(stored);
+    memcpy(&output[hdr], &be, sizeof(be));
+    produced += output.size();
+
+    return true;
+}
+
+/*
+ * Produces the next decompressed block
+ */
+bool zipstream::fillDecompress() {
+    if (finished)
+        return false;
+
+    if (!started) {
+        uint8_t head[4];
+        size_t got = 0;
+
+        started = true;
+        if (map != nullptr) {
+            got = MIN((size_t)4, mapLength);
+            memcpy(head, map, got);
+            consumed = got;
+        } else {
+            while (got < 4) {
+                size_t n = source->read(head + got, 4 - got);
+                if (n == 0 || source->error())
+                    break;
+                got += n;
+            }
+            consumed = got;
+            input.assign(head, head + got);
+        }
+
+        if (got < 4 || memcmp(head, ZIPSTREAM_MAGIC, 4) != 0)
+            return decodeLegacy();
+
+        uint32_t bs;
+        if (!fetchUInt32(bs) || bs == 0 || bs > ZIPSTREAM_MAXBLOCKSIZE) {
+            fail("zipstream header corrupt");
+            return false;
+        }
+        blockSize = bs;
+    }
+
+    uint32_t rawLen, storedLen;
+    if (!fetchUInt32(rawLen) || !fetchUInt32(storedLen)) {
+        fail("zipstream truncated");
+        return false;
+    }
+    if (rawLen == 0) {
+        finished = true;
+        return false;
+    }
+
+    bool raw = (storedLen & ZIPSTREAM_RAWBLOCK) != 0;
+    storedLen &= ~ZIPSTREAM_RAWBLOCK;
+    if (rawLen > blockSize || (raw && storedLen != rawLen) ||
+        storedLen > rawLen + rawLen / 16 + 66) {
+        fail("zipstream block corrupt");
+        return false;
+    }
+
+    const uint8_t *in = fetch(storedLen);
+    if (in == nullptr) {
+        fail("zipstream truncated");
+        return false;
+    }
+
+    output.resize(rawLen);
+    if (raw) {
+        memcpy(&output[0], in, rawLen);
+    } else if (fastlz_decompress(in, storedLen, &output[0], rawLen) !=
+               (int)rawLen) {
+        fail("FastLZ couldn't decompress");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Objects written before block framing are a single FastLZ block that needs
+ * the whole input and the payload size.
+ */
+bool zipstream::decodeLegacy() {
+    const uint8_t *in;
+    size_t len;
+
+    legacy = true;
+    finished = true;
+
+    if (map != nullptr) {
+        in = map;
+        len = mapLength;
+    } else {
+        uint8_t buf[COPYFILE_BUFSZ];
+        size_t n;
+        while ((n = source->read(buf, sizeof(buf))) > 0)
+            input.insert(input.end(), buf, buf + n);
+        in = input.data();
+        len = input.size();
+    }
+    consumed = len;
+
+    if (size_hint == 0 || len == 0) {
+        last_error = "FastLZ couldn't decompress";
+        return false;
+    }
+
+    output.resize(size_hint);
+    int n = fastlz_decompress(in, len, &output[0], output.size());
+    std::vector<uint8_t>().swap(input);
+    if (n <= 0) {
+        fail("FastLZ couldn't decompress");
+        return false;
+    }
+    output.resize(n);
+
+    return true;
+}
 
 /*
  * bytewstream
@@ -22,8 +22,10 @@ int OriStr_selfTest(void);
 int OriUtil_selfTest(void);
 int OriFile_selfTest(void);
 int LRUCache_selfTest(void);
+int ShardedCache_selfTest(void);
 int KVSerializer_selfTest(void);
 int OriCrypt_selfTest(void);
+int Codec_selfTest(void);
 int Key_selfTest(void);
 
 int
@@ -34,8 +36,10 @@ main(int argc, const char *argv[])
     result += OriUtil_selfTest();
     result += OriFile_selfTest();
     result += LRUCache_selfTest();
+    result += ShardedCache_selfTest();
     result += KVSerializer_selfTest();
     result += OriCrypt_selfTest();
+    result += Codec_selfTest();
     //result += Key_selfTest();
 
     if (result == 0) {
@@ -20,6 +20,9 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 #define HASHFILE_BUFSZ	(256 * 1024)
 #define COMPFILE_BUFSZ  (16 * 1024)
+// FastLZ zipstream blocks, each direction buffers one block
+#define ZIPSTREAM_BLOCKSIZE (64 * 1024)
+#define ZIPSTREAM_MAXBLOCKSIZE (16 * 1024 * 1024)
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -35,5 +38,12 @@
 #error "Please select one compression algorithm."
 #endif
 
+// Bytes sampled by the entropy estimate, taken as evenly spaced blocks
+#define ENTROPY_SAMPLE_BYTES 4096
+#define ENTROPY_SAMPLE_BLOCKS 16
+
+// zstd level for new objects, higher levels trade speed for ratio
+#define ZSTD_CODEC_LEVEL 3
+
 #endif /* __TUNEABLES_H__ */
 
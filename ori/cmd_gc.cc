@@ -15,6 +15,10 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
 
 #include <string>
 #include <iostream>
@@ -25,13 +29,50 @@ using namespace std;
 
 extern LocalRepo repository;
 
+void
+usage_gc(void)
+{
+    cout << "ori gc [OPTIONS]" << endl;
+    cout << endl;
+    cout << "Reclaim the space of purged objects by compacting the" << endl;
+    cout << "packfiles with the most dead bytes." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    -m MB          Stop after relocating MB of live objects" << endl;
+    cout << "    -r MB/s        Limit the I/O rate" << endl;
+}
+
 /*
  * Reclaim unused space.
  */
 int
 cmd_gc(int argc, char * const argv[])
 {
-    repository.gc();
+    uint64_t maxCopy = 0;
+    uint64_t rateLimit = 0;
+    int ch;
+
+    struct option longopts[] = {
+        { "max",        required_argument,  nullptr,   'm' },
+        { "rate",       required_argument,  nullptr,   'r' },
+        { nullptr,      0,                  nullptr,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "m:r:", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'm':
+                maxCopy = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+                break;
+            case 'r':
+                rateLimit = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+                break;
+            default:
+                printf("Usage: ori gc [OPTIONS]\n");
+                return 1;
+        }
+    }
+
+    repository.gc(maxCopy, rateLimit);
 
     return 0;
 }
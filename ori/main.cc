@@ -72,6 +72,7 @@ int cmd_cleanup(int argc, char * const argv[]);
 int cmd_diff(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
+void usage_gc(void);
 int cmd_gc(int argc, char * const argv[]);
 void usage_graft(void);
 int cmd_graft(int argc, char * const argv[]);
@@ -168,7 +169,7 @@ static Cmd commands[] = {
         "gc",
         "Reclaim unused space (NS)",
         cmd_gc,
-        nullptr,
+        usage_gc,
         CMD_DEBUG,
     },
     {
@@ -131,12 +131,18 @@ SshServer::serve() {
         else if (command == "readobjs") {
             cmd_readObjs();
         }
+        else if (command == "getmissing") {
+            cmd_getMissing();
+        }
         else if (command == "getobjinfo") {
             cmd_getObjInfo();
         }
         else if (command == "get head") {
             cmd_getHead();
         }
+        else if (command == "get objfilter") {
+            cmd_getObjFilter();
+        }
         else if (command == "get fsid") {
             cmd_getFSID();
         }
@@ -210,6 +216,37 @@ SshServer::cmd_readObjs()
     repo->transmit(&fs, objs);
 }
 
+/*
+ * The request is acknowledged before it is read so that a client can tell
+ * a server without getmissing apart from a failed request.
+ */
+void
+SshServer::cmd_getMissing()
+{
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+
+    fdstream in(STDIN_FILENO, -1);
+    std::vector<ObjectHash> wants, haves;
+    uint32_t numWants = in.readUInt32();
+    for (uint32_t i = 0; i < numWants; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        wants.push_back(hash);
+    }
+    uint32_t numHaves = in.readUInt32();
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+    DLOG("getMissing: %u wants %u haves", numWants, numHaves);
+
+    std::vector<ObjectHash> objs = repo->listMissingObjects(wants, haves);
+    fs.writeUInt8(OK);
+    repo->transmit(&fs, objs);
+}
+
 void
 SshServer::cmd_getObjInfo()
 {
@@ -228,6 +265,23 @@ SshServer::cmd_getObjInfo()
     fs.writeInfo(info);
 }
 
+void
+SshServer::cmd_getObjFilter()
+{
+    DLOG("getObjFilter");
+    ObjectFilter::sp filter = repo->getObjectFilter();
+    if (!filter) {
+        printError("No object filter");
+        return;
+    }
+
+    std::string blob = filter->getBlob();
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+    fs.writeUInt64(blob.size());
+    fs.write(blob.data(), blob.size());
+}
+
 void
 SshServer::cmd_getHead()
 {
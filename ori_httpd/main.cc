@@ -20,6 +20,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -124,6 +125,9 @@ main(int argc, char *argv[])
     ori_open_log(repository.getLogPath());
     LOG("libevent %s", event_get_version());
 
+    // Clients may drop the connection in the middle of a streamed reply
+    signal(SIGPIPE, SIG_IGN);
+
     HTTPServer server = HTTPServer(repository, port);
     server.start(mDNS_flag);
 
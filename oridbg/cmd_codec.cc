@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <oriutil/codec.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+/*
+ * Show or select the codec used to compress new objects.
+ */
+int
+cmd_codec(int argc, char * const argv[])
+{
+    if (argc == 1) {
+        vector<const Codec *> codecs = Codec_List();
+
+        for (size_t i = 0; i < codecs.size(); i++) {
+            cout << (codecs[i] == repository.getCodec() ? "* " : "  ")
+                 << codecs[i]->getName() << endl;
+        }
+        return 0;
+    }
+
+    if (argc != 2) {
+        cout << "Usage: oridbg codec [CODEC]" << endl;
+        return 1;
+    }
+
+    const Codec *codec = Codec_Lookup(argv[1]);
+    if (codec == nullptr) {
+        cout << "Codec '" << argv[1] << "' is not supported" << endl;
+        return 1;
+    }
+
+    repository.setCodec(codec);
+
+    return 0;
+}
+
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#include <oriutil/codec.h>
+#include <oriutil/stopwatch.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+static double
+mbPerSec(uint64_t bytes, uint64_t usecs)
+{
+    if (usecs == 0)
+        usecs = 1;
+    return (double)bytes / (double)usecs;
+}
+
+/*
+ * Compress and decompress the repository objects with every codec and print
+ * the compression ratio and throughput.
+ */
+int
+cmd_codecbench(int argc, char * const argv[])
+{
+    uint64_t limit = 256;
+    vector<string> payloads;
+    uint64_t total = 0;
+
+    if (argc > 2) {
+        cout << "Usage: oridbg codecbench [MB]" << endl;
+        return 1;
+    }
+    if (argc == 2)
+        limit = strtoull(argv[1], NULL, 10);
+    limit *= 1024 * 1024;
+
+    set<ObjectInfo> objs = repository.listObjects();
+    for (auto &it : objs) {
+        if (it.type == ObjectInfo::Purged)
+            continue;
+        if (total >= limit)
+            break;
+
+        Object::sp o = repository.getObject(it.hash);
+        payloads.push_back(o->getPayload());
+        total += payloads.back().size();
+    }
+
+    cout << "Objects " << payloads.size() << ", " << total << " bytes" << endl;
+    if (total == 0)
+        return 0;
+
+    cout << left << setw(10) << "Codec"
+         << right << setw(10) << "Ratio"
+         << setw(14) << "Comp MB/s"
+         << setw(14) << "Decomp MB/s" << endl;
+
+    vector<const Codec *> codecs = Codec_List();
+    for (size_t c = 0; c < codecs.size(); c++) {
+        const Codec *codec = codecs[c];
+        vector<string> stored(payloads.size());
+        uint64_t storedBytes = 0;
+        Stopwatch sw;
+
+        sw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            if (!codec->compress((const uint8_t *)payloads[i].data(),
+                                 payloads[i].size(), stored[i])) {
+                cout << codec->getName() << " failed to compress" << endl;
+                return 1;
+            }
+        }
+        sw.stop();
+        uint64_t compTime = sw.getElapsedTime();
+
+        for (size_t i = 0; i < stored.size(); i++)
+            storedBytes += stored[i].size();
+
+        string out;
+        sw.reset();
+        sw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            out.resize(payloads[i].size());
+            if (!codec->decompress((const uint8_t *)stored[i].data(),
+                                   stored[i].size(), (uint8_t *)&out[0],
+                                   out.size()) ||
+                out != payloads[i]) {
+                cout << codec->getName() << " failed to decompress" << endl;
+                return 1;
+            }
+        }
+        sw.stop();
+        uint64_t decompTime = sw.getElapsedTime();
+
+        cout << left << setw(10) << codec->getName()
+             << right << fixed << setprecision(3)
+             << setw(10) << (double)storedBytes / total
+             << setprecision(1)
+             << setw(14) << mbPerSec(total, compTime)
+             << setw(14) << mbPerSec(total, decompTime) << endl;
+    }
+
+    return 0;
+}
+
@@ -70,10 +70,9 @@ cmd_dumpobj(int argc, char * const argv[])
             lb.fromBlob(rawBlob);
 
             printf("\nChunk Table (%lu chunks):\n", lb.parts.size());
-            std::map<uint64_t, LBlobEntry>::iterator it;
             for (auto &it : lb.parts) {
-                printf("%016" PRIx64 "    %s %d\n", it.first,
-                       it.second.hash.hex().c_str(), it.second.length);
+                printf("%016" PRIx64 "    %s %d\n", it.offset,
+                       it.hash.hex().c_str(), it.length);
             }
 
             break;
@@ -15,6 +15,7 @@
  */
 
 #include <stdint.h>
+#include <sys/param.h>
 
 #include <string>
 #include <iostream>
@@ -28,6 +29,89 @@ using namespace std;
 
 extern LocalRepo repository;
 
+/// Buckets of the packfile fragmentation histogram
+#define STATS_FRAGBUCKETS 10
+
+/*
+ * Print the live and dead bytes of the packfiles and a histogram of packfiles
+ * by their fraction of dead bytes.
+ */
+static void
+printPackStats()
+{
+    map<packid_t, PackfileManager::PackStats> stats;
+    uint64_t live = 0;
+    uint64_t dead = 0;
+    uint64_t packs[STATS_FRAGBUCKETS] = { 0 };
+    uint64_t bytes[STATS_FRAGBUCKETS] = { 0 };
+
+    stats = repository.getPackStats();
+    for (auto &it : stats) {
+        const PackfileManager::PackStats &st = it.second;
+        uint64_t total = st.live + st.dead;
+        int bucket = STATS_FRAGBUCKETS - 1;
+
+        if (total != 0)
+            bucket = MIN(st.dead * STATS_FRAGBUCKETS / total,
+                         (uint64_t)STATS_FRAGBUCKETS - 1);
+        packs[bucket]++;
+        bytes[bucket] += total;
+        live += st.live;
+        dead += st.dead;
+    }
+
+    cout << left << setw(40) << "Packfiles" << stats.size() << endl;
+    cout << left << setw(40) << "  Live Bytes" << live << endl;
+    cout << left << setw(40) << "  Dead Bytes" << dead << endl;
+    cout << left << setw(40) << "  Fragmentation"
+         << fixed << setprecision(2)
+         << ((live + dead) ? 100.0 * dead / (live + dead) : 0.0) << "%"
+         << endl;
+    cout << "  Dead Fraction    Packfiles    Bytes" << endl;
+    for (int i = 0; i < STATS_FRAGBUCKETS; i++) {
+        int lo = i * 100 / STATS_FRAGBUCKETS;
+        int hi = (i + 1) * 100 / STATS_FRAGBUCKETS;
+        cout << "  " << right << setw(3) << lo << "-" << left << setw(3) << hi
+             << "%        " << setw(13) << packs[i] << bytes[i] << endl;
+    }
+}
+
+/*
+ * Print the pack handle cache counters.  They cover this process only, in the
+ * interactive shell they add up across commands.
+ */
+static void
+printPackCacheStats()
+{
+    PackfileManager::Stats st = repository.getPackCacheStats();
+
+    cout << "Pack Handle Cache" << endl;
+    cout << left << setw(40) << "  Hits" << st.hits << endl;
+    cout << left << setw(40) << "  Misses" << st.misses << endl;
+    cout << left << setw(40) << "  Evictions" << st.evictions << endl;
+    cout << left << setw(40) << "  Open Handles" << st.openHandles << endl;
+    cout << left << setw(40) << "  Mapped Bytes" << st.mappedBytes << endl;
+}
+
+/*
+ * Print the decoded object and path cache counters (see Repo::getTreeRef and
+ * Repo::lookupPath), which also cover this process only.
+ */
+static void
+printObjectCacheStats()
+{
+    Repo::ObjectCacheStats st = repository.getObjectCacheStats();
+
+    cout << "Object Cache" << endl;
+    cout << left << setw(40) << "  Hits" << st.hits << endl;
+    cout << left << setw(40) << "  Misses" << st.misses << endl;
+    cout << left << setw(40) << "  Entries" << st.entries << endl;
+    cout << "Path Cache" << endl;
+    cout << left << setw(40) << "  Hits" << st.pathHits << endl;
+    cout << left << setw(40) << "  Misses" << st.pathMisses << endl;
+    cout << left << setw(40) << "  Entries" << st.pathEntries << endl;
+}
+
 /*
  * Print repository statistics.
  */
@@ -95,6 +179,9 @@ cmd_stats(int argc, char * const argv[])
          << 100.0 * (float)blobs/(float)blobRefs << "%" << endl;
     cout << left << setw(40) << "Large Blobs" << largeBlobs << endl;
     cout << left << setw(40) << "Purged Blobs" << purgedBlobs << endl;
+    printPackStats();
+    printPackCacheStats();
+    printObjectCacheStats();
 
     return 0;
 }
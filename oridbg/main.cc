@@ -61,6 +61,7 @@ typedef struct Cmd {
 // General Operations
 int cmd_addkey(int argc, char * const argv[]);
 int cmd_branches(int argc, char * const argv[]);
+int cmd_codec(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
 int cmd_gc(int argc, char * const argv[]);
@@ -78,6 +79,7 @@ int cmd_verify(int argc, char * const argv[]);
 
 // Debug Operations
 int cmd_catobj(int argc, char * const argv[]); // Debug
+int cmd_codecbench(int argc, char * const argv[]); // Debug
 int cmd_dumpindex(int argc, char * const argv[]); // Debug
 int cmd_dumpmeta(int argc, char * const argv[]); // Debug
 int cmd_dumpobj(int argc, char * const argv[]); // Debug
@@ -116,6 +118,13 @@ static Cmd commands[] = {
         nullptr,
         CMD_NEED_REPO,
     },
+    {
+        "codec",
+        "Show or set the codec for new objects",
+        cmd_codec,
+        nullptr,
+        CMD_NEED_REPO,
+    },
     {
         "filelog",
         "Display a log of change to the specified file",
@@ -221,6 +230,13 @@ static Cmd commands[] = {
         nullptr,
         CMD_NEED_REPO,
     },
+    {
+        "codecbench",
+        "Benchmark the codecs on repository objects",
+        cmd_codecbench,
+        nullptr,
+        CMD_NEED_REPO,
+    },
     {
         "dumpindex",
         "Dump the repository index",
@@ -352,7 +352,33 @@ ori_open(const char *path, struct fuse_file_info *fi)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return writing ? -EPERM : 0;
+        string snapshot = path;
+        size_t pos = 0;
+
+        if (writing)
+            return -EPERM;
+
+        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
+        pos = snapshot.find('/', pos);
+        if (pos == snapshot.npos)
+            return -EISDIR;
+
+        std::string filePath = snapshot.substr(pos);
+        snapshot = snapshot.substr(0, pos);
+
+        // XXX: Enforce that this is a valid snapshot & directory path
+        Commit c = priv->lookupSnapshot(snapshot);
+
+        // Memoized path lookup
+        ObjectHash hash = priv->getRepo()->lookup(c, filePath);
+        if (hash.isEmpty())
+            return -ENOENT;
+
+        // Keep the reader with the handle rather than per read
+        RWKey::sp lock = priv->nsLock.writeLock();
+        fi->fh = priv->openSnapshotFile(hash).second;
+
+        return 0;
     }
 
     std::string parentPath = OriFile_Dirname(path);
@@ -394,40 +420,6 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
             return -EIO;
         memcpy(buf, repoPath.data(), len);
         return len;
-    } else if (strncmp(path,
-                       ORI_SNAPSHOT_DIRPATH,
-                       strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        size_t pos = 0;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        ASSERT(pos != snapshot.npos);
-
-        std::string parentPath = snapshot.substr(pos);
-        snapshot = snapshot.substr(0, pos);
-        std::string fileName = OriFile_Basename(parentPath);
-        parentPath = OriFile_Dirname(parentPath);
-        if (parentPath.empty())
-            parentPath = "/";
-
-        // XXX: Enforce that this is a valid snapshot & directory path
-        Commit c = priv->lookupSnapshot(snapshot);
-        Tree t = priv->getTree(c, parentPath);
-
-        // lookup tree
-        const auto it = t.find(fileName);
-        if (it == t.end())
-            return -ENOENT;
-
-        // Read
-        OriFileInfo *tempInfo = new OriFileInfo();
-        tempInfo->type = FILETYPE_COMMITTED;
-        tempInfo->hash = it->second.hash;
-        status = priv->readFile(tempInfo, buf, size, offset);
-        tempInfo->release();
-        return status;
     }
 
     RWKey::sp lock = priv->nsLock.readLock();
@@ -576,10 +568,6 @@ ori_release(const char *path, struct fuse_file_info *fi)
 
     if (strcmp(path, ORI_CONTROL_FILEPATH) == 0) {
         return 0;
-    } else if (strncmp(path,
-                       ORI_SNAPSHOT_DIRPATH,
-                       strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return 0;
     }
 
     RWKey::sp lock = priv->nsLock.writeLock();
@@ -344,6 +344,11 @@ OriPriv::closeFH(uint64_t fh)
         status = close(handles[fh]->fd);
         handles[fh]->fd = -1;
     }
+    if (handles[fh]->openCount == 0) {
+        readerLock.lock();
+        handles[fh]->reader.reset();
+        readerLock.unlock();
+    }
 
     // Manage reference count
     handles[fh]->release();
@@ -509,23 +514,17 @@ OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 
         return real_read;
     } else if (type == ObjectInfo::LargeBlob) {
-        LargeBlob lb = LargeBlob(repo);
-        lb.fromBlob(repo->getPayload(info->hash));
-        // XXX: Cache
+        LargeBlobReader::sp reader;
 
-        ssize_t total = 0;
-        while (total < static_cast<ssize_t>(size)) {
-            const ssize_t res = lb.read((uint8_t*)(buf + total),
-                                 size - total,
-                                 offset + total);
-            if (res == 0)
-                return total;
-            else if (res < 0)
-                return res;
-            total += res;
+        readerLock.lock();
+        if (!info->reader) {
+            info->reader.reset(new LargeBlobReader(repo,
+                        repo->getLargeBlobRef(info->hash), &nsLock));
         }
+        reader = info->reader;
+        readerLock.unlock();
 
-        return total;
+        return reader->read((uint8_t *)buf, size, offset);
     }
 
     return -EIO;
@@ -754,6 +753,26 @@ OriPriv::listSnapshots()
     return repo->listSnapshots();
 }
 
+/*
+ * Opens a file of a snapshot.  The handle owns a private OriFileInfo so that
+ * reads through it keep their LargeBlobReader until the file is closed, as
+ * files of the working tree do.
+ */
+std::pair<OriFileInfo *, uint64_t>
+OriPriv::openSnapshotFile(const ObjectHash &hash)
+{
+    OriFileInfo *info = new OriFileInfo();
+    const uint64_t handle = generateFH();
+
+    info->statInfo.st_mode = S_IFREG;
+    info->type = FILETYPE_COMMITTED;
+    info->hash = hash;
+    info->retainFd();
+    handles[handle] = info;
+
+    return std::make_pair(info, handle);
+}
+
 Commit
 OriPriv::lookupSnapshot(const std::string &name)
 {    
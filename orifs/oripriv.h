@@ -18,6 +18,7 @@
 #define __ORIPRIV_H__
 
 #include <oriutil/orifile.h>
+#include <ori/largeblob.h>
 
 typedef enum OriFileType
 {
@@ -92,6 +93,8 @@ public:
     int refCount;
     int openCount;
     bool dirLoaded;
+    // Reader for committed large files, dropped on the last close
+    LargeBlobReader::sp reader;
 };
 
 class OriDir
@@ -187,6 +190,7 @@ public:
     // Snapshot Operations
     std::map<std::string, ObjectHash> listSnapshots();
     Commit lookupSnapshot(const std::string &name);
+    std::pair<OriFileInfo*, uint64_t> openSnapshotFile(const ObjectHash &hash);
     Tree getTree(const Commit &c, const std::string &path);
     ObjectHash getTip();
 private:
@@ -217,6 +221,8 @@ private:
     std::map<OriPrivId, OriDir*> dirs;
     std::map<std::string, OriFileInfo*> paths;
     std::unordered_map<uint64_t, OriFileInfo*> handles;
+    // Guards OriFileInfo::reader, reads only hold nsLock for reading
+    Mutex readerLock;
 
     // Journal
     OriJournalMode::JournalMode journalMode;
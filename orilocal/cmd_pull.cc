@@ -24,7 +24,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <getopt.h>
+
 #include <string>
+#include <vector>
 #include <iostream>
 
 #include <ori/localrepo.h>
@@ -35,19 +38,51 @@ using namespace std;
 
 extern LocalRepo repository;
 
+void
+usage_pull()
+{
+    cout << "ori pull [OPTIONS] [REPO]" << endl;
+    cout << endl;
+    cout << "Pull changes from a repository (default: origin)." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    --peer REPO    Also fetch objects from REPO (repeatable)"
+         << endl;
+}
+
 int
 cmd_pull(int argc, char * const argv[])
 {
+    int ch;
     string srcRoot;
+    vector<string> peerRoots;
+
+    struct option longopts[] = {
+        { "peer",       required_argument,  nullptr,   'p' },
+        { nullptr,         0,               nullptr,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "p:", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'p':
+                peerRoots.push_back(optarg);
+                break;
+            default:
+                printf("Usage: ori pull [--peer <repo>]... [<repo>]\n");
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
 
-    if (argc > 2) {
+    if (argc > 1) {
         printf("Specify a repository to pull.\n");
-        printf("usage: ori pull <repo>\n");
+        printf("usage: ori pull [--peer <repo>]... [<repo>]\n");
         return 1;
     }
 
-    if (argc == 2) {
-        srcRoot = argv[1];
+    if (argc == 1) {
+        srcRoot = argv[0];
     } else {
         map<string, Peer> peers = repository.getPeers();
         map<string, Peer>::iterator it = peers.find("origin");
@@ -66,8 +101,19 @@ cmd_pull(int argc, char * const argv[])
             return 1;
         }
 
+        // Commits come from srcRoot, objects from any of the repositories
+        vector<RemoteRepo::sp> peerRepos;
+        for (size_t i = 0; i < peerRoots.size(); i++) {
+            RemoteRepo::sp peer(new RemoteRepo());
+            if (!peer->connect(peerRoots[i])) {
+                printf("Error connecting to %s\n", peerRoots[i].c_str());
+                return 1;
+            }
+            peerRepos.push_back(peer);
+        }
+
         printf("Multi-pulling from %s\n", srcRoot.c_str());
-        repository.multiPull(srcRepo);
+        repository.multiPull(srcRepo, peerRepos);
 
         // XXX: Need to rely on sync log.
         repository.updateHead(srcRepo->get()->getHead());
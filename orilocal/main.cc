@@ -67,6 +67,7 @@ int cmd_commit(int argc, char * const argv[]);
 int cmd_diff(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
+void usage_gc(void);
 int cmd_gc(int argc, char * const argv[]);
 void usage_graft(void);
 int cmd_graft(int argc, char * const argv[]);
@@ -79,6 +80,7 @@ int cmd_log(int argc, char * const argv[]);
 int cmd_merge(int argc, char * const argv[]);
 void usage_newfs();
 int cmd_newfs(int argc, char * const argv[]);
+void usage_pull(void);
 int cmd_pull(int argc, char * const argv[]);
 int cmd_remote(int argc, char * const argv[]);
 void usage_removefs();
@@ -162,7 +164,7 @@ static Cmd commands[] = {
         "gc",
         "Reclaim unused space",
         cmd_gc,
-        nullptr,
+        usage_gc,
         CMD_NEED_REPO,
     },
     {
@@ -225,7 +227,7 @@ static Cmd commands[] = {
         "pull",
         "Pull changes from a repository",
         cmd_pull,
-        nullptr,
+        usage_pull,
         CMD_NEED_REPO,
     },
     {
@@ -18,8 +18,10 @@ public:
     void cmd_listObjs();
     void cmd_listCommits();
     void cmd_readObjs();
+    void cmd_getMissing();
     void cmd_getObjInfo();
     void cmd_getHead();
+    void cmd_getObjFilter();
     void cmd_getFSID();
 private:
     UDSClient *udsClient;
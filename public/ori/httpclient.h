@@ -19,6 +19,9 @@
 
 #include <string>
 
+class bytestream;
+class HttpStream;
+
 void HttpClient_requestDoneCB(struct evhttp_request *, void *);
 
 class HttpClient
@@ -37,6 +40,10 @@ public:
     int postRequest(const std::string &url,
                     const std::string &payload,
                     std::string &response);
+    // Returns the response body as it arrives (nullptr on failure), it
+    // should be read to its end before the next request
+    bytestream *postStream(const std::string &url,
+                           const std::string &payload);
     int putRequest(const std::string &command,
                    const std::string &payload,
                    std::string &response);
@@ -48,6 +55,7 @@ private:
     std::string remoteHost, remotePort, remoteRepo;
     friend void HttpClient_requestDoneCB(struct evhttp_request *,
                                          void *);
+    friend class HttpStream;
 };
 
 #endif /* __HTTPCLIENT_H__ */
@@ -42,6 +42,9 @@ public:
     bool hasObject(const ObjectHash &id);
     std::vector<bool> hasObjects(const ObjectHashVec &objs);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                  const ObjectHashVec &haves);
+    ObjectFilter::sp getObjectFilter();
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
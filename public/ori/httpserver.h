@@ -44,7 +44,10 @@ private:
     void getCommits(struct evhttp_request *req);
     void contains(struct evhttp_request *req);
     void getObjs(struct evhttp_request *req);
+    void getMissing(struct evhttp_request *req);
+    void getObjFilter(struct evhttp_request *req);
     void getObjInfo(struct evhttp_request *req);
+    void sendStream(struct evhttp_request *req, bytestream *bs);
     LocalRepo &repo;
     uint16_t port;
     struct evhttp *httpd;
@@ -21,11 +21,61 @@
 
 #include <string>
 #include <set>
+#include <vector>
 #include <unordered_map>
 
+#include <oriutil/mutex.h>
 #include "object.h"
 #include "packfile.h"
+#include "objectfilter.h"
 
+/// Suffix of the sorted base index that sits next to the index log
+#define INDEX_BASE_EXT ".base"
+/// Pack id of log records that remove an object from the index
+#define INDEX_PACKID_DELETED 0xFFFFFFFFU
+
+/*
+ * A group of index entries appended to the log with a single write.  Records
+ * are encoded and checksummed as they are added.  Entries of a replacing
+ * batch are expected to be indexed already (e.g. relocated objects).
+ */
+class IndexBatch
+{
+public:
+    IndexBatch(bool replace = false);
+    ~IndexBatch();
+    void add(const IndexEntry &entry);
+    /// Adds a record that removes the object from the index
+    void remove(const ObjectHash &objId);
+    void clear();
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+private:
+    friend class Index;
+    bool replace;
+    std::vector<IndexEntry> entries;
+    std::string records;
+};
+
+/*
+ * The index is split into two tiers.  The base is an immutable file sorted by
+ * object hash with a 256 entry fanout table, it is memory mapped and searched
+ * in place.  The delta is the append-only log of entries added since the last
+ * compaction and is kept in memory.  Index::rewrite merges the delta into a
+ * new base, Index::sync does so once the delta outgrows its budget.  Removed
+ * objects are kept as delta entries with the pack id INDEX_PACKID_DELETED
+ * until the next rewrite.
+ *
+ * Committed batches are reported to the packfile manager set with
+ * setAccounting, which keeps the live and dead bytes of every packfile.
+ * Once getFilter has been called they are also added to an object filter,
+ * which is rebuilt from the index when it outgrows its capacity.  getFilter
+ * hands out immutable snapshots of the filter.
+ *
+ * All methods are safe to call from multiple threads.  A committed batch is
+ * appended to the log and published to lookups under one lock, so readers see
+ * either none or all of its entries.
+ */
 class Index
 {
 public:
@@ -33,20 +83,48 @@ public:
     ~Index();
     void open(const std::string &indexFile);
     void close();
+    /// Flushes committed entries to disk and compacts an oversized log
     void sync();
+    /// Compacts the delta log into a new sorted base
     void rewrite();
     void dump();
+    /// Accounts the payloads of committed batches in mgr (may be null)
+    void setAccounting(PackfileManager *mgr);
     void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    /// Appends a batch to the log, the caller must have synced the packfile
+    void commit(IndexBatch &batch);
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
     std::set<ObjectInfo> getList();
+    /// Summary of the indexed objects, see ObjectFilter (do not modify)
+    ObjectFilter::sp getFilter();
+    /// Entries in the delta log and in the sorted base
+    size_t getDeltaSize() const;
+    size_t getBaseSize() const;
 private:
+    mutable Mutex lock;
     int fd;
+    bool dirty;
     std::string fileName;
     std::unordered_map<ObjectHash, IndexEntry> index;
+    PackfileManager *accounting;
+    ObjectFilter::sp filter;
+    std::vector<ObjectHash> filterAdds;
+
+    // Sorted base
+    const uint8_t *base;
+    size_t baseLen;
+    uint32_t baseCount;
+    uint32_t baseFanout[256];
 
-    void _writeEntry(const IndexEntry &e);
+    void _rewrite();
+    void _openBase();
+    void _closeBase();
+    void _buildFilter();
+    bool _hasEntry(const ObjectHash &objId, IndexEntry *entry = nullptr) const;
+    const uint8_t *_baseEntry(uint32_t ix) const;
+    bool _findBase(const ObjectHash &objId, IndexEntry *entry) const;
 };
 
 #endif /* __INDEX_H__ */
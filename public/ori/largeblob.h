@@ -21,17 +21,24 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 #include "repo.h"
 
 class LBlobEntry
 {
 public:
-    LBlobEntry(const LBlobEntry &l);
-    LBlobEntry(const ObjectHash &hash, uint16_t length);
+    LBlobEntry(const ObjectHash &hash, uint64_t offset, uint32_t length);
     ~LBlobEntry();
-    const ObjectHash hash;
-    const uint16_t length;
+    ObjectHash hash;
+    /// Offset of the chunk within the file
+    uint64_t offset;
+    uint32_t length;
 };
 
 class Repo;
@@ -45,19 +52,76 @@ public:
     void extractFile(const std::string &path);
     /// May read less than s bytes
     ssize_t read(uint8_t *buf, size_t s, off_t off) const;
+    /// @returns the part containing off or parts.end()
+    std::vector<LBlobEntry>::const_iterator findPart(uint64_t off) const;
+    /// Appends the next chunk of the file
+    void addPart(const ObjectHash &hash, uint32_t length);
     // XXX: Stream read/write operations
     const std::string getBlob();
     void fromBlob(const std::string &blob);
     size_t totalSize() const;
     /*
-     * A map of the file parts contains the file offset as the key and the large 
-     * blob entry object as the value.  It allows O(log n) random access into 
-     * the file.
+     * The file parts sorted by offset, a binary search on the offsets allows
+     * O(log n) random access into the file.
      */
     ObjectHash totalHash;
-    std::map<uint64_t, LBlobEntry> parts;
+    std::vector<LBlobEntry> parts;
     Repo *repo;
 };
 
+class RWLock;
+class LargeBlobPrefetcher;
+
+/*
+ * Reader for an open large file.  Keeps a window of decoded chunks and once
+ * reads turn sequential prefetches the following chunks on a background
+ * thread.  If repoLock is given the prefetcher only accesses the repository
+ * while it can take repoLock for reading without blocking.
+ */
+class LargeBlobReader
+{
+public:
+    typedef std::shared_ptr<LargeBlobReader> sp;
+
+    LargeBlobReader(Repo *r, std::shared_ptr<const LargeBlob> lb,
+                    RWLock *repoLock = nullptr);
+    ~LargeBlobReader();
+    /// Reads up to s bytes, only returns less at the end of the file
+    ssize_t read(uint8_t *buf, size_t s, off_t off);
+    size_t totalSize() const { return lb->totalSize(); }
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t prefetched;
+    };
+    Stats getStats();
+private:
+    typedef std::shared_ptr<const std::string> Chunk;
+    Chunk getChunk(std::unique_lock<std::mutex> &l, const LBlobEntry &e);
+    Chunk fetch(const LBlobEntry &e);
+    void insert(uint64_t off, Chunk c);
+    void schedule(uint64_t nextOff);
+    void prefetchLoop();
+    friend class LargeBlobPrefetcher;
+
+    Repo *repo;
+    std::shared_ptr<const LargeBlob> lb;
+    RWLock *repoLock;
+
+    std::mutex lock;
+    std::condition_variable prefetchCV;
+    std::map<uint64_t, Chunk> window;
+    std::deque<uint64_t> windowOrder;
+    std::deque<uint64_t> prefetchQueue;
+    std::set<uint64_t> pending;
+    uint64_t nextReadOff;
+    uint64_t prefetchedTo;
+    int sequential;
+    bool stopping;
+    LargeBlobPrefetcher *prefetcher;
+    Stats stats;
+};
+
 #endif /* __LARGEBLOB_H__ */
 
@@ -33,7 +33,8 @@ class LocalObject : public Object
 public:
     typedef std::shared_ptr<LocalObject> sp;
 
-    LocalObject(PfTransaction::sp transaction, size_t ix);
+    /// An object staged in a transaction that is not yet committed
+    LocalObject(const ObjectInfo &info, const std::string &stored);
     LocalObject(Packfile::sp packfile, const IndexEntry &entry);
     ~LocalObject();
 
@@ -41,8 +42,8 @@ public:
     bytestream *getPayloadStream();
 
 private:
-    PfTransaction::sp transaction;
-    size_t ix_tr;
+    bool staged;
+    std::string stored;
 
     Packfile::sp packfile;
     IndexEntry entry;
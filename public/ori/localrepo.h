@@ -18,9 +18,12 @@
 #define __LOCALREPO_H__
 
 #include <memory>
+#include <unordered_set>
+#include <condition_variable>
 
 #include <oriutil/lrucache.h>
 #include <oriutil/key.h>
+#include <oriutil/stopwatch.h>
 #include "repo.h"
 #include "index.h"
 #include "snapshotindex.h"
@@ -55,6 +58,7 @@
 #define ORI_PATH_LOCK "/lock"
 #define ORI_PATH_UDSSOCK "/uds"
 #define ORI_PATH_BACKUP_CONF "/backup.conf"
+#define ORI_PATH_CODEC "/codec"
 
 int LocalRepo_Init(const std::string &path, bool barerepo,
                    const std::string &uuid = "");
@@ -111,15 +115,29 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &objId) override ;
     bool hasObject(const ObjectHash &objId) override ;
     bool isObjectStored(const ObjectHash &objId);
+    ObjectFilter::sp getObjectFilter() override;
     //std::set<ObjectInfo> slowListObjects();
     std::set<ObjectInfo> listObjects() override;
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload) override;
+    int addPreparedObject(const ObjectInfo &info, const std::string &payload,
+            const std::string &stored) override;
+    int addFileObject(const ObjectHash &hash, const std::string &payload,
+            const std::string &fileType) override;
+    const Codec *getCodec() override { return codec; }
+    CompressionMemo *getCompressionMemo() override { return &compressionMemo; }
+    /// Compress new objects with codec and remember it in the repository
+    void setCodec(const Codec *codec);
 
     void sync(); /// sync all changes to disk
 
     // Index
     bool rebuildIndex();
+    void rebuildPackStats();
+    /// Live and dead payload bytes of every packfile
+    std::map<packid_t, PackfileManager::PackStats> getPackStats();
+    /// Pack handle cache counters of this process
+    PackfileManager::Stats getPackCacheStats();
     void dumpIndex();
     void dumpPackfile(packid_t packfileId);
 
@@ -143,7 +161,9 @@ public:
 
     // Clone/pull operations
     void pull(Repo *r);
-    void multiPull(RemoteRepo::sp defaultRemote);
+    void multiPull(RemoteRepo::sp defaultRemote,
+                   const std::vector<RemoteRepo::sp> &peers =
+                       std::vector<RemoteRepo::sp>());
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs) override;
     void receive(bytestream *bs) override;
     bytestream *getObjects(const std::vector<ObjectHash> &objs) override;
@@ -162,7 +182,8 @@ public:
     ObjectHash commitFromObjects(const ObjectHash &treeHash, Repo *objects,
             Commit &c, const std::string &status="normal");
 
-    void gc();
+    /// Reclaims space, maxCopy and rateLimit (bytes/s) of 0 are unlimited
+    void gc(uint64_t maxCopy = 0, uint64_t rateLimit = 0);
 
     // Reference Counting Operations
     MetadataLog &getMetadata();
@@ -225,6 +246,28 @@ public:
 private:
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+
+    /*
+     * Objects are appended to the packfile of a writer that is checked out by
+     * one thread at a time, concurrent commits and receives each fill their
+     * own packfile.  The lock is held by the owning thread and by
+     * commitWriters, tr may only be replaced while holding writersLock.
+     */
+    struct PackWriter {
+        typedef std::shared_ptr<PackWriter> sp;
+        Mutex lock;
+        Packfile::sp pf;
+        PfTransaction::sp tr;
+    };
+    PackWriter::sp acquireWriter();
+    void releaseWriter(PackWriter::sp w);
+    void openTransaction(PackWriter::sp w);
+    bool claimObject(const ObjectHash &hash);
+    void releaseObject(const ObjectHash &hash);
+    void addStagedObject(const ObjectInfo &info, const std::string &stored);
+    bool getStagedObject(const ObjectHash &objId, ObjectInfo *info,
+                         std::string *stored);
+    void commitWriters();
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
@@ -239,12 +282,29 @@ private:
     MetadataLog metadata;
 
     // Packfiles
-    Packfile::sp currPackfile;
-    PfTransaction::sp currTransaction;
+    Mutex writersLock;
+    std::vector<PackWriter::sp> writers;
+    std::vector<PackWriter::sp> idleWriters;
+    std::unordered_set<ObjectHash> claimedObjects;
+    std::condition_variable_any claimsCV;
     PackfileManager::sp packfiles;
-
-    // Purging
-    std::set<ObjectHash> purged;
+    const Codec *codec;
+    CompressionMemo compressionMemo;
+
+    // Pulling
+    bool pullObjects(Repo *r, ObjectHashVec &objs);
+    ObjectHashVec listHaves(const std::vector<Commit> &wants);
+
+    // Transmitting (wire groups of objects from one packfile)
+    void planTransmit(const ObjectHashVec &objs,
+        std::vector<std::pair<Packfile::sp, std::vector<IndexEntry> > > &groups);
+
+    // Garbage collection (gcPackfile receives relocated objects)
+    Mutex gcLock;
+    Packfile::sp gcPackfile;
+    std::vector<std::pair<double, packid_t> > gcSelectPacks();
+    bool gcCompactPack(packid_t id, uint64_t maxCopy, uint64_t rateLimit,
+                       uint64_t *copied, Stopwatch &sw);
 
     // Repo lock
     LocalRepoLock::sp repoProcessLock;
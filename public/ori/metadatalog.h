@@ -43,6 +43,22 @@ private:
     MetadataMap metadata;
 };
 
+/// Suffix of the sorted snapshot that sits next to the metadata log
+#define MDLOG_SNAPSHOT_EXT ".snap"
+
+/*
+ * Reference counts and object metadata are kept in two tiers like the index.
+ * The snapshot is an immutable file sorted by object hash that is memory
+ * mapped and searched in place.  The log holds the transactions committed
+ * since the snapshot was written and is replayed into memory at open, so
+ * opening costs time proportional to the log only.  rewrite merges both into
+ * a new snapshot and starts an empty log, sync does so once the log has grown
+ * large.
+ *
+ * Both files carry a generation number.  A log whose generation is older than
+ * the snapshot was already merged and is discarded at open.  A record torn by
+ * a crash is truncated from the end of the log.
+ */
 class MetadataLog
 {
 public:
@@ -50,8 +66,9 @@ public:
     ~MetadataLog();
 
     void open(const std::string &filename);
+    /// Flushes the log and checkpoints it once it exceeds its budget
     void sync();
-    /// rewrites the log file, optionally with new counts
+    /// Writes a new snapshot and empties the log, optionally with new counts
     void rewrite(const RefcountMap *refs = nullptr, const MetadataMap *data = nullptr);
 
     void addRef(const ObjectHash &hash, MdTransaction::sp trs =
@@ -69,8 +86,28 @@ private:
     friend class MdTransaction;
     int fd;
     std::string filename;
+    uint64_t generation;
+    size_t logSize;
+    // Changes since the snapshot
     RefcountMap refcounts;
     MetadataMap metadata;
+
+    // Sorted snapshot
+    const uint8_t *snap;
+    size_t snapLen;
+    uint32_t snapRefs;
+    uint32_t snapMetas;
+    uint32_t refFanout[256];
+    uint32_t metaFanout[256];
+
+    void _openSnapshot();
+    void _closeSnapshot();
+    void _writeSnapshot(const std::string &path,
+                        const RefcountMap *refs, const MetadataMap *data);
+    void _replay(size_t fileSize);
+    bool _findRef(const ObjectHash &hash, refcount_t *count) const;
+    bool _findMeta(const ObjectHash &hash, ObjMetadata *md) const;
+    ObjMetadata _getAllMeta(const ObjectHash &hash) const;
 };
 
 #endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OBJECTFILTER_H__
+#define __OBJECTFILTER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <oriutil/objecthash.h>
+
+/*
+ * A compact summary of a repository's object set for deciding which remote
+ * to fetch an object from without asking each one.  It is a Bloom filter:
+ * mayContain is always true for added objects and is true for other objects
+ * with a probability of about 1% while getCount() <= getCapacity().  Object
+ * hashes are uniformly distributed, so the probe positions are read
+ * directly from the hash instead of rehashing it.  Objects cannot be
+ * removed, a filter of a repository that deleted objects is only
+ * conservative.
+ */
+class ObjectFilter
+{
+public:
+    typedef std::shared_ptr<ObjectFilter> sp;
+
+    ObjectFilter();
+    /// Creates an empty filter sized for capacity objects
+    ObjectFilter(uint64_t capacity);
+    ~ObjectFilter();
+    void add(const ObjectHash &objId);
+    bool mayContain(const ObjectHash &objId) const;
+    uint64_t getCount() const { return count; }
+    uint64_t getCapacity() const;
+    std::string getBlob() const;
+    /// Returns false if the blob is not a valid filter
+    bool fromBlob(const std::string &blob);
+private:
+    uint8_t log2Bits;
+    uint64_t count;
+    std::vector<uint8_t> bits;
+
+    uint64_t probe(const ObjectHash &objId, int i) const;
+};
+
+#endif /* __OBJECTFILTER_H__ */
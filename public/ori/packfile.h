@@ -18,18 +18,23 @@
 #define __PACKFILE_H__
 
 #include <set>
+#include <list>
+#include <map>
 #include <deque>
 #include <memory>
 #include <unordered_map>
 
 #include <oriutil/objecthash.h>
 #include <oriutil/stream.h>
-#include <oriutil/lrucache.h>
+#include <oriutil/mutex.h>
+#include <oriutil/codec.h>
 #include "object.h"
 
 typedef uint32_t offset_t;
 typedef uint32_t packid_t;
 typedef uint32_t numobjs_t;
+/// Ends an object stream in place of the 0 terminator if the sender failed
+#define NUMOBJS_ABORT ((numobjs_t)0xFFFFFFFF)
 
 struct IndexEntry
 {
@@ -44,17 +49,85 @@ struct IndexEntry
 
 class Packfile;
 class Index;
+class IndexBatch;
+
+/*
+ * Decides whether payloads are worth compressing before a codec runs and
+ * counts how each decision was made.  Outcomes are remembered per file type
+ * (the file name extension), types that consistently do or do not compress
+ * skip the entropy estimate.  Safe to use from multiple threads.
+ */
+class CompressionMemo
+{
+public:
+    enum Decision { Unknown, Compress, Store };
+    enum Path {
+        COMPPATH_SMALL,          ///< Below ZIP_MINIMUM_SIZE
+        COMPPATH_MEMO_STORE,     ///< File type known not to compress
+        COMPPATH_MEMO_COMPRESS,  ///< File type known to compress, no estimate
+        COMPPATH_ENTROPY_STORE,  ///< Estimated entropy too high
+        COMPPATH_COMPRESSED,     ///< Codec output kept
+        COMPPATH_RATIO_STORE,    ///< Codec ran, output discarded
+        COMPPATH_MAX
+    };
+    struct Stats {
+        uint64_t paths[COMPPATH_MAX];
+    };
+
+    CompressionMemo();
+    ~CompressionMemo();
+
+    Decision lookup(const std::string &fileType);
+    /// Records the path taken by a payload of fileType
+    void record(const std::string &fileType, Path path) {
+        record(fileType, path, path);
+    }
+    /// As above but learns from outcome rather than the path counted
+    void record(const std::string &fileType, Path path, Path outcome);
+    Stats getStats();
+
+    /// @returns the lower case extension of path or an empty string
+    static std::string fileType(const std::string &path);
+    static const char *getStrForPath(Path path);
+
+private:
+    struct TypeEntry {
+        uint32_t compressed;
+        uint32_t stored;
+        uint32_t lookups;
+    };
+    Mutex lock;
+    std::unordered_map<std::string, TypeEntry> types;
+    Stats stats;
+};
+
+/*
+ * Objects staged for one packfile.  A transaction is filled and committed by
+ * a single writer thread, has and get may be called concurrently from other
+ * threads.
+ */
 class PfTransaction
 {
 public:
     typedef std::shared_ptr<PfTransaction> sp;
 
-    PfTransaction(Packfile *pf, Index *idx);
+    PfTransaction(Packfile *pf, Index *idx, const Codec *codec,
+                  CompressionMemo *memo);
     ~PfTransaction();
 
     bool full() const;
-    void addPayload(ObjectInfo info, const std::string &payload);
+    void addPayload(ObjectInfo info, const std::string &payload,
+                    const std::string &fileType = "");
+    static std::string preparePayload(ObjectInfo &info,
+                                      const std::string &payload,
+                                      const Codec *codec,
+                                      CompressionMemo *memo = nullptr,
+                                      const std::string &fileType = "");
+    void addPreparedPayload(const ObjectInfo &info, const std::string &stored);
     bool has(const ObjectHash &hash) const;
+    /// Copies out the info and stored bytes of a staged object
+    bool get(const ObjectHash &hash, ObjectInfo *info,
+             std::string *stored) const;
     void commit();
 
     std::vector<ObjectInfo> infos;
@@ -65,11 +138,66 @@ public:
     std::unordered_map<ObjectHash, size_t> hashToIx;
 
 private:
+    mutable Mutex lock;
     Packfile *pf;
     Index *idx;
+    const Codec *codec;
+    CompressionMemo *memo;
     float _checkCompressionRatio(const std::string &payload);
 };
 
+/*
+ * Reads an object stream in the format written by Packfile::transmit, one
+ * group at a time.  Every object is checked against its hash before it is
+ * handed out, a mismatch or a stream the sender aborted throws
+ * RuntimeException(ORIEC_BSCORRUPT).
+ */
+class GroupReader
+{
+public:
+    explicit GroupReader(bytestream *bs);
+
+    /// Reads the headers of the next group, @returns false at the end
+    bool nextGroup();
+    /// Headers of the current group in stream order
+    const std::vector<ObjectInfo> &getInfos() const { return infos; }
+    const std::vector<uint32_t> &getSizes() const { return sizes; }
+    /// @returns true while the current group has objects left to read
+    bool hasObject() const { return next < infos.size(); }
+    /**
+     * Reads the next object of the current group.
+     * @param stored if set receives the object as transmitted
+     * @returns the info and uncompressed payload (empty for purged objects)
+     */
+    std::pair<ObjectInfo, std::string> readObject(std::string *stored = nullptr);
+
+private:
+    bytestream *bs;
+    std::vector<ObjectInfo> infos;
+    std::vector<uint32_t> sizes;
+    size_t next;
+};
+
+/*
+ * Read-only mapping of a packfile.  Payload streams hold a reference so the
+ * region stays valid after the packfile is remapped or evicted.
+ */
+class PackMapping
+{
+public:
+    typedef std::shared_ptr<PackMapping> sp;
+
+    PackMapping(int fd, size_t length);
+    ~PackMapping();
+
+    const uint8_t *data() const { return addr; }
+    size_t size() const { return length; }
+
+private:
+    uint8_t *addr;
+    size_t length;
+};
+
 class Packfile
 {
 public:
@@ -79,18 +207,26 @@ public:
     ~Packfile();
 
     packid_t getPackfileID() const;
+    size_t getSize() const;
+    /// Bytes currently mapped for reading
+    size_t getMappedSize();
 
     bool full() const;
-    PfTransaction::sp begin(Index *idx);
+    /// New objects are compressed with codec (or the default codec)
+    PfTransaction::sp begin(Index *idx, const Codec *codec = nullptr,
+                            CompressionMemo *memo = nullptr);
     void commit(PfTransaction *t, Index *idx);
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
-    /// @returns true when the packfile is empty
-    bool purge(const std::set<ObjectHash> &hset, Index *idx);
+    /// Copies objects of src to this packfile and moves their index entries
+    void relocate(Packfile *src, const std::vector<IndexEntry> &entries,
+                  Index *idx);
 
     typedef void (*ReadEntryCb)(const ObjectInfo &info, offset_t off,
                                 void *arg);
     void readEntries(ReadEntryCb cb, void *arg);
+    /// @returns every object stored in the packfile (including dead ones)
+    std::vector<IndexEntry> getEntries();
 
     void transmit(bytewstream *bs, std::vector<IndexEntry> objects);
     /// @returns false if nothing to receive
@@ -102,33 +238,113 @@ private:
     packid_t packid;
     size_t numObjects;
     size_t fileSize;
+
+    Mutex mapLock;
+    PackMapping::sp mapping;
+    PackMapping::sp _getMapping(size_t end);
+    void _append(const std::vector<ObjectInfo> &infos,
+                 const std::vector<std::string> &payloads, IndexBatch *batch);
 };
 
 
 #define PFMGR_FREELIST ".freelist"
+#define PFMGR_PACKSTATS ".packstats"
 
+/*
+ * Pack handles are cached until either the open file descriptor or the mapped
+ * bytes budget is exceeded, the least recently used idle handles are closed
+ * first.  A handle referenced outside the cache (e.g. by an in-flight
+ * transmit) is pinned and never evicted, so pinned handles may temporarily
+ * exceed the budgets.
+ */
 class PackfileManager
 {
 public:
     typedef std::shared_ptr<PackfileManager> sp;
 
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t openHandles;
+        size_t mappedBytes;
+    };
+    /*
+     * Payload bytes of a packfile that the index refers to and that it no
+     * longer refers to (superseded, relocated or purged objects).  Object
+     * headers are not counted.
+     */
+    struct PackStats {
+        uint64_t live;
+        uint64_t dead;
+    };
+
     PackfileManager(const std::string &rootPath);
     ~PackfileManager();
 
     Packfile::sp getPackfile(packid_t id);
     Packfile::sp newPackfile();
+    /*
+     * Deletes a packfile that is no longer indexed.  The cached handle keeps
+     * the data readable for lookups that raced with the removal, the id is
+     * reused after the next reclaimRetired.
+     */
+    void retirePackfile(packid_t id);
+    void reclaimRetired();
     bool hasPackfile(packid_t id);
     std::vector<packid_t> getPackfileList();
 
+    /// Defaults to PFMGR_MAXFDS and PFMGR_MAXMAPPED
+    void setBudget(size_t maxFds, size_t maxMapped);
+    Stats getStats();
+
+    /*
+     * Live and dead bytes are maintained by Index::commit and persisted
+     * next to the free list on syncPackStats and close.  After a crash they
+     * may be stale, they only steer garbage collection.
+     */
+    void addLive(packid_t id, uint64_t bytes);
+    void addDead(packid_t id, uint64_t bytes);
+    std::map<packid_t, PackStats> getPackStats();
+    /// Replaces all counters (e.g. after recounting from the index)
+    void setPackStats(const std::map<packid_t, PackStats> &stats);
+    /// False if no counters were found on disk
+    bool hasPackStats();
+    void syncPackStats();
+
 private:
     std::string rootPath;
 
+    Mutex statsLock;
+    std::map<packid_t, PackStats> packStats;
+    bool statsLoaded;
+    bool statsDirty;
+    bool _loadPackStats();
+    void _writePackStats();
+
+    Mutex freeListLock;
     std::deque<packid_t> freeList;
+    std::vector<packid_t> retired;
     void _recomputeFreeList();
     bool _loadFreeList();
     void _writeFreeList();
 
-    LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
+    // Pack handle cache (protected by cacheLock)
+    typedef std::list<packid_t> HandleLRU;
+    struct Handle {
+        Packfile::sp pf;
+        HandleLRU::iterator lruIt;
+    };
+    Mutex cacheLock;
+    std::unordered_map<packid_t, Handle> handles;
+    HandleLRU lru;
+    size_t maxFds;
+    size_t maxMapped;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    void _insertHandle(packid_t id, Packfile::sp pf);
+    void _enforceBudget();
 
     std::string _getPackfileName(packid_t id);
 };
@@ -22,12 +22,15 @@
 #include <string>
 #include <set>
 #include <deque>
+#include <memory>
 
 #include <oriutil/dag.h>
 #include <oriutil/objecthash.h>
+#include <oriutil/codec.h>
 #include "tree.h"
 #include "commit.h"
 #include "object.h"
+#include "objectfilter.h"
 
 extern ObjectHash EMPTY_COMMIT;
 extern ObjectHash EMPTYFILE_HASH;
@@ -35,11 +38,16 @@ extern ObjectHash EMPTYFILE_HASH;
 typedef std::vector<ObjectHash> ObjectHashVec;
 
 class LargeBlob;
+class CompressionMemo;
+struct RepoObjectCache;
 
 class Repo
 {
 public:
-    Repo() = default;
+    Repo();
+    /// The object cache is per instance and is never copied
+    Repo(const Repo &r);
+    Repo &operator=(const Repo &r);
     virtual ~Repo();
 
     // Repo information
@@ -59,6 +67,19 @@ public:
     virtual bytestream *getObjects(
             const ObjectHashVec &objs
             ) = 0;
+    /*
+     * Lists the objects reachable from the wanted commits that are not
+     * reachable from the commits the caller has (have/want negotiation).
+     * The order is unspecified, getMissingObjects transmits the objects in
+     * the order they are stored.
+     */
+    virtual ObjectHashVec listMissingObjects(const ObjectHashVec &wants,
+                                             const ObjectHashVec &haves);
+    /// Transmits listMissingObjects, nullptr if the remote does not support it
+    virtual bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                          const ObjectHashVec &haves);
+    /// Summary of the stored objects, nullptr if the repo cannot provide one
+    virtual ObjectFilter::sp getObjectFilter();
 
     // Object queries
     virtual std::set<ObjectInfo> listObjects() = 0;
@@ -69,6 +90,29 @@ public:
             const ObjectHash &hash,
             const std::string &payload
             ) = 0;
+    /*
+     * Adds an object whose stored bytes were already produced by
+     * PfTransaction::preparePayload (e.g. on a worker thread).  Repositories
+     * without packfiles store the original payload instead.
+     */
+    virtual int addPreparedObject(
+            const ObjectInfo &info,
+            const std::string &payload,
+            const std::string &stored
+            );
+    /*
+     * Adds a blob read from a file, the file type (see
+     * CompressionMemo::fileType) helps decide whether to compress it.
+     */
+    virtual int addFileObject(
+            const ObjectHash &hash,
+            const std::string &payload,
+            const std::string &fileType
+            );
+    /// Codec passed to PfTransaction::preparePayload for new objects
+    virtual const Codec *getCodec() { return Codec_Default(); }
+    /// Memo passed to PfTransaction::preparePayload, may be nullptr
+    virtual CompressionMemo *getCompressionMemo() { return nullptr; }
 
     // Wrappers
     virtual ObjectHash addBlob(ObjectType type, const std::string &blob);
@@ -84,8 +128,28 @@ public:
     virtual Commit getCommit(const ObjectHash &commitId);
     virtual LargeBlob getLargeBlob(const ObjectHash &objId);
 
+    /*
+     * Parsed objects are immutable so they are cached and shared by hash.
+     * Prefer these over the copying getters on hot paths.
+     */
+    std::shared_ptr<const Tree> getTreeRef(const ObjectHash &treeId);
+    std::shared_ptr<const Commit> getCommitRef(const ObjectHash &commitId);
+    std::shared_ptr<const LargeBlob> getLargeBlobRef(const ObjectHash &objId);
+
+    struct ObjectCacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+        uint64_t pathHits;
+        uint64_t pathMisses;
+        size_t pathEntries;
+    };
+    ObjectCacheStats getObjectCacheStats();
+
     // Lookup
     ObjectHash lookup(const Commit &c, const std::string &path);
+    /// Memoized on (tree, path), misses are cached as an empty hash
+    ObjectHash lookupPath(const ObjectHash &treeId, const std::string &path);
 
     // Transport
     virtual void transmit(bytewstream *bs, const ObjectHashVec &objs);
@@ -102,6 +166,13 @@ public:
             Object *other
             );
     virtual DAG<ObjectHash, Commit> getCommitDag();
+
+protected:
+    /// Drops a parsed object, e.g. once it has been purged
+    void invalidateObjectCache(const ObjectHash &objId);
+
+private:
+    std::unique_ptr<RepoObjectCache> objCache;
 };
 
 #endif /* __REPO_H__ */
@@ -32,6 +32,7 @@ public:
     void rewrite();
     void addSnapshot(const std::string &name, const ObjectHash &commitId);
     void delSnapshot(const std::string &name);
+    bool hasSnapshot(const std::string &name) const;
     const ObjectHash &getSnapshot(const std::string &name) const;
     std::map<std::string, ObjectHash> getList();
     std::map<int64_t, ObjectHash> getOrisyncList();
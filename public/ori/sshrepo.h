@@ -40,6 +40,9 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                  const ObjectHashVec &haves);
+    ObjectFilter::sp getObjectFilter();
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
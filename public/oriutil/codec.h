@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "objectinfo.h"
+#include "stream.h"
+
+/*
+ * Object compression codec.  Every codec a build knows about can always
+ * decompress, the repository configuration only selects the codec used for
+ * new objects.  The algorithm is stored in the object flags so packfiles may
+ * hold objects written with different codecs.
+ */
+class Codec
+{
+public:
+    virtual ~Codec() { }
+    virtual ObjectInfo::ZipAlgo getAlgo() const = 0;
+    virtual const char *getName() const = 0;
+    /// Returns false if the codec cannot compress the input
+    virtual bool compress(const uint8_t *in, size_t len,
+                          std::string &out) const = 0;
+    /// Returns false unless the input expands to exactly outLen bytes
+    virtual bool decompress(const uint8_t *in, size_t len,
+                            uint8_t *out, size_t outLen) const = 0;
+};
+
+/// Returns the codec for an algorithm or nullptr if it is not built in
+const Codec *Codec_Get(ObjectInfo::ZipAlgo algo);
+/// Returns the codec with the given name or nullptr
+const Codec *Codec_Lookup(const std::string &name);
+/// Returns the codec used when a repository does not configure one
+const Codec *Codec_Default();
+/// Returns all codecs built into this binary
+std::vector<const Codec *> Codec_List();
+
+/*
+ * Estimates the entropy of data in bits per byte (0 to 8) from a sample of
+ * its byte histogram.  Data close to 8 bits per byte is very unlikely to
+ * compress, which is cheaper to detect than running a codec.
+ */
+float Codec_EstimateEntropy(const uint8_t *buf, size_t len);
+
+/// Returns the payload of an object given its stored bytes
+std::string Codec_Decompress(const ObjectInfo &info, const uint8_t *stored,
+                             size_t len);
+std::string Codec_Decompress(const ObjectInfo &info,
+                             const std::string &stored);
+/// Returns a payload stream, takes ownership of stored
+bytestream *Codec_DecompressStream(const ObjectInfo &info,
+                                   bytestream *stored);
+
+#endif /* __CODEC_H__ */
+
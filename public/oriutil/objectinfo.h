@@ -20,6 +20,7 @@
 #define __OBJECTINFO_H__
 
 #include <string>
+#include <iostream>
 
 #include "objecthash.h"
 
@@ -31,19 +32,24 @@
 #define ORI_FLAG_UNCOMPRESSED   0x0000
 #define ORI_FLAG_FASTLZ         0x0001
 #define ORI_FLAG_LZMA           0x0002
+#define ORI_FLAG_SNAPPY         0x0003
+#define ORI_FLAG_ZSTD           0x0004
 #define ORI_FLAG_ZIPMASK        0x000F
 
 #define ORI_FLAG_DEFAULT        0x0000
 
 struct ObjectInfo {
     enum Type { Null, Commit, Tree, Blob, LargeBlob, Purged };
-    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA };
+    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA,
+                   ZIPALGO_SNAPPY, ZIPALGO_ZSTD };
 
     ObjectInfo();
     explicit ObjectInfo(const ObjectHash &hash);
 
     std::string toString() const;
     void fromString(const std::string &info);
+    /// Parses SIZE bytes of a serialized ObjectInfo in place
+    void fromBytes(const uint8_t *buf);
     //ssize_t writeTo(int fd, bool seekable = true);
     bool hasAllFields() const;
 
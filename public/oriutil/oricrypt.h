@@ -23,6 +23,23 @@ std::string OriCrypt_MD5String(const std::string &str);
 ObjectHash OriCrypt_HashString(const std::string &str);
 ObjectHash OriCrypt_HashBlob(const uint8_t *data, size_t len);
 ObjectHash OriCrypt_HashFile(const std::string &path);
+
+/*
+ * Incremental hashing for data that arrives in pieces, yields the same hash
+ * as OriCrypt_HashBlob over the concatenated data.
+ */
+class OriCrypt_HashContext
+{
+public:
+    OriCrypt_HashContext();
+    ~OriCrypt_HashContext();
+    void update(const uint8_t *data, size_t len);
+    ObjectHash final();
+private:
+    OriCrypt_HashContext(const OriCrypt_HashContext &);
+    OriCrypt_HashContext &operator=(const OriCrypt_HashContext &);
+    void *state;
+};
 std::string
 OriCrypt_Encrypt(const std::string &plaintext, const std::string &key);
 std::string
@@ -33,6 +33,7 @@ std::string Util_GetHome();
 std::string Util_GetOSType();
 std::string Util_GetMachType();
 int Util_SetBlocking(int fd, bool block);
+int Util_NumCPUs();
 
 std::string Util_NewUUID();
 bool Util_IsPathRemote(const std::string &path);
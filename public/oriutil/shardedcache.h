@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SHARDEDCACHE_H__
+#define __SHARDEDCACHE_H__
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+
+/*
+ * Concurrent cache with the interface of LRUCache.  Keys are spread over
+ * SHARDS independently locked shards and each shard evicts with the CLOCK
+ * algorithm: a hit only sets a reference bit under the shared lock, so
+ * readers never serialize.  Recency is approximate and per shard, a shard
+ * holds at most ceil(MAX / SHARDS) entries.
+ *
+ * The shard locks are std::shared_mutex rather than RWLock since the debug
+ * lock order checking in RWLock goes through a single global mutex.
+ */
+template <class K, class V, int MAX, int SHARDS = 16>
+class ShardedCache
+{
+public:
+    ShardedCache() {
+        for (int i = 0; i < SHARDS; i++) {
+            shards[i].slots = std::vector<Slot>(PER_SHARD);
+            shards[i].used = 0;
+            shards[i].hand = 0;
+        }
+    }
+    ~ShardedCache() {
+    }
+
+    void put(const K &key, const V &value) {
+        Shard &s = shardFor(key);
+        std::unique_lock<std::shared_mutex> l(s.lock);
+
+        typename slot_map::iterator it = s.map.find(key);
+        if (it != s.map.end()) {
+            s.slots[(*it).second].value = value;
+            return;
+        }
+
+        size_t ix;
+        if (!s.freeSlots.empty()) {
+            ix = s.freeSlots.back();
+            s.freeSlots.pop_back();
+        } else if (s.used < PER_SHARD) {
+            ix = s.used++;
+        } else {
+            ix = evict(s);
+        }
+
+        Slot &slot = s.slots[ix];
+        slot.key = key;
+        slot.value = value;
+        slot.valid = true;
+        slot.referenced.store(false, std::memory_order_relaxed);
+        s.map[key] = ix;
+    }
+
+    V get(const K &key) {
+        V value;
+        if (!get(key, value))
+            throw std::runtime_error("Key doesn't exist!");
+        return value;
+    }
+
+    /// Atomic get which returns true if key is cached (and value returned)
+    bool get(const K &key, V &value) {
+        Shard &s = shardFor(key);
+        std::shared_lock<std::shared_mutex> l(s.lock);
+
+        typename slot_map::const_iterator it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+
+        Slot &slot = s.slots[(*it).second];
+        if (!slot.referenced.load(std::memory_order_relaxed))
+            slot.referenced.store(true, std::memory_order_relaxed);
+        value = slot.value;
+        return true;
+    }
+
+    bool hasKey(const K &key) {
+        Shard &s = shardFor(key);
+        std::shared_lock<std::shared_mutex> l(s.lock);
+
+        return s.map.find(key) != s.map.end();
+    }
+    void invalidate(const K &key) {
+        Shard &s = shardFor(key);
+        std::unique_lock<std::shared_mutex> l(s.lock);
+
+        typename slot_map::iterator it = s.map.find(key);
+        if (it == s.map.end())
+            return;
+
+        release(s, (*it).second);
+        s.map.erase(it);
+    }
+    void clear() {
+        for (int i = 0; i < SHARDS; i++) {
+            Shard &s = shards[i];
+            std::unique_lock<std::shared_mutex> l(s.lock);
+
+            for (size_t ix = 0; ix < s.used; ix++) {
+                s.slots[ix].valid = false;
+                s.slots[ix].value = V();
+            }
+            s.map.clear();
+            s.freeSlots.clear();
+            s.used = 0;
+            s.hand = 0;
+        }
+    }
+    size_t size() {
+        size_t n = 0;
+        for (int i = 0; i < SHARDS; i++) {
+            std::shared_lock<std::shared_mutex> l(shards[i].lock);
+            n += shards[i].map.size();
+        }
+        return n;
+    }
+private:
+    static const size_t PER_SHARD = (MAX + SHARDS - 1) / SHARDS;
+
+    struct Slot {
+        Slot() : value(), valid(false), referenced(false) { }
+        K key;
+        V value;
+        bool valid;
+        std::atomic<bool> referenced;
+    };
+    typedef std::unordered_map<K, size_t> slot_map;
+    struct Shard {
+        std::shared_mutex lock;
+        slot_map map;
+        std::vector<Slot> slots;
+        std::vector<size_t> freeSlots;
+        size_t used;
+        size_t hand;
+    };
+
+    Shard &shardFor(const K &key) {
+        uint64_t h = std::hash<K>()(key);
+        // Mix the bits so weak hashes still spread over the shards
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return shards[h % SHARDS];
+    }
+    /// Sweep the clock hand to a slot that was not referenced since the last
+    /// sweep and empty it.  Called with the shard write locked and full.
+    size_t evict(Shard &s) {
+        while (true) {
+            size_t ix = s.hand;
+            Slot &slot = s.slots[ix];
+            s.hand = (s.hand + 1) % PER_SHARD;
+
+            if (!slot.valid)
+                continue;
+            if (slot.referenced.load(std::memory_order_relaxed)) {
+                slot.referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+
+            s.map.erase(slot.key);
+            slot.valid = false;
+            slot.value = V();
+            return ix;
+        }
+    }
+    void release(Shard &s, size_t ix) {
+        Slot &slot = s.slots[ix];
+        slot.valid = false;
+        slot.value = V();
+        s.freeSlots.push_back(ix);
+    }
+
+    Shard shards[SHARDS];
+};
+
+#endif /* __SHARDEDCACHE_H__ */
+
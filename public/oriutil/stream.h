@@ -126,6 +126,30 @@ private:
     size_t left;
 };
 
+/*
+ * Reads from a memory mapped region without copying it.  The owner keeps the
+ * mapping alive for the lifetime of the stream.
+ */
+class mmapstream : public bytestream
+{
+public:
+    mmapstream(std::shared_ptr<const void> owner, const uint8_t *buf,
+               size_t length);
+    bool ended() override;
+    size_t read(uint8_t *, size_t) override;
+    size_t sizeHint() const override;
+
+    /// Unread bytes, valid while the stream exists
+    const uint8_t *data() const { return buf + off; }
+    size_t remaining() const { return length - off; }
+
+private:
+    std::shared_ptr<const void> owner;
+    const uint8_t *buf;
+    size_t length;
+    size_t off;
+};
+
 class diskstream : public bytestream
 {
 public:
@@ -146,12 +170,12 @@ private:
 
 #ifdef ORI_USE_LZMA
 
-class zipstream : public bytestream
+class lzmastream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
-    ~zipstream();
+    lzmastream(bytestream *source, bool compress = false, size_t size_hint = 0);
+    ~lzmastream();
     bool ended() override;
     size_t read(uint8_t *, size_t) override;
     size_t sizeHint() const override;
@@ -170,33 +194,64 @@ private:
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
-
+/*
+ * Block framed FastLZ stream.  The input is cut into blocks that are
+ * compressed independently, so either direction only buffers one block:
+ *
+ *   "OZB1" | block size
+ *   { raw length | stored length | stored bytes }*
+ *   0 | 0 | { block offset }* | block count
+ *
+ * All integers are 32-bit big endian.  ZIPSTREAM_RAWBLOCK in the stored
+ * length marks a block that did not compress.  The trailing offsets allow
+ * decompression to start at any block of a mapped input (see seek).
+ *
+ * Decompression also accepts the single block FastLZ format of older
+ * objects, a FastLZ block can never start with the magic.
+ */
 class zipstream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
     zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
     ~zipstream();
-    bool ended();
-    size_t read(uint8_t *, size_t);
-    size_t sizeHint() const;
+    bool ended() override;
+    size_t read(uint8_t *, size_t) override;
+    size_t sizeHint() const override;
     size_t inputConsumed() const;
+    /// Continue decompressing at offset off, requires an mmapstream source
+    bool seek(size_t off);
 
 private:
     bytestream *source;
     size_t size_hint;
-
     bool compress;
-    bool input_processed;
-    std::string input; // TODO
-    std::vector<uint8_t> output;
 
+    // Mapped input is used in place and allows seeking
+    const uint8_t *map;
+    size_t mapLength;
+    size_t consumed;
+    std::vector<uint8_t> input;
+
+    bool started;
+    bool legacy;
+    bool finished;
+    uint32_t blockSize;
+    std::vector<uint32_t> blockOffsets;
+    uint64_t produced;
+
+    std::vector<uint8_t> output;
     size_t offset;
     bool output_ended;
-};
 
-#endif /* ORI_USE_FASTLZ */
+    const uint8_t *fetch(size_t n);
+    bool fetchUInt32(uint32_t &val);
+    bool fillCompress();
+    bool fillDecompress();
+    bool decodeLegacy();
+    void putUInt32(uint32_t val);
+    void fail(const char *msg);
+};
 
 ////////////////////////////////
 // Writable streams
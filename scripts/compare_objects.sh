@@ -0,0 +1,19 @@
+# Usage: compare_objects.sh SRC DST
+# Checks that the repository at DST holds every object of the repository at
+# SRC.  Neither may be mounted.
+
+cd $1
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/objects_src.txt
+cd $2
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/objects_dst.txt
+
+comm -23 $TEMP_DIR/objects_src.txt $TEMP_DIR/objects_dst.txt \
+    > $TEMP_DIR/objects_missing.txt
+rm $TEMP_DIR/objects_src.txt $TEMP_DIR/objects_dst.txt
+
+if [ -s $TEMP_DIR/objects_missing.txt ]; then
+    echo "Objects missing from $2:"
+    cat $TEMP_DIR/objects_missing.txt
+    exit 1
+fi
+rm $TEMP_DIR/objects_missing.txt
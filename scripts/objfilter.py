@@ -0,0 +1,50 @@
+import struct
+import sys
+
+try:
+    from urllib.request import urlopen
+except ImportError:
+    from urllib2 import urlopen
+
+# Usage: objfilter.py URL < objects
+# Checks that the object filter served at URL holds every object listed on
+# stdin in the format of oridbg listobj.
+
+OBJFILTER_VERSION = 2
+OBJFILTER_PROBES = 7
+
+url = sys.argv[1]
+blob = urlopen(url).read()
+
+version, log2bits, probes, count = struct.unpack(">BBBQ", blob[:11])
+bits = bytearray(blob[11:])
+print("Filter version %d, 2^%d bits, %d probes, %d objects" %
+      (version, log2bits, probes, count))
+if version != OBJFILTER_VERSION or probes != OBJFILTER_PROBES:
+    print("Unsupported filter")
+    sys.exit(1)
+if len(bits) != (1 << log2bits) // 8:
+    print("Filter has the wrong size")
+    sys.exit(1)
+
+def may_contain(objid):
+    h = bytearray.fromhex(objid)
+    for i in range(probes):
+        # Each probe is a big endian word of the object hash
+        word = struct.unpack(">I", bytes(h[4 * i:4 * i + 4]))[0]
+        b = word & ((1 << log2bits) - 1)
+        if not bits[b // 8] & (1 << (b % 8)):
+            return False
+    return True
+
+objs = [l.split()[0] for l in sys.stdin if l.strip()]
+missing = [o for o in objs if not may_contain(o)]
+if len(missing) > 0:
+    print("Objects missing from the filter:")
+    print(missing)
+    sys.exit(1)
+if count < len(objs):
+    print("Filter counts %d objects, expected at least %d" %
+          (count, len(objs)))
+    sys.exit(1)
+print("All %d objects are in the filter" % len(objs))
@@ -0,0 +1,110 @@
+import socket
+import sys
+import threading
+
+# Usage: truncproxy.py PORT TARGETPORT LOG PATH:N...
+# Forwards HTTP requests from PORT to the server on TARGETPORT.  The Nth
+# response to a request for PATH is cut halfway through its body and the
+# connection is closed, as if the server had died mid-transfer.  Every cut
+# is recorded in LOG.
+
+port = int(sys.argv[1])
+target = int(sys.argv[2])
+logfile = sys.argv[3]
+cuts = {}
+for rule in sys.argv[4:]:
+    path, n = rule.rsplit(":", 1)
+    cuts.setdefault(path, set()).add(int(n))
+
+counts = {}
+lock = threading.Lock()
+
+class Reader:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b""
+
+    def fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise EOFError()
+        self.buf += data
+
+    def line(self):
+        while b"\r\n" not in self.buf:
+            self.fill()
+        l, self.buf = self.buf.split(b"\r\n", 1)
+        return l + b"\r\n"
+
+    def exact(self, n):
+        while len(self.buf) < n:
+            self.fill()
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+def read_message(r):
+    """Returns the head and the raw body of an HTTP message"""
+    head = r.line()
+    length = 0
+    chunked = False
+    while True:
+        l = r.line()
+        head += l
+        if l == b"\r\n":
+            break
+        name, value = l.decode().split(":", 1)
+        name = name.strip().lower()
+        if name == "content-length":
+            length = int(value)
+        elif name == "transfer-encoding" and "chunked" in value.lower():
+            chunked = True
+
+    if not chunked:
+        return head, r.exact(length)
+
+    body = b""
+    while True:
+        l = r.line()
+        body += l
+        n = int(l.split(b";")[0], 16)
+        body += r.exact(n + 2)
+        if n == 0:
+            return head, body
+
+def serve(client):
+    server = socket.create_connection(("127.0.0.1", target))
+    cr = Reader(client)
+    sr = Reader(server)
+    try:
+        while True:
+            head, body = read_message(cr)
+            path = head.split(b" ")[1].decode()
+            server.sendall(head + body)
+            rhead, rbody = read_message(sr)
+
+            with lock:
+                counts[path] = counts.get(path, 0) + 1
+                cut = counts[path] in cuts.get(path, set())
+                if cut:
+                    with open(logfile, "a") as f:
+                        f.write("cut %s %d after %d of %d bytes\n" %
+                                (path, counts[path], len(rbody) // 2,
+                                 len(rbody)))
+            if cut:
+                client.sendall(rhead + rbody[:len(rbody) // 2])
+                break
+            client.sendall(rhead + rbody)
+    except (EOFError, socket.error):
+        pass
+    client.close()
+    server.close()
+
+listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", port))
+listener.listen(8)
+while True:
+    client, addr = listener.accept()
+    t = threading.Thread(target=serve, args=(client,))
+    t.daemon = True
+    t.start()
@@ -24,6 +24,9 @@ cd ~/.ori/$TEST_FS2.ori
 $ORIDBG_EXE verify
 $ORIDBG_EXE stats
 
+# The pull left nothing behind
+bash -e $SCRIPTS/compare_objects.sh ~/.ori/$TEST_FS.ori ~/.ori/$TEST_FS2.ori
+
 cd $TEMP_DIR
 $ORI_EXE removefs $TEST_FS
 $ORI_EXE removefs $TEST_FS2
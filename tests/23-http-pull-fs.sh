@@ -0,0 +1,50 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+cp -R $SOURCE_FILES/a $SOURCE_FILES/file9.tst .
+ori snapshot
+cd ..
+$UMOUNT $TEST_FS
+
+# Objects are sent as chunked replies to /getmissing
+$ORI_HTTPD $TEST_FS &
+sleep 1
+$ORI_EXE replicate http://127.0.0.1:8080/ $TEST_FS2
+kill %1
+wait
+
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+cp -R $SOURCE_FILES/b .
+echo "Hello World" > tesfile.txt
+ori snapshot
+cd ..
+$UMOUNT $TEST_FS
+
+# The incremental pull offers the first snapshot as a have
+$ORI_HTTPD $TEST_FS &
+sleep 1
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+sleep 1
+cd $TEST_FS2
+ori pull
+cd ..
+$UMOUNT $TEST_FS2
+kill %1
+wait
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+# The pulls left nothing behind
+bash -e $SCRIPTS/compare_objects.sh ~/.ori/$TEST_FS.ori ~/.ori/$TEST_FS2.ori
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2